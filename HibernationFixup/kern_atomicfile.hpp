@@ -0,0 +1,59 @@
+//
+//  kern_atomicfile.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_atomicfile_hpp
+#define kern_atomicfile_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  Replacing a file so that an interrupted write never leaves a torn file behind.
+ *  File system access is provided by Vfs:
+ *    int  write(const char *path, const Chunk *chunks, size_t count, bool &flushed, uint64_t &flushTime)
+ *         creates or truncates the file, writes chunks and flushes the file (flushed is set on success)
+ *    bool canRename()
+ *    int  rename(const char *from, const char *to)
+ *    bool flushDirectory(const char *path, uint64_t &flushTime)
+ *         flushes the directory containing path, so that its entries (renames) are persistent
+ */
+namespace AtomicFile {
+	/**
+	 *  Part of file contents
+	 */
+	struct Chunk {
+		const void *data;
+		size_t      size;
+	};
+
+	/**
+	 *  Write chunks to temp, flush it, rename it to filename and flush the directory.
+	 *  Without rename filename is written in place.
+	 *
+	 *  @param flushed    set to true if the new contents are persistent, global sync is required otherwise
+	 *  @param flushTime  time spent flushing in nanoseconds
+	 *
+	 *  @return 0 on success, error code otherwise
+	 */
+	template <typename Vfs>
+	int write(Vfs &vfs, const char *filename, const char *temp, const Chunk *chunks, size_t count, bool &flushed, uint64_t &flushTime) {
+		if (vfs.canRename()) {
+			int error = vfs.write(temp, chunks, count, flushed, flushTime);
+			if (error == 0 && (error = vfs.rename(temp, filename)) == 0) {
+				// renamed file is found by its new name after a crash only if the directory is flushed
+				uint64_t directoryFlushTime = 0;
+				flushed = vfs.flushDirectory(filename, directoryFlushTime) && flushed;
+				flushTime += directoryFlushTime;
+				return 0;
+			}
+		}
+
+		return vfs.write(filename, chunks, count, flushed, flushTime);
+	}
+}
+
+#endif /* kern_atomicfile_hpp */
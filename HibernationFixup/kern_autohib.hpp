@@ -0,0 +1,291 @@
+//
+//  kern_autohib.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_autohib_hpp
+#define kern_autohib_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <IOKit/pwr_mgt/IOPM.h>
+
+#include "osx_defines.h"
+
+/**
+ *  Auto hibernation decision made in X86PlatformPlugin_sleepPolicyHandler.
+ *  Decision functions have no side effects and depend only on their input, so they are constexpr
+ *  and can be verified at compile time. The decision has two stages: gate decides whether hibernation
+ *  is allowed (and whether maintenance wake calendar has to be set), action is evaluated after
+ *  the maintenance wake calendar is set, since it depends on wakeCalendarSet.
+ */
+namespace AutoHibernate {
+	/**
+	 *  hbfx-ahbm bits which affect the decision
+	 */
+	struct Options {
+		bool    whenLidIsClosed                 {false};
+		bool    whenExternalPowerIsDisconnected {false};
+		bool    whenBatteryIsNotCharging        {false};
+		bool    whenBatteryIsAtWarnLevel        {false};
+		bool    whenBatteryAtCriticalLevel      {false};
+		bool    doNotOverrideWakeUpTime         {false};
+		uint8_t minimalRemainingCapacity        {0};
+	};
+
+	/**
+	 *  Power source and lid state captured once per evaluation, so that every branch (and log)
+	 *  sees the same values. batteryInstalled is false when there is no power source.
+	 */
+	struct PowerSnapshot {
+		bool batteryInstalled          {false};
+		bool externalConnected         {false};
+		bool charging                  {false};
+		bool atWarnLevel               {false};
+		bool atCriticalLevel           {false};
+		int  capacityPercentRemaining  {0};
+		bool lidIsOpen                 {false};
+	};
+
+	/**
+	 *  State of one power source (battery or UPS)
+	 */
+	struct PowerSourceState {
+		bool     batteryInstalled          {false};
+		bool     externalConnected         {false};
+		bool     charging                  {false};
+		bool     atWarnLevel               {false};
+		bool     atCriticalLevel           {false};
+		uint32_t currentCapacity           {0};
+		uint32_t maxCapacity               {0};
+		int      capacityPercentRemaining  {0};
+	};
+
+	/**
+	 *  Combine states of several power sources: external power is connected and battery is charging
+	 *  if it is true for any source, warning and critical levels are reached when every battery reached them.
+	 *  Remaining capacity is total current capacity relative to total maximal capacity, average of
+	 *  capacityPercentRemaining is used when some battery does not report its capacity.
+	 *  Lid state is not changed.
+	 */
+	constexpr PowerSnapshot aggregate(const PowerSourceState *sources, size_t count, PowerSnapshot snapshot = {}) {
+		uint64_t current = 0, maximum = 0;
+		int percentSum = 0, batteries = 0;
+		bool capacityKnown = true, warn = true, critical = true;
+		snapshot.batteryInstalled = snapshot.externalConnected = snapshot.charging = false;
+		for (size_t i = 0; i < count; i++) {
+			const PowerSourceState &source = sources[i];
+			snapshot.externalConnected |= source.externalConnected;
+			if (!source.batteryInstalled)
+				continue;
+			batteries++;
+			snapshot.charging |= source.charging;
+			warn &= source.atWarnLevel;
+			critical &= source.atCriticalLevel;
+			percentSum += source.capacityPercentRemaining;
+			if (source.maxCapacity == 0)
+				capacityKnown = false;
+			current += source.currentCapacity;
+			maximum += source.maxCapacity;
+		}
+
+		snapshot.batteryInstalled = batteries != 0;
+		snapshot.atWarnLevel = batteries != 0 && warn;
+		snapshot.atCriticalLevel = batteries != 0 && critical;
+		if (batteries == 0)
+			snapshot.capacityPercentRemaining = 0;
+		else if (capacityKnown)
+			snapshot.capacityPercentRemaining = static_cast<int>((current * 100 + maximum / 2) / maximum);
+		else
+			snapshot.capacityPercentRemaining = percentSum / batteries;
+		return snapshot;
+	}
+
+	/**
+	 *  Return true if battery related values of two snapshots are equal (lid state is ignored)
+	 */
+	constexpr bool sameBatteryState(const PowerSnapshot &a, const PowerSnapshot &b) {
+		return a.batteryInstalled == b.batteryInstalled && a.externalConnected == b.externalConnected &&
+			   a.charging == b.charging && a.atWarnLevel == b.atWarnLevel && a.atCriticalLevel == b.atCriticalLevel &&
+			   a.capacityPercentRemaining == b.capacityPercentRemaining;
+	}
+
+	struct GateInput {
+		Options    options;
+		PowerSnapshot power;
+		uint32_t   sleepPhase       {kIOPMSleepPhase0};
+		uint32_t   standbyDelay     {0};
+		bool       wakeCalendarSet  {false};
+		bool       sleepServiceWake {false};
+		bool       longSleepPredicted {false};  // sleep is expected to last longer than standby delay
+	};
+
+	enum class Reason {
+		None,
+		ExternalConnected,
+		Charging,
+		LidIsOpen,
+		WarnLevel,
+		CriticalLevel,
+		MinimalCapacity
+	};
+
+	struct Gate {
+		bool   proceed                {true};   // false: hibernation is not allowed, sleep is not altered
+		bool   forceHibernate         {false};
+		bool   clearSleepServiceWake  {false};
+		bool   setMaintenanceWake     {false};  // explicitlyCallSetMaintenanceWakeCalendar has to be called
+		Reason reason                 {Reason::None};
+	};
+
+	/**
+	 *  Return reason to force hibernation (or sleep) because of low battery, Reason::None otherwise
+	 */
+	constexpr Reason lowBattery(const Options &options, const PowerSnapshot &power) {
+		if (options.whenBatteryAtCriticalLevel && power.atCriticalLevel)
+			return Reason::CriticalLevel;
+		if (options.whenBatteryIsAtWarnLevel && power.atWarnLevel)
+			return Reason::WarnLevel;
+		if (options.minimalRemainingCapacity != 0 && power.capacityPercentRemaining <= options.minimalRemainingCapacity)
+			return Reason::MinimalCapacity;
+		return Reason::None;
+	}
+
+	/**
+	 *  Periodic capacity check (checkCapacity): return reason to put the system into sleep, Reason::None otherwise
+	 */
+	constexpr Reason evaluateCapacity(const Options &options, const PowerSnapshot &power) {
+		if (!power.batteryInstalled || power.externalConnected || power.charging)
+			return Reason::None;
+		return lowBattery(options, power);
+	}
+
+	constexpr Gate evaluateGate(const GateInput &in) {
+		Gate gate {};
+		const Options &options = in.options;
+		const PowerSnapshot &power = in.power;
+
+		if (power.batteryInstalled) {
+			if (options.whenExternalPowerIsDisconnected && power.externalConnected) {
+				gate.proceed = false;
+				gate.reason = Reason::ExternalConnected;
+			}
+			else if (options.whenBatteryIsNotCharging && power.charging) {
+				gate.proceed = false;
+				gate.reason = Reason::Charging;
+			}
+			else if (!power.charging) {
+				gate.reason = lowBattery(options, power);
+				gate.forceHibernate = gate.reason != Reason::None;
+			}
+		}
+
+		if (gate.proceed && !gate.forceHibernate && options.whenLidIsClosed && power.lidIsOpen) {
+			gate.proceed = false;
+			gate.reason = Reason::LidIsOpen;
+		}
+
+		if (in.sleepPhase > kIOPMSleepPhase0) {
+			if (!gate.proceed) {
+				gate.clearSleepServiceWake = true;
+				gate.setMaintenanceWake = in.standbyDelay != 0 && !in.wakeCalendarSet;
+			}
+			else
+				gate.setMaintenanceWake = in.standbyDelay != 0 && !gate.forceHibernate && !in.longSleepPredicted && !in.wakeCalendarSet && !in.sleepServiceWake;
+		}
+
+		return gate;
+	}
+
+	struct ActionInput {
+		bool     forceHibernate          {false};
+		bool     wakeCalendarSet         {false};
+		bool     sleepServiceWake        {false};
+		bool     doNotOverrideWakeUpTime {false};
+		uint32_t standbyDelay            {0};
+		uint32_t standbyTimer            {0};
+		uint32_t sleepPhase              {kIOPMSleepPhase0};
+		bool     longSleepPredicted      {false};
+	};
+
+	enum class Action {
+		None,          // sleep parameters are not altered
+		Cancel,        // macOS is responsible for standby (DoNotOverrideWakeUpTime), keep its decision
+		Standby,       // sleep phase 0/1: request standby with hibernate flag
+		HibernateNow,  // sleep phase 2: hibernate
+		Postpone       // sleep phase 2: restore sleep parameters saved at phase 0
+	};
+
+	struct Decision {
+		Action action         {Action::None};
+		bool   setupHibernate {false};
+		bool   resetWakeState {false};  // clear sleepServiceWake and wakeCalendarSet
+	};
+
+	constexpr Decision evaluateAction(const ActionInput &in) {
+		Decision decision {};
+		// long sleep prediction is opted in explicitly, it hibernates at once like forced hibernation
+		bool hibernateAtOnce = in.forceHibernate || in.longSleepPredicted;
+		decision.setupHibernate = hibernateAtOnce || !in.wakeCalendarSet || in.sleepServiceWake || in.standbyDelay == 0;
+
+		if (decision.setupHibernate && in.doNotOverrideWakeUpTime && !hibernateAtOnce && in.standbyTimer != 0)
+			decision.action = Action::Cancel;
+		else if (in.sleepPhase < kIOPMSleepPhase2 && decision.setupHibernate)
+			decision.action = Action::Standby;
+		else if (in.sleepPhase == kIOPMSleepPhase2) {
+			decision.action = decision.setupHibernate ? Action::HibernateNow : Action::Postpone;
+			decision.resetWakeState = true;
+		}
+
+		return decision;
+	}
+
+	/**
+	 *  Invariants of the decision
+	 */
+	constexpr bool hibernates(const Decision &decision) {
+		return decision.action == Action::Standby || decision.action == Action::HibernateNow;
+	}
+
+	constexpr GateInput batteryInput(bool externalConnected, bool charging, bool lidIsOpen, int capacity) {
+		GateInput in {};
+		in.options.whenLidIsClosed = true;
+		in.options.whenExternalPowerIsDisconnected = true;
+		in.options.whenBatteryIsNotCharging = true;
+		in.options.minimalRemainingCapacity = 10;
+		in.power.batteryInstalled = true;
+		in.power.externalConnected = externalConnected;
+		in.power.charging = charging;
+		in.power.lidIsOpen = lidIsOpen;
+		in.power.capacityPercentRemaining = capacity;
+		in.sleepPhase = kIOPMSleepPhase1;
+		in.standbyDelay = 3600;
+		return in;
+	}
+
+	static_assert(!evaluateGate(batteryInput(true, false, false, 5)).proceed, "never hibernate on external power with WhenExternalPowerIsDisconnected");
+	static_assert(!evaluateGate(batteryInput(false, true, false, 5)).proceed, "never hibernate while charging with WhenBatteryIsNotCharging");
+	static_assert(evaluateGate(batteryInput(false, false, true, 5)).forceHibernate, "low capacity forces hibernation even with open lid");
+	static_assert(!evaluateGate(batteryInput(false, false, true, 50)).proceed, "never hibernate with open lid with WhenLidIsClosed");
+	static_assert(evaluateGate(batteryInput(true, false, false, 50)).setMaintenanceWake, "blocked sleep keeps maintenance wake");
+	static_assert(!evaluateGate(batteryInput(false, false, false, 5)).setMaintenanceWake, "forced hibernation does not set maintenance wake");
+	static_assert(evaluateCapacity(batteryInput(false, false, true, 5).options, batteryInput(false, false, true, 5).power) == Reason::MinimalCapacity, "low capacity puts the system into sleep");
+	static_assert(evaluateCapacity(batteryInput(true, false, true, 5).options, batteryInput(true, false, true, 5).power) == Reason::None, "never sleep because of capacity on external power");
+	constexpr PowerSourceState twoBatteries[] {
+		{true, false, false, true,  false, 900,  5000, 18},
+		{true, false, true,  false, false, 2000, 4000, 50},
+		{false, true, false, false, false, 0,    0,    0}
+	};
+	static_assert(aggregate(twoBatteries, 2).capacityPercentRemaining == 32, "capacity is weighted by maximal capacity");
+	static_assert(aggregate(twoBatteries, 2).charging && !aggregate(twoBatteries, 2).atWarnLevel, "any battery charging, not every battery at warning level");
+	static_assert(aggregate(twoBatteries, 3).externalConnected && !aggregate(twoBatteries, 2).externalConnected, "UPS provides external power");
+	static_assert(!aggregate(twoBatteries + 2, 1).batteryInstalled && aggregate(twoBatteries, 1).atWarnLevel, "UPS without battery, single battery");
+	static_assert(evaluateAction({true, true, false, true, 3600, 60, kIOPMSleepPhase1}).action == Action::Standby, "forced hibernation ignores DoNotOverrideWakeUpTime");
+	static_assert(evaluateAction({false, true, false, false, 3600, 0, kIOPMSleepPhase2}).action == Action::Postpone, "maintenance wake postpones hibernation");
+	static_assert(evaluateAction({false, true, false, false, 3600, 0, kIOPMSleepPhase2}).resetWakeState, "phase 2 resets wake state");
+	static_assert(evaluateAction({false, true, false, false, 3600, 0, kIOPMSleepPhase0, true}).action == Action::Standby, "predicted long sleep hibernates at phase 0");
+}
+
+#endif /* kern_autohib_hpp */
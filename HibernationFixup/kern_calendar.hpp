@@ -0,0 +1,135 @@
+//
+//  kern_calendar.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_calendar_hpp
+#define kern_calendar_hpp
+
+#include <stdint.h>
+#include <IOKit/pwr_mgt/IOPM.h>
+
+#include "osx_defines.h"
+
+/**
+ *  Conversions between seconds since the epoch and calendar dates (UTC).
+ *  Everything is constexpr, so conversions can be verified at compile time.
+ */
+namespace Calendar {
+	static constexpr int64_t SecondsPerDay  = 86400;
+	static constexpr int64_t DaysPerEra     = 146097;   // 400 years
+	static constexpr int64_t EpochShift     = 719468;   // days from 0000-03-01 to 1970-01-01
+
+	/**
+	 *  Broken-down date, month and day are 1-based, weekday is 0 for Sunday
+	 */
+	struct Date {
+		int64_t  year    {1970};
+		uint8_t  month   {1};
+		uint8_t  day     {1};
+		uint8_t  hour    {0};
+		uint8_t  minute  {0};
+		uint8_t  second  {0};
+		uint8_t  weekday {4};
+		uint16_t yearDay {0};
+	};
+
+	constexpr bool isLeapYear(int64_t year) {
+		return ((year % 4 == 0) && (year % 100 != 0)) || (year % 400 == 0);
+	}
+
+	constexpr uint8_t daysInMonth(int64_t year, uint8_t month) {
+		return month == 2 ? (isLeapYear(year) ? 29 : 28) : ((month == 4 || month == 6 || month == 9 || month == 11) ? 30 : 31);
+	}
+
+	/**
+	 *  Number of days since 1970-01-01 for a civil date.
+	 *  Years are counted from March 1st, so February (with its leap day) is the last month of a year
+	 *  and the month lengths form a regular pattern (see H. Hinnant, chrono-Compatible Low-Level Date Algorithms).
+	 */
+	constexpr int64_t daysFromCivil(int64_t year, uint8_t month, uint8_t day) {
+		year -= (month <= 2);
+		const int64_t era = (year >= 0 ? year : year - 399) / 400;
+		const int64_t yoe = year - era * 400;                                          // [0, 399]
+		const int64_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;  // [0, 365]
+		const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;                     // [0, 146096]
+		return era * DaysPerEra + doe - EpochShift;
+	}
+
+	/**
+	 *  Civil date for a number of days since 1970-01-01
+	 */
+	constexpr Date civilFromDays(int64_t days) {
+		Date date {};
+		const int64_t shifted = days + EpochShift;
+		const int64_t era = (shifted >= 0 ? shifted : shifted - (DaysPerEra - 1)) / DaysPerEra;
+		const int64_t doe = shifted - era * DaysPerEra;                                // [0, 146096]
+		const int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;     // [0, 399]
+		const int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);                   // [0, 365]
+		const int64_t mp  = (5 * doy + 2) / 153;                                       // [0, 11]
+		date.day     = static_cast<uint8_t>(doy - (153 * mp + 2) / 5 + 1);
+		date.month   = static_cast<uint8_t>(mp < 10 ? mp + 3 : mp - 9);
+		date.year    = yoe + era * 400 + (date.month <= 2);
+		date.yearDay = static_cast<uint16_t>(doy >= 306 ? doy - 306 : doy + 59 + isLeapYear(date.year));
+		// 1970-01-01 was Thursday
+		date.weekday = static_cast<uint8_t>(days >= -4 ? (days + 4) % 7 : (days + 5) % 7 + 6);
+		return date;
+	}
+
+	constexpr Date fromSeconds(int64_t seconds) {
+		int64_t days = seconds / SecondsPerDay;
+		int64_t secs = seconds % SecondsPerDay;
+		if (secs < 0) {
+			secs += SecondsPerDay;
+			days--;
+		}
+
+		Date date = civilFromDays(days);
+		date.hour   = static_cast<uint8_t>(secs / 3600);
+		date.minute = static_cast<uint8_t>((secs / 60) % 60);
+		date.second = static_cast<uint8_t>(secs % 60);
+		return date;
+	}
+
+	constexpr int64_t toSeconds(int64_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second) {
+		return daysFromCivil(year, month, day) * SecondsPerDay + hour * 3600 + minute * 60 + second;
+	}
+
+	constexpr int64_t toSeconds(const Date &date) {
+		return toSeconds(date.year, date.month, date.day, date.hour, date.minute, date.second);
+	}
+
+	constexpr IOPMCalendarStruct toPMCalendar(int64_t seconds, UInt8 selector) {
+		const Date date = fromSeconds(seconds);
+		IOPMCalendarStruct calendar {};
+		calendar.year     = static_cast<UInt32>(date.year);
+		calendar.month    = date.month;
+		calendar.day      = date.day;
+		calendar.hour     = date.hour;
+		calendar.minute   = date.minute;
+		calendar.second   = date.second;
+		calendar.selector = selector;
+		return calendar;
+	}
+
+	constexpr int64_t fromPMCalendar(const IOPMCalendarStruct &calendar) {
+		return toSeconds(calendar.year, calendar.month, calendar.day, calendar.hour, calendar.minute, calendar.second);
+	}
+
+	constexpr bool roundTrips(int64_t seconds) {
+		return fromPMCalendar(toPMCalendar(seconds, 0)) == seconds && toSeconds(fromSeconds(seconds)) == seconds;
+	}
+
+	static_assert(daysFromCivil(1970, 1, 1) == 0, "epoch must be day 0");
+	static_assert(fromSeconds(0).weekday == 4, "1970-01-01 was Thursday");
+	static_assert(toSeconds(2000, 2, 29, 0, 0, 0) == 951782400, "leap day of a 400-year century");
+	static_assert(fromSeconds(951868800).month == 3 && fromSeconds(951868800).day == 1, "day after 2000-02-29");
+	static_assert(fromSeconds(1735689599).yearDay == 365 && fromSeconds(1735689599).second == 59, "last second of 2024");
+	static_assert(fromSeconds(-1).year == 1969 && fromSeconds(-1).hour == 23, "one second before the epoch");
+	static_assert(roundTrips(toSeconds(0, 1, 1, 0, 0, 0)), "smallest IOPMCalendarStruct year");
+	static_assert(roundTrips(toSeconds(UINT32_MAX, 12, 31, 23, 59, 59)), "largest IOPMCalendarStruct year");
+}
+
+#endif /* kern_calendar_hpp */
@@ -0,0 +1,164 @@
+//
+//  kern_config.cpp
+//  HibernationFixup
+//
+//  Copyright © 2017 lvs1974. All rights reserved.
+//
+
+#include <stddef.h>
+
+#include "kern_config.hpp"
+
+const Configuration::Option Configuration::options[OptionCount] {
+	{bootargDumpNvram,         NVRAM_PREFIX(LILU_READ_ONLY_GUID, "hbfx-dump-nvram"),        u"hbfx-dump-nvram",        Option::Flag,   BootArg,
+		sizeof(bool), sizeof(bool), offsetof(Configuration, dumpNvram), false},
+	{bootargCompressPanicInfo, NVRAM_PREFIX(LILU_READ_ONLY_GUID, "hbfx-compress-panic"),    u"hbfx-compress-panic",    Option::Flag,   BootArg,
+		sizeof(bool), sizeof(bool), offsetof(Configuration, compressPanicInfo), false},
+	{bootargPatchPCIWithList,  NVRAM_PREFIX(LILU_READ_ONLY_GUID, "hbfx-patch-pci"),         u"hbfx-patch-pci",         Option::String, BootArg,
+		4,            sizeof(ignored_device_list), offsetof(Configuration, ignored_device_list), 0},
+	{bootargDisablePatchPCI,   NVRAM_PREFIX(LILU_READ_ONLY_GUID, "hbfx-disable-patch-pci"), u"hbfx-disable-patch-pci", Option::Flag,   BootArg,
+		sizeof(bool), sizeof(bool), offsetof(Configuration, disablePatchPCI), false},
+	{bootargAutoHibernateMode, NVRAM_PREFIX(LILU_READ_ONLY_GUID, "hbfx-ahbm"),              u"hbfx-ahbm",              Option::Number, BootArg,
+		sizeof(int),  sizeof(int),  offsetof(Configuration, autoHibernateMode), 0}
+};
+
+static const char *sourceName[] {"default", "NVRAM variable", "boot-arg"};
+
+Configuration::Configuration() {
+	for (int id = 0; id < OptionCount; id++) {
+		const Option &option = options[id];
+		auto value = reinterpret_cast<uint8_t *>(this) + option.offset;
+		switch (option.type) {
+			case Option::Flag:
+				*reinterpret_cast<bool *>(value) = option.defaultValue != 0;
+				break;
+			case Option::String:
+				value[0] = '\0';
+				break;
+			case Option::Number:
+				*reinterpret_cast<int *>(value) = option.defaultValue;
+				break;
+		}
+	}
+}
+
+bool Configuration::isOffValue(const char *value) {
+	return strstr(value, "none") != nullptr || strstr(value, "false") != nullptr || strstr(value, "off") != nullptr;
+}
+
+bool Configuration::isWanted(OptionId id, Source from) const {
+	return isSupported(id) && (source[id] == Default || source[id] == from || options[id].precedence == from);
+}
+
+bool Configuration::isSupported(OptionId id) const {
+	// PCIFamily patching is required since macOS Sierra 10.12.1
+	if (id == PatchPCIWithList || id == DisablePatchPCI)
+		return (getKernelVersion() == KernelVersion::Sierra && getKernelMinorVersion() >= 1) ||
+			getKernelVersion() >= KernelVersion::HighSierra;
+	return true;
+}
+
+void Configuration::set(OptionId id, const void *data, size_t size, Source from) {
+	if (!isWanted(id, from))
+		return;
+
+	const Option &option = options[id];
+	auto value = reinterpret_cast<uint8_t *>(this) + option.offset;
+	switch (option.type) {
+		case Option::Flag:
+		case Option::Number:
+			if (size != option.size)
+				return;
+			lilu_os_memcpy(value, data, size);
+			DBGLOG("HBFX", "%s %s specified, value: %d", sourceName[from], option.bootarg,
+				   option.type == Option::Flag ? *static_cast<const bool *>(data) : *static_cast<const int *>(data));
+			break;
+		case Option::String: {
+			size_t length = min(size, option.size - 1);
+			lilu_os_memcpy(value, data, length);
+			value[length] = '\0';
+			DBGLOG("HBFX", "%s %s specified, value: %s", sourceName[from], option.bootarg, reinterpret_cast<const char *>(value));
+			break;
+		}
+	}
+	source[id] = from;
+}
+
+void Configuration::update() {
+	if (!isSupported(PatchPCIWithList)) {
+		patchPCIFamily = false;
+		DBGLOG("HBFX", "Running on Darwin %d.%d. Turn off PCIFamily patching since it is not required in this macOS version", getKernelVersion(), getKernelMinorVersion());
+	} else if (disablePatchPCI) {
+		patchPCIFamily = false;
+		DBGLOG("HBFX", "%s specified, turn off PCIFamily patching", bootargDisablePatchPCI);
+	} else if (isOffValue(ignored_device_list)) {
+		patchPCIFamily = false;
+		DBGLOG("HBFX", "Turn off PCIFamily patching since %s contains none, false or off", bootargPatchPCIWithList);
+	} else {
+		patchPCIFamily = true;
+	}
+}
+
+void Configuration::readArguments() {
+	for (int id = 0; id < OptionCount; id++) {
+		const Option &option = options[id];
+		if (!isWanted(static_cast<OptionId>(id), BootArg))
+			continue;
+
+		switch (option.type) {
+			case Option::Flag: {
+				bool value = true;
+				if (checkKernelArgument(option.bootarg))
+					set(static_cast<OptionId>(id), &value, sizeof(value), BootArg);
+				break;
+			}
+			case Option::String: {
+				char value[64] {};
+				if (PE_parse_boot_argn(option.bootarg, value, sizeof(value)))
+					set(static_cast<OptionId>(id), value, strlen(value), BootArg);
+				break;
+			}
+			case Option::Number: {
+				int value = 0;
+				if (PE_parse_boot_argn(option.bootarg, &value, sizeof(value)))
+					set(static_cast<OptionId>(id), &value, sizeof(value), BootArg);
+				break;
+			}
+		}
+	}
+	update();
+}
+
+uint32_t Configuration::readNVRAM(EfiRuntimeServices *rt, uint8_t *buf, size_t size) {
+	uint32_t calls = 0;
+	for (int id = 0; id < OptionCount; id++) {
+		const Option &option = options[id];
+		if (!isWanted(static_cast<OptionId>(id), NVRAM) || option.size > size)
+			continue;
+
+		uint32_t attr = 0;
+		uint64_t length = option.size;
+		auto status = rt->getVariable(option.efi, &EfiRuntimeServices::LiluReadOnlyGuid, &attr, &length, buf);
+		calls++;
+		if (status == EFI_ERROR64(EFI_NOT_FOUND))
+			continue;
+		if (status != EFI_SUCCESS) {
+			DBGLOG("HBFX", "Failed to read efi rt services for %s, error code: 0x%llx", option.bootarg, static_cast<unsigned long long>(status));
+			continue;
+		}
+
+		bool valid = (option.type == Option::String) ? length >= option.minSize : length == option.size;
+		if (!valid) {
+			SYSLOG("HBFX", "Unexpected size of %s = %llu", option.bootarg, static_cast<unsigned long long>(length));
+			continue;
+		}
+
+		// string variables may include terminating null
+		if (option.type == Option::String)
+			length = strnlen(reinterpret_cast<const char *>(buf), static_cast<size_t>(length));
+		set(static_cast<OptionId>(id), buf, static_cast<size_t>(length), NVRAM);
+	}
+	update();
+
+	return calls;
+}
@@ -9,6 +9,10 @@
 #define kern_config_private_h
 
 #include <Headers/kern_util.hpp>
+#include <Headers/kern_nvram.hpp>
+#include <Headers/kern_efi.hpp>
+
+class IORegistryEntry;
 
 class Configuration {
 public:
@@ -19,30 +23,107 @@ public:
 	static const char *bootargDebug[];
 	static const char *bootargBeta[];
 	static constexpr const char *bootargDumpNvram         {"-hbfx-dump-nvram"};          // write NVRAM to file
+	static constexpr const char *bootargCompressPanicInfo {"-hbfx-compress-panic"};      // compress panic info written to NVRAM
 	static constexpr const char *bootargPatchPCIWithList  {"hbfx-patch-pci"};            // patch pci family ignored device list
 	static constexpr const char *bootargDisablePatchPCI   {"-hbfx-disable-patch-pci"};   // disable patch pci family
 	static constexpr const char *bootargAutoHibernateMode {"hbfx-ahbm"};                 // auto hibernate mode
 
+	/**
+	 *  Options which can be specified by boot-args or NVRAM variables (LiluReadOnlyGuid)
+	 */
+	enum OptionId {
+		DumpNvram,
+		CompressPanicInfo,
+		PatchPCIWithList,
+		DisablePatchPCI,
+		AutoHibernateMode,
+		OptionCount
+	};
+
+	/**
+	 *  Where an option value comes from
+	 */
+	enum Source : uint8_t {
+		Default,
+		NVRAM,
+		BootArg
+	};
+
+	struct Option {
+		enum Type : uint8_t {
+			Flag,     // boot-arg without value, Boolean NVRAM variable, bool value
+			String,   // boot-arg with string value, String NVRAM variable, null-terminated char array
+			Number    // boot-arg with integer value, Number (Data) NVRAM variable, int value
+		};
+		const char     *bootarg;
+		const char     *nvram;        // NVRAM key with LiluReadOnlyGuid prefix
+		const char16_t *efi;          // EFI variable name
+		Type            type;
+		Source          precedence;   // source which wins when the option is specified by boot-args and NVRAM
+		uint8_t         minSize;      // minimal EFI variable size (including terminating null for String)
+		uint8_t         size;         // value size in Configuration and NVRAM
+		uint16_t        offset;       // value offset in Configuration
+		int             defaultValue; // Flag and Number default, String defaults to empty
+	};
+
+	/**
+	 *  Option descriptors, defined in kern_config.cpp
+	 */
+	static const Option options[OptionCount];
+
 public:
 	/**
 	 *  Retrieve boot arguments
 	 */
 	void readArguments();
 
+	/**
+	 *  Read options from NVRAM registry entry (/options)
+	 */
+	void readNVRAM(IORegistryEntry *entry);
+
+	/**
+	 *  Read options using EFI runtime services in one pass over option descriptors.
+	 *  Lilu provides no variable enumeration, options which can't change are not requested.
+	 *
+	 *  @param rt    EFI runtime services
+	 *  @param buf   temporary buffer
+	 *  @param size  buffer size
+	 *
+	 *  @return amount of runtime service calls
+	 */
+	uint32_t readNVRAM(EfiRuntimeServices *rt, uint8_t *buf, size_t size);
+
+	/**
+	 *  Source of every option value
+	 */
+	Source source[OptionCount] {};
+
 	/**
 	 *  dump nvram to /nvram.plist
 	 */
-	bool dumpNvram {false};
+	bool dumpNvram;
 
 	/**
-	 *  patch PCI Family
+	 *  compress panic info before splitting it into AAPL,PanicInfo%04d variables
+	 */
+	bool compressPanicInfo;
+
+	/**
+	 *  patch PCI Family, turned off by disablePatchPCI, by none, false or off in ignored_device_list
+	 *  and on macOS versions which do not need it
 	 */
 	bool patchPCIFamily {true};
 
+	/**
+	 *  do not patch PCI Family
+	 */
+	bool disablePatchPCI;
+
 	/**
 	 *  device list (can be separated by comma, space or something like that)
 	 */
-	char ignored_device_list[64] {};
+	char ignored_device_list[64];
 	
 	/* Flags used to control automatic hibernation behavior (takes place only when system goes to sleep)
 	 */
@@ -70,12 +151,51 @@ public:
 		RemainCapacityBit1                      = 256,
 		RemainCapacityBit2                      = 512,
 		RemainCapacityBit3                      = 1024,
-		RemainCapacityBit4                      = 2048
+		RemainCapacityBit4                      = 2048,
+		
+		// Learn sleep durations per weekday and hour, hibernate at once (without waking up after standby delay)
+		// when the sleep is expected to last longer than standby delay. Requires EnableAutoHibernation
+		HibernateLongSleeps                     = 4096
 	};
 	
-	int autoHibernateMode {0};
+	int autoHibernateMode;
+
+	/**
+	 *  Set default values of all options
+	 */
+	Configuration();
+
+private:
+	/**
+	 *  Return true if a value from the source can change the option
+	 *  (the option has its default value or the source has precedence)
+	 */
+	bool isWanted(OptionId id, Source from) const;
 
-	Configuration() = default;
+	/**
+	 *  Whether option can be used on current macOS version
+	 */
+	bool isSupported(OptionId id) const;
+
+	/**
+	 *  Set option value unless a source with precedence has set it
+	 *
+	 *  @param id    option
+	 *  @param data  bool for Flag, characters (not necessarily null-terminated) for String, int for Number
+	 *  @param size  data size
+	 *  @param from  value source
+	 */
+	void set(OptionId id, const void *data, size_t size, Source from);
+
+	/**
+	 *  Update values which depend on several options
+	 */
+	void update();
+
+	/**
+	 *  Return true if string value contains none, false or off
+	 */
+	static bool isOffValue(const char *value);
 };
 
 extern Configuration ADDPR(hbfx_config);
@@ -0,0 +1,208 @@
+//
+//  kern_devset.cpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#include <Headers/kern_util.hpp>
+#include <Headers/kern_compat.hpp>
+
+#include "kern_devset.hpp"
+
+//==============================================================================
+
+size_t DeviceNameSet::parse(const char *list)
+{
+	entries = 0;
+	while (list && *list)
+	{
+		while (*list && isSeparator(*list))
+			list++;
+
+		const char *start = list;
+		while (*list && !isSeparator(*list))
+			list++;
+
+		size_t length = static_cast<size_t>(list - start);
+		if (length == 0)
+			continue;
+
+		if (length >= MaxNameLength || entries >= MaxNames)
+		{
+			SYSLOG("HBFX", "DeviceNameSet: device %.*s is ignored", static_cast<int>(length), start);
+			continue;
+		}
+
+		Entry &current = entry[entries];
+		lilu_os_memcpy(current.name, start, length);
+		current.name[length] = '\0';
+		current.hash = hash(current.name, current.length);
+
+		// keep entries sorted by hash (insertion sort, the list is tiny)
+		size_t pos = entries++;
+		Entry inserted = current;
+		while (pos > 0 && entry[pos - 1].hash > inserted.hash)
+		{
+			entry[pos] = entry[pos - 1];
+			pos--;
+		}
+		entry[pos] = inserted;
+	}
+
+	return entries;
+}
+
+//==============================================================================
+
+bool DeviceNameSet::contains(const char *name) const
+{
+	if (!name || entries == 0)
+		return false;
+
+	uint32_t length;
+	uint32_t value = hash(name, length);
+
+	size_t low = 0, high = entries;
+	while (low < high)
+	{
+		size_t mid = (low + high) / 2;
+		if (entry[mid].hash < value)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	for (; low < entries && entry[low].hash == value; low++)
+		if (entry[low].length == length && memcmp(entry[low].name, name, length) == 0)
+			return true;
+
+	return false;
+}
+
+//==============================================================================
+
+uint32_t DeviceNameSet::hash(const char *name, uint32_t &length)
+{
+	uint32_t value = 0x811C9DC5;
+	length = 0;
+	while (name[length])
+	{
+		value ^= static_cast<uint8_t>(name[length++]);
+		value *= 0x01000193;
+	}
+	return value;
+}
+
+//==============================================================================
+
+bool DeviceDecisionCache::init()
+{
+	if (!lock)
+		lock = IOSimpleLockAlloc();
+	if (!lock)
+		SYSLOG("HBFX", "DeviceDecisionCache: failed to allocate lock");
+	return lock != nullptr;
+}
+
+//==============================================================================
+
+void DeviceDecisionCache::deinit()
+{
+	if (lock)
+	{
+		IOSimpleLockFree(lock);
+		lock = nullptr;
+	}
+	for (size_t i = 0; i < Capacity; i++)
+		slot[i] = {};
+	used = 0;
+	counters = {};
+}
+
+//==============================================================================
+
+size_t DeviceDecisionCache::find(const void *device) const
+{
+	for (size_t i = home(device), probes = 0; probes < Capacity; i = (i + 1) & (Capacity - 1), probes++)
+	{
+		if (slot[i].device == device)
+			return i;
+		if (slot[i].device == nullptr)
+			break;
+	}
+	return Capacity;
+}
+
+//==============================================================================
+
+bool DeviceDecisionCache::lookup(const void *device, bool &decision)
+{
+	if (!lock || !device)
+		return false;
+
+	IOSimpleLockLock(lock);
+	size_t i = find(device);
+	bool found = i != Capacity;
+	if (found)
+	{
+		decision = slot[i].decision;
+		counters.hits++;
+	}
+	else
+		counters.misses++;
+	IOSimpleLockUnlock(lock);
+	return found;
+}
+
+//==============================================================================
+
+void DeviceDecisionCache::insert(const void *device, bool decision)
+{
+	if (!lock || !device)
+		return;
+
+	IOSimpleLockLock(lock);
+	size_t i = find(device);
+	if (i == Capacity && used < Capacity)
+	{
+		i = home(device);
+		while (slot[i].device != nullptr)
+			i = (i + 1) & (Capacity - 1);
+		slot[i].device = device;
+		used++;
+	}
+	if (i != Capacity)
+		slot[i].decision = decision;
+	IOSimpleLockUnlock(lock);
+}
+
+//==============================================================================
+
+void DeviceDecisionCache::remove(const void *device)
+{
+	if (!lock || !device)
+		return;
+
+	IOSimpleLockLock(lock);
+	size_t i = find(device);
+	if (i != Capacity)
+	{
+		// Backward shift deletion: move following entries of the probe sequence into the hole
+		slot[i] = {};
+		used--;
+		counters.invalidations++;
+		for (size_t j = (i + 1) & (Capacity - 1); slot[j].device != nullptr; j = (j + 1) & (Capacity - 1))
+		{
+			size_t h = home(slot[j].device);
+			// entry at j can be moved to i if i lies cyclically in [h, j)
+			if (((j - h) & (Capacity - 1)) >= ((j - i) & (Capacity - 1)))
+			{
+				slot[i] = slot[j];
+				slot[j] = {};
+				i = j;
+			}
+		}
+	}
+	IOSimpleLockUnlock(lock);
+}
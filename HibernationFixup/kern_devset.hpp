@@ -0,0 +1,136 @@
+//
+//  kern_devset.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_devset_hpp
+#define kern_devset_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <IOKit/IOLocks.h>
+
+/**
+ *  Set of device names parsed from a list like "XHC,IMEI,IGPU".
+ *  Names are matched exactly, the set is sorted by name hash, so a lookup
+ *  is one hash calculation, a binary search and one comparison.
+ */
+class DeviceNameSet {
+public:
+	/**
+	 *  Maximum amount of names and name length (including terminating null)
+	 */
+	static constexpr size_t MaxNames      = 24;
+	static constexpr size_t MaxNameLength = 32;
+
+	/**
+	 *  Build the set from a list of names separated by any other characters (commas, spaces, semicolons, '|')
+	 *
+	 *  @param list  device list, can be empty
+	 *
+	 *  @return amount of names in the set
+	 */
+	size_t parse(const char *list);
+
+	/**
+	 *  Return true if the set contains exactly this name
+	 */
+	bool contains(const char *name) const;
+
+	bool empty() const { return entries == 0; }
+	size_t count() const { return entries; }
+
+private:
+	struct Entry {
+		uint32_t hash;
+		uint32_t length;
+		char     name[MaxNameLength];
+	};
+
+	/**
+	 *  Device names consist of letters, digits and underscores, anything else separates them
+	 */
+	static bool isSeparator(char c) {
+		return !((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_');
+	}
+
+	/**
+	 *  FNV-1a, length is calculated as well
+	 */
+	static uint32_t hash(const char *name, uint32_t &length);
+
+	Entry entry[MaxNames] {};
+	size_t entries {0};
+};
+
+/**
+ *  Decisions made for particular devices (IOService pointers), so that a device
+ *  is matched against DeviceNameSet only once. Open addressing with linear probing,
+ *  entries must be removed when a device terminates, since its address can be reused.
+ */
+class DeviceDecisionCache {
+public:
+	/**
+	 *  Amount of slots, must be a power of two. A full table makes every miss probe all slots,
+	 *  so it has room for large PCI trees (a few hundred devices).
+	 */
+	static constexpr size_t Capacity = 256;
+
+	bool init();
+	void deinit();
+
+	/**
+	 *  Find cached decision
+	 *
+	 *  @param device    device pointer
+	 *  @param decision  cached decision
+	 *
+	 *  @return true if the device was found
+	 */
+	bool lookup(const void *device, bool &decision);
+
+	/**
+	 *  Cache decision, nothing is cached when the table is full
+	 */
+	void insert(const void *device, bool decision);
+
+	/**
+	 *  Forget decision made for this device
+	 */
+	void remove(const void *device);
+
+	/**
+	 *  Cache counters
+	 */
+	struct Stats {
+		uint32_t hits;
+		uint32_t misses;
+		uint32_t invalidations;
+	};
+	const Stats &stats() const { return counters; }
+
+private:
+	struct Slot {
+		const void *device;
+		bool        decision;
+	};
+
+	static size_t home(const void *device) {
+		auto value = reinterpret_cast<uintptr_t>(device);
+		return static_cast<size_t>((value >> 4) ^ (value >> 10)) & (Capacity - 1);
+	}
+
+	/**
+	 *  Return slot index of the device or Capacity, called with lock held
+	 */
+	size_t find(const void *device) const;
+
+	Slot slot[Capacity] {};
+	size_t used {0};
+	Stats counters {};
+	IOSimpleLock *lock {nullptr};
+};
+
+#endif /* kern_devset_hpp */
@@ -0,0 +1,144 @@
+//
+//  kern_discharge.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_discharge_hpp
+#define kern_discharge_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ *  Predicts when battery capacity reaches a threshold from recent (time, capacity) samples.
+ *  Discharge rate is a Theil-Sen estimate (median of pairwise slopes), so single outliers
+ *  and 1% capacity steps do not disturb it. Does not depend on kernel headers.
+ */
+class DischargePredictor {
+public:
+	static constexpr size_t   MaxSamples        = 12;
+	static constexpr uint64_t MinSampleInterval = 60;    // seconds, samples with unchanged capacity are not stored more often
+	static constexpr uint64_t MaxSampleGap      = 900;   // seconds, longer gap (sleep) resets the samples
+
+	void reset() {
+		count = 0;
+		next = 0;
+	}
+
+	/**
+	 *  Add a sample taken while the battery is discharging
+	 *
+	 *  @param time      wall clock time in seconds
+	 *  @param capacity  remaining capacity in percent
+	 */
+	void add(uint64_t time, int capacity) {
+		if (count > 0) {
+			const Sample &last = sample[(next + MaxSamples - 1) % MaxSamples];
+			if (time < last.time || time - last.time > MaxSampleGap || capacity > last.capacity)
+				reset();
+			else if (capacity == last.capacity && time - last.time < MinSampleInterval)
+				return;
+		}
+
+		sample[next] = {time, capacity};
+		next = (next + 1) % MaxSamples;
+		if (count < MaxSamples)
+			count++;
+	}
+
+	size_t samples() const { return count; }
+
+	/**
+	 *  Estimate seconds left until capacity drops to threshold
+	 *
+	 *  @param threshold  capacity in percent
+	 *  @param now        wall clock time in seconds
+	 *  @param seconds    estimated time left, 0 if the threshold is already reached
+	 *
+	 *  @return false if there are not enough samples or the battery is not discharging
+	 */
+	bool timeToThreshold(int threshold, uint64_t now, uint64_t &seconds) const {
+		if (count < 3)
+			return false;
+
+		const uint64_t origin = oldest().time;
+
+		// slope in millionths of percent per second
+		int64_t slopes[MaxSamples * (MaxSamples - 1) / 2];
+		size_t slopeCount = 0;
+		for (size_t i = 0; i < count; i++) {
+			for (size_t j = i + 1; j < count; j++) {
+				const Sample &a = at(i), &b = at(j);
+				if (b.time != a.time)
+					slopes[slopeCount++] = (static_cast<int64_t>(b.capacity) - a.capacity) * Scale / static_cast<int64_t>(b.time - a.time);
+			}
+		}
+
+		if (slopeCount == 0)
+			return false;
+		int64_t slope = median(slopes, slopeCount);
+		if (slope >= 0)
+			return false;
+
+		// capacity at origin, median of intercepts through every sample
+		int64_t intercepts[MaxSamples];
+		for (size_t i = 0; i < count; i++)
+			intercepts[i] = static_cast<int64_t>(at(i).capacity) * Scale - slope * static_cast<int64_t>(at(i).time - origin);
+		int64_t intercept = median(intercepts, count);
+
+		int64_t crossing = (static_cast<int64_t>(threshold) * Scale - intercept) / slope;
+		int64_t elapsed = now > origin ? static_cast<int64_t>(now - origin) : 0;
+		seconds = crossing > elapsed ? static_cast<uint64_t>(crossing - elapsed) : 0;
+		return true;
+	}
+
+	/**
+	 *  Return delay of the next capacity check: 3/4 of the time left until predicted threshold crossing
+	 *  (so that checks get denser when the crossing is close), clamped to [minimum, maximum],
+	 *  fallback when the crossing can't be predicted
+	 */
+	uint64_t nextCheckDelay(int threshold, uint64_t now, uint64_t minimum, uint64_t maximum, uint64_t fallback) const {
+		// capacity is reported in whole percents, aim at the step above threshold
+		uint64_t seconds;
+		if (!timeToThreshold(threshold + 1, now, seconds))
+			return fallback;
+		seconds = seconds * 3 / 4;
+		if (seconds < minimum)
+			return minimum;
+		return seconds > maximum ? maximum : seconds;
+	}
+
+private:
+	static constexpr int64_t Scale = 1000000;
+
+	struct Sample {
+		uint64_t time;
+		int      capacity;
+	};
+
+	const Sample &oldest() const { return at(0); }
+
+	// i-th sample from the oldest one
+	const Sample &at(size_t i) const {
+		return sample[(next + MaxSamples - count + i) % MaxSamples];
+	}
+
+	static int64_t median(int64_t *values, size_t size) {
+		for (size_t i = 1; i < size; i++) {
+			int64_t value = values[i];
+			size_t j = i;
+			for (; j > 0 && values[j - 1] > value; j--)
+				values[j] = values[j - 1];
+			values[j] = value;
+		}
+		return size % 2 ? values[size / 2] : (values[size / 2 - 1] + values[size / 2]) / 2;
+	}
+
+	Sample sample[MaxSamples] {};
+	size_t count {0};
+	size_t next {0};
+};
+
+#endif /* kern_discharge_hpp */
@@ -8,6 +8,7 @@
 #include <IOKit/IOService.h>
 #include <IOKit/pwr_mgt/RootDomain.h>
 #include <IOKit/IOTimerEventSource.h>
+#include <libkern/OSAtomic.h>
 
 #include <Headers/kern_api.hpp>
 #include <Headers/kern_efi.hpp>
@@ -19,6 +20,7 @@
 
 #include "kern_config.hpp"
 #include "kern_hbfx.hpp"
+#include "kern_calendar.hpp"
 
 #include <kern/clock.h>
 #include "gmtime.h"
@@ -26,6 +28,14 @@
 
 #define FILE_NVRAM_NAME                 "/nvram.plist"
 #define BACKUP_FILE_NVRAM_NAME          "/System/Volumes/Data/nvram.plist"
+#define kHBFXStatisticsKey              "HBFX Statistics"
+#define kSleepHistoryKey                NVRAM_PREFIX(LILU_VENDOR_GUID, "hbfx-sleep-history")
+
+// minimal interval (seconds) between writes of learned sleep durations to NVRAM
+#define SLEEP_HISTORY_SAVE_INTERVAL     21600
+
+// interval of IOPMPowerSource registration retries
+#define POWER_SOURCE_RETRY_MS           10000
 
 // Only used in apple-driven callbacks
 static HBFX *callbackHBFX = nullptr;
@@ -45,7 +55,10 @@ static KernelPatcher::KextInfo kextList[] {
 bool HBFX::init()
 {
 	callbackHBFX = this;
+	nvstorageInit.lock.handle = IOLockAlloc();
+	powerSources.lock.handle = IOLockAlloc();
 	readConfigFromNVRAM();
+	patchedDevices.parse(ADDPR(hbfx_config).ignored_device_list);
 
 	lilu.onPatcherLoadForce(
 	[](void *user, KernelPatcher &patcher) {
@@ -65,21 +78,77 @@ bool HBFX::init()
 
 void HBFX::deinit()
 {
+	releasePanicArena();
+	releasePreArm();
+	if (pciTerminationNotifier)
+	{
+		pciTerminationNotifier->remove();
+		pciTerminationNotifier = nullptr;
+	}
+	patchDecisions.deinit();
+	if (rootDomainNotifier)
+	{
+		rootDomainNotifier->remove();
+		rootDomainNotifier = nullptr;
+	}
+	if (powerSourceRetryTimer)
+		powerSourceRetryTimer->cancelTimeout();
+	if (powerSourcePublishNotifier)
+	{
+		powerSourcePublishNotifier->remove();
+		powerSourcePublishNotifier = nullptr;
+	}
+	if (powerSourceTerminateNotifier)
+	{
+		powerSourceTerminateNotifier->remove();
+		powerSourceTerminateNotifier = nullptr;
+	}
+	powerSources.clear([](IOPMPowerSource *source, IONotifier *interest) {
+		if (interest)
+			interest->remove();
+		source->release();
+	});
+	if (powerSources.lock.handle)
+	{
+		IOLockFree(powerSources.lock.handle);
+		powerSources.lock.handle = nullptr;
+	}
+	if (restoreStatsLock)
+	{
+		// devices were retained when they were added to restore statistics
+		for (size_t i = 0; i < restoreStats.count(); i++)
+			static_cast<const OSObject *>(restoreStats.device(i).device)->release();
+		IOSimpleLockFree(restoreStatsLock);
+		restoreStatsLock = nullptr;
+	}
+	hibernateBatch.reset();
+	OSSafeReleaseNULL(statistics);
+	nvramDump.deinit();
 	nvstorage.deinit();
+	nvstorageInit.reset();
+	if (nvstorageInit.lock.handle)
+	{
+		IOLockFree(nvstorageInit.lock.handle);
+		nvstorageInit.lock.handle = nullptr;
+	}
 }
 
 //==============================================================================
 
 IOReturn HBFX::IOHibernateSystemSleep(void)
 {
+	uint64_t entry_time, work_time, exit_time;
+	clock_get_uptime(&entry_time);
+
 	IOReturn result = FunctionCast(IOHibernateSystemSleep, callbackHBFX->orgIOHibernateSystemSleep)();
+	clock_get_uptime(&work_time);
 	
 #ifdef DEBUG
 	struct timeval tv;
 	struct tm tm;
 	microtime(&tv);
 	gmtime_r(tv.tv_sec, &tm);
-	DBGLOG("HBFX", "%02d.%02d.%04d %02d:%02d:%02d: IOHibernateSystemSleep is called, result is: 0x%x", tm.tm_mday, tm.tm_mon, tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec, result);
+	DBGLOG("HBFX", "%02d.%02d.%04d %02d:%02d:%02d: IOHibernateSystemSleep is called, result is: 0x%x", tm.tm_mday, tm.tm_mon + 1, tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec, result);
 #endif
 
 	uint32_t ioHibernateState = kIOHibernateStateInactive;
@@ -88,58 +157,80 @@ IOReturn HBFX::IOHibernateSystemSleep(void)
 	
 	if (result == KERN_SUCCESS || ioHibernateState == kIOHibernateStateHibernating)
 	{
-		if (!callbackHBFX->checkRTCExtendedMemory())
+		// Everything which does not depend on IOHibernateSystemSleep results is normally prepared at sleep phase 0
+		bool preArmed = callbackHBFX->completePreArm();
+		PreArmState &preArm = callbackHBFX->preArm;
+		callbackHBFX->updateStatistic(preArmed ? "PreArmHits" : "PreArmMisses", 1, true);
+		callbackHBFX->updateStatistic("PreArmTimeUS", preArm.duration / 1000);
+		callbackHBFX->updateStatistic("RTCProbes", callbackHBFX->rtcBank.probes());
+
+		if (!preArm.rtcExtendedMemory)
 		{
-			if (!callbackHBFX->initializeNVStorage())
-				return result;
-			
-			OSData *rtc = OSDynamicCast(OSData, IOService::getPMRootDomain()->getProperty(kIOHibernateRTCVariablesKey));
-			if (rtc && !callbackHBFX->nvstorage.exists(kIOHibernateRTCVariablesKey))
-			{
-				if (!callbackHBFX->nvstorage.write(kIOHibernateRTCVariablesKey, rtc, NVStorage::OptRaw))
-					SYSLOG("HBFX", "IOHibernateRTCVariablesKey can't be written to NVRAM.");
-			}
-			
-			OSData *smc = OSDynamicCast(OSData, IOService::getPMRootDomain()->getProperty(kIOHibernateSMCVariablesKey));
-			if (smc && !callbackHBFX->nvstorage.exists(kIOHibernateSMCVariablesKey))
-			{
-				if (!callbackHBFX->nvstorage.write(kIOHibernateSMCVariablesKey, smc, NVStorage::OptRaw))
-					SYSLOG("HBFX", "IOHibernateSMCVariablesKey can't be written to NVRAM.");
-			}
+			// without NVStorage nothing can be written, statistics are still published below
+			if (preArm.nvstorageReady)
+				callbackHBFX->commitHibernateVariables();
+			else
+				SYSLOG("HBFX", "NVStorage is not ready, IOHibernateRTCVariables can't be written to NVRAM");
 		}
 
-		if (ADDPR(hbfx_config).dumpNvram && callbackHBFX->initializeNVStorage())
+		if (ADDPR(hbfx_config).dumpNvram && preArm.nvstorageReady)
 		{
+			// Boot0082 and BootNext are written by IOHibernateSystemSleep, so they are read after it
+			NVRAMDump::Variable bootVariables[2] {};
+			size_t bootVariableCount = 0;
 			uint32_t size;
 			if (uint8_t *buf = callbackHBFX->nvstorage.read(kGlobalBoot0082Key, size, NVStorage::OptRaw))
-			{
-				if (!callbackHBFX->nvstorage.write(kBoot0082Key, buf, size, NVStorage::OptRaw))
-					SYSLOG("HBFX", "%s can't be written!", kBoot0082Key);
-				Buffer::deleter(buf);
-			}
+				bootVariables[bootVariableCount++] = {kBoot0082Key, buf, size};
 			else
 				SYSLOG("HBFX", "Variable %s can't be found!", kBoot0082Key);
 
 			if (uint8_t *buf = callbackHBFX->nvstorage.read(kGlobalBootNextKey, size, NVStorage::OptRaw))
-			{
-				if (!callbackHBFX->nvstorage.write(kBootNextKey, buf, size, NVStorage::OptRaw))
-					SYSLOG("HBFX", "%s can't be written!", kBootNextKey);
-				Buffer::deleter(buf);
-			}
+				bootVariables[bootVariableCount++] = {kBootNextKey, buf, size};
 			else
 				SYSLOG("HBFX", "Variable %s can't be found!", kBootNextKey);
 
-			if (!callbackHBFX->nvstorage.save(FILE_NVRAM_NAME))
-				callbackHBFX->nvstorage.save(BACKUP_FILE_NVRAM_NAME);
+			// The dump was prepared at phase 0, so only variables changed since then (RTC/SMC variables) are serialized here
+			NVRAMDump &dump = callbackHBFX->nvramDump;
+			bool flushed = false;
+			uint64_t flush_time = 0;
+			bool built = dump.init() && dump.build(bootVariables, bootVariableCount);
+			for (size_t i = 0; i < bootVariableCount; i++)
+				Buffer::deleter(const_cast<uint8_t *>(bootVariables[i].data));
 
-			if (callbackHBFX->sync)
-				callbackHBFX->sync(kernproc, nullptr, nullptr);
+			if (built)
+			{
+				if (dump.save(FILE_NVRAM_NAME) || dump.save(BACKUP_FILE_NVRAM_NAME))
+				{
+					flushed = dump.flushed();
+					flush_time = dump.flushTime();
+				}
+			}
+			else if (!callbackHBFX->nvstorage.save(FILE_NVRAM_NAME))
+				callbackHBFX->nvstorage.save(BACKUP_FILE_NVRAM_NAME);
 
-			callbackHBFX->nvstorage.remove(kBoot0082Key);
-			callbackHBFX->nvstorage.remove(kBootNextKey);
+			if (!flushed)
+			{
+				flush_time += callbackHBFX->globalSync();
+				callbackHBFX->updateStatistic("DumpSyncFallbacks", 1, true);
+			}
+			callbackHBFX->updateStatistic("DumpFlushUS", flush_time / 1000);
+			DBGLOG("HBFX", "nvram dump was flushed in %llu us (%s)", flush_time / 1000, flushed ? "fsync" : "sync");
 		}
+
+		callbackHBFX->cancelPreArm();
 	}
 
+	uint64_t entry_ns, work_ns, exit_ns;
+	clock_get_uptime(&exit_time);
+	absolutetime_to_nanoseconds(entry_time, &entry_ns);
+	absolutetime_to_nanoseconds(exit_time, &exit_ns);
+	absolutetime_to_nanoseconds(exit_time - work_time, &work_ns);
+	callbackHBFX->updateStatistic("SystemSleepEntryNS", entry_ns);
+	callbackHBFX->updateStatistic("SystemSleepExitNS", exit_ns);
+	callbackHBFX->updateStatistic("SystemSleepWorkUS", work_ns / 1000);
+	callbackHBFX->publishStatistics();
+	DBGLOG("HBFX", "IOHibernateSystemSleep: HBFX work took %llu us", work_ns / 1000);
+
 	return result;
 }
 
@@ -159,7 +250,20 @@ IOReturn HBFX::IOHibernateSystemWake(void)
 	callbackHBFX->sleepFlags          = 0;
 	
 	IOReturn result = FunctionCast(IOHibernateSystemWake, callbackHBFX->orgIOHibernateSystemWake)();
-	DBGLOG("HBFX", "IOHibernateSystemWake is called, result is: 0x%x", result);
+
+	// hibernate state is published by IOHibernateSystemWake, read it after the call
+	uint32_t ioHibernateState = kIOHibernateStateInactive;
+	WIOKit::getOSDataValue(IOService::getPMRootDomain(), kIOHibernateStateKey, ioHibernateState);
+	DBGLOG("HBFX", "IOHibernateSystemWake is called, result is: 0x%x, hibernate state: %d", result, ioHibernateState);
+
+	// RTC could be reinitialized by firmware while waking from hibernation, probe it again during next sleep (at phase 0).
+	// Hibernating means the state left by IOHibernateSystemSleep was not updated, the image could have been restored as well.
+	if (ioHibernateState == kIOHibernateStateWakingFromHibernate || ioHibernateState == kIOHibernateStateHibernating)
+		callbackHBFX->rtcBank.invalidate();
+
+	if (callbackHBFX->preArmTimer)
+		callbackHBFX->preArmTimer->cancelTimeout();
+	callbackHBFX->cancelPreArm();
 	
 	OSString * wakeType = OSDynamicCast(OSString, IOService::getPMRootDomain()->getProperty(kIOPMRootDomainWakeTypeKey));
 #ifdef DEBUG
@@ -172,10 +276,7 @@ IOReturn HBFX::IOHibernateSystemWake(void)
 	if (callbackHBFX->nextSleepTimer)
 		callbackHBFX->nextSleepTimer->cancelTimeout();
 	
-	if (callbackHBFX->checkCapacityTimer) {
-		callbackHBFX->checkCapacityTimer->cancelTimeout();
-		callbackHBFX->checkCapacityTimer->setTimeoutMS(60000);
-	}
+	callbackHBFX->restartCapacityCheck();
 	
 	if (wakeType)
 	{
@@ -186,11 +287,17 @@ IOReturn HBFX::IOHibernateSystemWake(void)
 			DBGLOG("HBFX", "IOHibernateSystemWake: Maintenance/SleepService wake");
 			uint32_t standby_delay = 0;
 			bool pmset_default_mode = false;
-			if (callbackHBFX->isStandbyEnabled(IOService::getPMRootDomain(), standby_delay, pmset_default_mode) && pmset_default_mode && callbackHBFX->nextSleepTimer)
+			if (callbackHBFX->isStandbyEnabled(standby_delay, pmset_default_mode) && pmset_default_mode && callbackHBFX->nextSleepTimer)
 				callbackHBFX->nextSleepTimer->setTimeoutMS(20000);
 		}
 	}
 	
+	// dark wakes are a part of the sleep, the next sleep phase 0 predicts its remaining duration again,
+	// the sleep ends with a user wake, dark wakes become full wakes in requestFullWake or evaluatePolicy
+	callbackHBFX->longSleepPredicted = false;
+	if (wakeType && (wakeType->isEqualTo(kIOPMRootDomainWakeTypeUser) || wakeType->isEqualTo(kIOPMRootDomainWakeTypeHIDActivity)))
+		callbackHBFX->endSleepSession();
+	
 	return result;
 }
 
@@ -206,6 +313,10 @@ void HBFX::IOPMrootDomain_evaluatePolicy(IOPMrootDomain* that, int stimulus, uin
 	}
 #endif
 	
+	// user became active, the sleep is over
+	if (stimulus == kStimulusEnterUserActiveState)
+		callbackHBFX->endSleepSession();
+
 	auto autoHibernateMode = ADDPR(hbfx_config).autoHibernateMode;
 	if (autoHibernateMode & Configuration::DisableStimulusDarkWakeActivityTickle) {
 		if (stimulus == kStimulusDarkWakeActivityTickle) {
@@ -236,14 +347,12 @@ void HBFX::IOPMrootDomain_requestFullWake(IOPMrootDomain* that, uint32_t reason)
 		callbackHBFX->sleepReason         = 0;
 		callbackHBFX->sleepType           = 0;
 		callbackHBFX->sleepFlags          = 0;
+		callbackHBFX->endSleepSession();
 		
 		if (callbackHBFX->nextSleepTimer)
 			callbackHBFX->nextSleepTimer->cancelTimeout();
 		
-		if (callbackHBFX->checkCapacityTimer) {
-			callbackHBFX->checkCapacityTimer->cancelTimeout();
-			callbackHBFX->checkCapacityTimer->setTimeoutMS(60000);
-		}
+		callbackHBFX->restartCapacityCheck();
 	}
 }
 
@@ -264,21 +373,15 @@ IOReturn HBFX::IOPMrootDomain_setMaintenanceWakeCalendar(IOPMrootDomain* that, c
 	uint32_t standby_delay = 0;
 	bool pmset_default_mode = false;
 	callbackHBFX->wakeCalendarSet = false;
-	if (callbackHBFX->isStandbyEnabled(that, standby_delay, pmset_default_mode) && pmset_default_mode && standby_delay != 0)
+	if (callbackHBFX->isStandbyEnabled(standby_delay, pmset_default_mode) && pmset_default_mode && standby_delay != 0)
 	{
-		struct tm tm;
 		struct timeval tv;
 		microtime(&tv);
-		
-		gmtime_r(tv.tv_sec, &tm);
-		DBGLOG("HBFX", "Current time: %02d.%02d.%04d %02d:%02d:%02d", tm.tm_mday, tm.tm_mon, tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec);
 
-        tv.tv_sec += standby_delay;
-		gmtime_r(tv.tv_sec, &tm);
-		DBGLOG("HBFX", "Postpone maintenance wake to: %02d.%02d.%04d %02d:%02d:%02d", tm.tm_mday, tm.tm_mon, tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec);
+		IOPMCalendarStruct overriden_calendar = Calendar::toPMCalendar(tv.tv_sec + standby_delay, calendar->selector);
+		DBGLOG("HBFX", "Postpone maintenance wake by %u seconds to: %02d.%02d.%04d %02d:%02d:%02d", standby_delay, overriden_calendar.day,
+			   overriden_calendar.month, overriden_calendar.year, overriden_calendar.hour, overriden_calendar.minute, overriden_calendar.second);
 
-		IOPMCalendarStruct overriden_calendar { static_cast<UInt32>(tm.tm_year), static_cast<UInt8>(tm.tm_mon), static_cast<UInt8>(tm.tm_mday),
-												static_cast<UInt8>(tm.tm_hour), static_cast<UInt8>(tm.tm_min), static_cast<UInt8>(tm.tm_sec), calendar->selector };
 		result = FunctionCast(IOPMrootDomain_setMaintenanceWakeCalendar, callbackHBFX->orgIOPMrootDomain_setMaintenanceWakeCalendar)(that, &overriden_calendar);
 		callbackHBFX->wakeCalendarSet = (result == KERN_SUCCESS);
 	}
@@ -303,20 +406,18 @@ IOReturn HBFX::AppleRTC_setupDateTimeAlarm(void *that, void* rtcDateTime)
 	if (pmRootDomain) {
 		uint32_t standby_delay = 0;
 		bool pmset_default_mode = false;
-		if (callbackHBFX->isStandbyEnabled(pmRootDomain, standby_delay, pmset_default_mode) && pmset_default_mode && standby_delay != 0)
+		if (callbackHBFX->isStandbyEnabled(standby_delay, pmset_default_mode) && pmset_default_mode && standby_delay != 0)
 		{
-			struct tm tm;
 			struct timeval tv;
 			microtime(&tv);
-			
-			gmtime_r(tv.tv_sec, &tm);
-			DBGLOG("HBFX", "Current time: %02d.%02d.%04d %02d:%02d:%02d", tm.tm_mday, tm.tm_mon, tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec);
-
 			tv.tv_sec += standby_delay;
-			gmtime_r(tv.tv_sec, &tm);
-			DBGLOG("HBFX", "Postpone RTC wake to: %02d.%02d.%04d %02d:%02d:%02d", tm.tm_mday, tm.tm_mon, tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec);
-			
+
 			callbackHBFX->convertSecondsToDateTime(tv.tv_sec, rtcDateTime);
+#ifdef DEBUG
+			IOPMCalendarStruct postponed = Calendar::toPMCalendar(tv.tv_sec, 0);
+			DBGLOG("HBFX", "Postpone RTC wake by %u seconds to: %02d.%02d.%04d %02d:%02d:%02d", standby_delay,
+				   postponed.day, postponed.month, postponed.year, postponed.hour, postponed.minute, postponed.second);
+#endif
 		}
 	}
 	else
@@ -329,8 +430,6 @@ IOReturn HBFX::AppleRTC_setupDateTimeAlarm(void *that, void* rtcDateTime)
 
 IOReturn HBFX::X86PlatformPlugin_sleepPolicyHandler(void * target, IOPMSystemSleepPolicyVariables * vars, IOPMSystemSleepParameters * params)
 {
-	bool forceHibernate = false;
-	
 	IOReturn result = FunctionCast(X86PlatformPlugin_sleepPolicyHandler, callbackHBFX->orgX86PlatformPlugin_sleepPolicyHandler)(target, vars, params);
 	if (result != KERN_SUCCESS)
 	{
@@ -355,6 +454,13 @@ IOReturn HBFX::X86PlatformPlugin_sleepPolicyHandler(void * target, IOPMSystemSle
 		callbackHBFX->sleepReason  = vars->sleepReason;
 		callbackHBFX->sleepType    = params->sleepType;
 		callbackHBFX->sleepFlags   = params->sleepFlags;
+		callbackHBFX->schedulePreArm();
+		callbackHBFX->beginSleepSession();
+		
+		// without root domain messages pmset changes since the previous sleep are not known
+		if (!callbackHBFX->rootDomainNotifier)
+			callbackHBFX->storePMSettings(0, PMSettings::Valid);
+		callbackHBFX->updateStatistic("PMLookupsAvoided", static_cast<UInt32>(OSBitAndAtomic(0, reinterpret_cast<volatile UInt32 *>(&callbackHBFX->pmLookupsAvoided))));
 	}
 	
 	if (callbackHBFX->nextSleepTimer)
@@ -362,81 +468,61 @@ IOReturn HBFX::X86PlatformPlugin_sleepPolicyHandler(void * target, IOPMSystemSle
 
 	uint32_t standby_delay = 0;
 	bool pmset_default_mode = false;
-	auto autoHibernateMode = ADDPR(hbfx_config).autoHibernateMode;
-	while (callbackHBFX->isStandbyEnabled(IOService::getPMRootDomain(), standby_delay, pmset_default_mode) && pmset_default_mode &&
+	while (callbackHBFX->isStandbyEnabled(standby_delay, pmset_default_mode) && pmset_default_mode &&
 		   (params->sleepType == kIOPMSleepTypeDeepIdle || params->sleepType == kIOPMSleepTypeStandby || params->sleepType == kIOPMSleepTypeNormalSleep))
 	{
-		IOPMPowerSource *power_source = callbackHBFX->getPowerSource();
-		if (power_source && power_source->batteryInstalled()) {
-			bool whenExternalPowerIsDisconnected = (autoHibernateMode & Configuration::WhenExternalPowerIsDisconnected);
-			bool whenBatteryIsNotCharging   = (autoHibernateMode & Configuration::WhenBatteryIsNotCharging);
-			bool whenBatteryIsAtWarnLevel   = (autoHibernateMode & Configuration::WhenBatteryIsAtWarnLevel);
-			bool whenBatteryAtCriticalLevel = (autoHibernateMode & Configuration::WhenBatteryAtCriticalLevel);
-			int  minimalRemainingCapacity   = ((autoHibernateMode & 0xF00) >> 8);
-
-			if (whenExternalPowerIsDisconnected && power_source->externalConnected()) {
+		AutoHibernate::GateInput input {};
+		input.options              = autoHibernateOptions();
+		input.power                = callbackHBFX->capturePowerSnapshot();
+		input.sleepPhase           = callbackHBFX->sleepPhase;
+		input.standbyDelay         = standby_delay;
+		input.wakeCalendarSet      = callbackHBFX->wakeCalendarSet;
+		input.sleepServiceWake     = callbackHBFX->sleepServiceWake;
+		if (input.sleepPhase == kIOPMSleepPhase0)
+			callbackHBFX->longSleepPredicted = callbackHBFX->predictLongSleep(standby_delay);
+		input.longSleepPredicted   = callbackHBFX->longSleepPredicted;
+
+		AutoHibernate::Gate gate = AutoHibernate::evaluateGate(input);
+		switch (gate.reason) {
+			case AutoHibernate::Reason::ExternalConnected:
 				DBGLOG("HBFX", "Auto hibernate: external is connected, do not force to hibernate");
-				if (callbackHBFX->sleepPhase > kIOPMSleepPhase0)
-				{
-					callbackHBFX->sleepServiceWake = false;
-					if (standby_delay != 0 && !callbackHBFX->wakeCalendarSet && callbackHBFX->sleepPhase > kIOPMSleepPhase0)
-						callbackHBFX->explicitlyCallSetMaintenanceWakeCalendar();
-				}
 				break;
-			}
-
-			if (whenBatteryIsNotCharging && power_source->isCharging()) {
+			case AutoHibernate::Reason::Charging:
 				DBGLOG("HBFX", "Auto hibernate: battery is charging, do not force to hibernate");
-				if (callbackHBFX->sleepPhase > kIOPMSleepPhase0)
-				{
-					callbackHBFX->sleepServiceWake = false;
-					if (standby_delay != 0 && !callbackHBFX->wakeCalendarSet && callbackHBFX->sleepPhase > kIOPMSleepPhase0)
-						callbackHBFX->explicitlyCallSetMaintenanceWakeCalendar();
-				}
 				break;
-			}
-
-			if (!power_source->isCharging())
-			{
-				DBGLOG("HBFX", "Auto hibernate: warning level = %d, critical level = %d, capacity remaining = %d, minimal capacity = %d",
-					   power_source->atWarnLevel(), power_source->atCriticalLevel(),
-					   power_source->capacityPercentRemaining(), minimalRemainingCapacity);
-				if (whenBatteryIsAtWarnLevel && power_source->atWarnLevel()) {
-					DBGLOG("HBFX", "Auto hibernate: Battery is at warning level, capacity remaining: %d, force to hibernate", power_source->capacityPercentRemaining());
-					forceHibernate = true;
-				}
-
-				if (whenBatteryAtCriticalLevel && power_source->atCriticalLevel()) {
-					DBGLOG("HBFX", "Auto hibernate: battery is at critical level, capacity remaining: %d, force to hibernate", power_source->capacityPercentRemaining());
-					forceHibernate = true;
-				}
-
-				if (!forceHibernate && minimalRemainingCapacity != 0 && power_source->capacityPercentRemaining() <= minimalRemainingCapacity)
-				{
-					DBGLOG("HBFX", "Auto hibernate: capacity remaining: %d less than minimal: %d, force to hibernate", power_source->capacityPercentRemaining(), minimalRemainingCapacity);
-					forceHibernate = true;
-				}
-			}
+			case AutoHibernate::Reason::LidIsOpen:
+				DBGLOG("HBFX", "Auto hibernate: clamshell is open, do not force to hibernate");
+				break;
+			case AutoHibernate::Reason::WarnLevel:
+			case AutoHibernate::Reason::CriticalLevel:
+			case AutoHibernate::Reason::MinimalCapacity:
+				DBGLOG("HBFX", "Auto hibernate: battery is at %s, capacity remaining: %d, force to hibernate",
+					   gate.reason == AutoHibernate::Reason::WarnLevel ? "warning level" :
+					   gate.reason == AutoHibernate::Reason::CriticalLevel ? "critical level" : "minimal capacity",
+					   input.power.capacityPercentRemaining);
+				break;
+			default:
+				break;
 		}
 
-		bool whenLidIsClosed = (autoHibernateMode & Configuration::WhenLidIsClosed);
-		bool lidIsOpen = OSDynamicCast(OSBoolean, IOService::getPMRootDomain()->getProperty(kAppleClamshellStateKey)) != kOSBooleanTrue;
-		if (!forceHibernate && whenLidIsClosed && lidIsOpen) {
-			DBGLOG("HBFX", "Auto hibernate: clamshell is open, do not force to hibernate");
-			if (callbackHBFX->sleepPhase > kIOPMSleepPhase0)
-			{
-				callbackHBFX->sleepServiceWake = false;
-				if (standby_delay != 0 && !callbackHBFX->wakeCalendarSet && callbackHBFX->sleepPhase > kIOPMSleepPhase0)
-					callbackHBFX->explicitlyCallSetMaintenanceWakeCalendar();
-			}
+		if (gate.clearSleepServiceWake)
+			callbackHBFX->sleepServiceWake = false;
+		if (gate.setMaintenanceWake)
+			callbackHBFX->explicitlyCallSetMaintenanceWakeCalendar();
+		if (!gate.proceed)
 			break;
-		}
 
-		if (callbackHBFX->sleepPhase > kIOPMSleepPhase0)
-		{
-			if (standby_delay != 0 && !forceHibernate && !callbackHBFX->wakeCalendarSet && !callbackHBFX->sleepServiceWake)
-				callbackHBFX->explicitlyCallSetMaintenanceWakeCalendar();
-		}
+		// setMaintenanceWakeCalendar updates wakeCalendarSet, so the action is evaluated with current values
+		AutoHibernate::ActionInput actionInput {};
+		actionInput.forceHibernate          = gate.forceHibernate;
+		actionInput.wakeCalendarSet         = callbackHBFX->wakeCalendarSet;
+		actionInput.sleepServiceWake        = callbackHBFX->sleepServiceWake;
+		actionInput.doNotOverrideWakeUpTime = input.options.doNotOverrideWakeUpTime;
+		actionInput.standbyDelay            = standby_delay;
+		actionInput.standbyTimer            = vars->standbyTimer;
+		actionInput.sleepPhase              = callbackHBFX->sleepPhase;
+		actionInput.longSleepPredicted      = input.longSleepPredicted;
+		AutoHibernate::Decision decision = AutoHibernate::evaluateAction(actionInput);
 
 #ifdef DEBUG
 		struct timeval current_time;
@@ -445,62 +531,51 @@ IOReturn HBFX::X86PlatformPlugin_sleepPolicyHandler(void * target, IOPMSystemSle
 		gmtime_r(current_time.tv_sec, &tm);
 #endif
 		
-		bool doNotOverrideWakeUpTime = (ADDPR(hbfx_config).autoHibernateMode & Configuration::DoNotOverrideWakeUpTime);
-		bool setupHibernate = (forceHibernate || !callbackHBFX->wakeCalendarSet || callbackHBFX->sleepServiceWake || standby_delay == 0);
-		if (setupHibernate && doNotOverrideWakeUpTime && !forceHibernate)
+		if (decision.action == AutoHibernate::Action::Cancel)
 		{
-			if (vars->standbyTimer != 0)
-			{
-				DBGLOG("HBFX", "%02d.%02d.%04d %02d:%02d:%02d: Auto hibernate: %d seconds to standby, cancel hibernate",
-					   tm.tm_mday, tm.tm_mon, tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec, vars->standbyTimer);
-				return result;
-			}
-			else
-			{
-				DBGLOG("HBFX", "%02d.%02d.%04d %02d:%02d:%02d: Auto hibernate: %d seconds to standby, enable hibernate",
-					   tm.tm_mday, tm.tm_mon, tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec, vars->standbyTimer);
-			}
+			DBGLOG("HBFX", "%02d.%02d.%04d %02d:%02d:%02d: Auto hibernate: %d seconds to standby, cancel hibernate",
+				   tm.tm_mday, tm.tm_mon + 1, tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec, vars->standbyTimer);
+			return result;
 		}
 
 		DBGLOG("HBFX", "Auto hibernate: setupHibernate %d, wakeCalendarSet %d, sleepServiceWake %d, standby_delay %d",
-			   setupHibernate, callbackHBFX->wakeCalendarSet, callbackHBFX->sleepServiceWake, standby_delay);
+			   decision.setupHibernate, callbackHBFX->wakeCalendarSet, callbackHBFX->sleepServiceWake, standby_delay);
 
-		if ((callbackHBFX->sleepPhase < kIOPMSleepPhase2) && setupHibernate)
-		{
-			vars->sleepFactors = callbackHBFX->sleepFactors;
-			vars->sleepReason  = callbackHBFX->sleepReason;
-			params->sleepType  = kIOPMSleepTypeStandby;
-			params->sleepFlags = kIOPMSleepFlagHibernate;
-			DBGLOG("HBFX", "%02d.%02d.%04d %02d:%02d:%02d: Auto hibernate: sleep phase %d, set hibernate values",
-				   tm.tm_mday, tm.tm_mon, tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec, callbackHBFX->sleepPhase);
-		}
-		else if (callbackHBFX->sleepPhase == kIOPMSleepPhase2)
-		{
-			if (setupHibernate)
-			{
+		switch (decision.action) {
+			case AutoHibernate::Action::Standby:
+				vars->sleepFactors = callbackHBFX->sleepFactors;
+				vars->sleepReason  = callbackHBFX->sleepReason;
+				params->sleepType  = kIOPMSleepTypeStandby;
+				params->sleepFlags = kIOPMSleepFlagHibernate;
+				DBGLOG("HBFX", "%02d.%02d.%04d %02d:%02d:%02d: Auto hibernate: sleep phase %d, set hibernate values",
+					   tm.tm_mday, tm.tm_mon + 1, tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec, callbackHBFX->sleepPhase);
+				break;
+			case AutoHibernate::Action::HibernateNow:
 				vars->sleepFactors = callbackHBFX->sleepFactors;
 				vars->sleepReason  = callbackHBFX->sleepReason;
 				params->sleepType  = kIOPMSleepTypeHibernate;
 				params->sleepFlags = kIOPMSleepFlagHibernate;
 				DBGLOG("HBFX", "%02d.%02d.%04d %02d:%02d:%02d: Auto hibernate: sleep phase %d, hibernate now",
-					   tm.tm_mday, tm.tm_mon, tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec, callbackHBFX->sleepPhase);
-			}
-			else
-			{
+					   tm.tm_mday, tm.tm_mon + 1, tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec, callbackHBFX->sleepPhase);
+				break;
+			case AutoHibernate::Action::Postpone:
 				vars->sleepFactors = callbackHBFX->sleepFactors;
 				vars->sleepReason  = callbackHBFX->sleepReason;
 				params->sleepType  = callbackHBFX->sleepType;
 				params->sleepFlags = callbackHBFX->sleepFlags;
 				DBGLOG("HBFX", "%02d.%02d.%04d %02d:%02d:%02d: Auto hibernate: sleep phase %d, postpone hibernate",
-					   tm.tm_mday, tm.tm_mon, tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec, callbackHBFX->sleepPhase);
-			}
-			
-			callbackHBFX->sleepServiceWake = false;
-			callbackHBFX->wakeCalendarSet  = false;
+					   tm.tm_mday, tm.tm_mon + 1, tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec, callbackHBFX->sleepPhase);
+				break;
+			default:
+				if (gate.forceHibernate)
+					DBGLOG("HBFX", "%02d.%02d.%04d %02d:%02d:%02d: Auto hibernate: force hibernate...", tm.tm_mday, tm.tm_mon + 1, tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+				break;
 		}
-		else if (forceHibernate)
+
+		if (decision.resetWakeState)
 		{
-			DBGLOG("HBFX", "%02d.%02d.%04d %02d:%02d:%02d: Auto hibernate: force hibernate...", tm.tm_mday, tm.tm_mon, tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec);
+			callbackHBFX->sleepServiceWake = false;
+			callbackHBFX->wakeCalendarSet  = false;
 		}
 		break;
 	}
@@ -513,6 +588,15 @@ IOReturn HBFX::X86PlatformPlugin_sleepPolicyHandler(void * target, IOPMSystemSle
 int HBFX::packA(char *inbuf, uint32_t length, uint32_t buflen)
 {
 	char key[128];
+	// packing is done in place, raw text is kept for compression
+	PanicArena &arena = callbackHBFX->panicArena;
+	arena.rawSize = 0;
+	if (arena.raw && !arena.used && length > 0 && length <= PanicChunks::InfoSize)
+	{
+		lilu_os_memcpy(arena.raw, inbuf, length);
+		arena.rawSize = length;
+	}
+
 	unsigned int bufpos = 0;
 	if (callbackHBFX->orgPackA)
 		bufpos = FunctionCast(packA, callbackHBFX->orgPackA)(inbuf, length, buflen);
@@ -532,22 +616,60 @@ int HBFX::packA(char *inbuf, uint32_t length, uint32_t buflen)
 				IOSleep(1);
 			}
 
-			if (callbackHBFX->preemption_enabled() && callbackHBFX->initializeNVStorage())
+			if (callbackHBFX->preemption_enabled())
 			{
+				uint64_t start_time, end_time, elapsed_ns;
+				clock_get_uptime(&start_time);
+
 				unsigned int pi_size = bufpos ? bufpos : length;
-				const unsigned int max_size = 768;
-				counter = 0;
-				while (pi_size > 0)
+				const char *key_format = PanicInfo::RawKeyFormat;
+				uint32_t compressed_size = 0;
+				const char *compressed = callbackHBFX->compressPanicInfo(pi_size, compressed_size);
+				if (compressed)
+				{
+					inbuf = const_cast<char *>(compressed);
+					pi_size = compressed_size;
+					key_format = PanicInfo::CompressedKeyFormat;
+				}
+
+				bool flushed = false;
+				uint64_t flush_time = 0;
+				bool written = callbackHBFX->writePanicInfoFromArena(inbuf, pi_size, compressed != nullptr, flushed, flush_time);
+				if (!written && callbackHBFX->initializeNVStorage(false))
 				{
-					unsigned int part_size = (pi_size > max_size) ? max_size : pi_size;
-					snprintf(key, sizeof(key), "AAPL,PanicInfo%04d", counter++);
-					callbackHBFX->nvstorage.write(key, reinterpret_cast<const uint8_t*>(inbuf), part_size, NVStorage::OptRaw);
-					pi_size -= part_size;
-					inbuf += part_size;
+					const unsigned int max_size = callbackHBFX->panicInfoChunkSize();
+					NVBatch &batch = callbackHBFX->panicBatch;
+					batch.reset();
+					auto stage = [&](uint32_t chunk, const char *data, uint32_t size) {
+						snprintf(key, sizeof(key), key_format, chunk);
+						return batch.stage(key, reinterpret_cast<const uint8_t *>(data), size);
+					};
+					uint32_t chunks = PanicChunks::split(inbuf, pi_size, max_size, static_cast<uint32_t>(batch.capacity()), stage);
+					if (static_cast<uint64_t>(chunks) * max_size < pi_size)
+						SYSLOG("HBFX", "panic info is truncated to %u chunks", chunks);
+
+					// chunks written before a failure are kept, truncated panic info is still useful
+					if (!batch.commit(callbackHBFX->nvstorage))
+						SYSLOG("HBFX", "panic info can't be written to NVRAM completely");
+
+					NVRAMDump &dump = callbackHBFX->nvramDump;
+					if (dump.init() && dump.build() && dump.save(FILE_NVRAM_NAME))
+					{
+						flushed = dump.flushed();
+						flush_time = dump.flushTime();
+					}
+					else
+						callbackHBFX->nvstorage.save(FILE_NVRAM_NAME);
+					written = true;
 				}
 
-				callbackHBFX->nvstorage.save(FILE_NVRAM_NAME);
-				callbackHBFX->sync(kernproc, nullptr, nullptr);
+				if (written && !flushed)
+					flush_time += callbackHBFX->globalSync();
+				DBGLOG("HBFX", "panic info was flushed in %llu us (%s)", flush_time / 1000, flushed ? "fsync" : "sync");
+
+				clock_get_uptime(&end_time);
+				absolutetime_to_nanoseconds(end_time - start_time, &elapsed_ns);
+				DBGLOG("HBFX", "panic info was stored in %llu us", elapsed_ns / 1000);
 			}
 
 			if (!preemption_enabled)
@@ -562,24 +684,80 @@ int HBFX::packA(char *inbuf, uint32_t length, uint32_t buflen)
 
 //==============================================================================
 
+IOReturn HBFX::IODTNVRAM_setPropertyInternal(IORegistryEntry *that, const OSSymbol *key, OSObject *value)
+{
+	IOReturn result = FunctionCast(IODTNVRAM_setPropertyInternal, callbackHBFX->orgIODTNVRAM_setPropertyInternal)(that, key, value);
+	callbackHBFX->nvramDump.invalidate(key);
+	return result;
+}
+
+//==============================================================================
+
+IOReturn HBFX::IODTNVRAM_removePropertyInternal(IORegistryEntry *that, const OSSymbol *key)
+{
+	IOReturn result = FunctionCast(IODTNVRAM_removePropertyInternal, callbackHBFX->orgIODTNVRAM_removePropertyInternal)(that, key);
+	callbackHBFX->nvramDump.invalidate(key);
+	return result;
+}
+
+//==============================================================================
+
+bool HBFX::IODTNVRAM_setProperty(IORegistryEntry *that, const OSSymbol *key, OSObject *value)
+{
+	bool result = FunctionCast(IODTNVRAM_setProperty, callbackHBFX->orgIODTNVRAM_setProperty)(that, key, value);
+	callbackHBFX->nvramDump.invalidate(key);
+	return result;
+}
+
+//==============================================================================
+
+void HBFX::IODTNVRAM_removeProperty(IORegistryEntry *that, const OSSymbol *key)
+{
+	FunctionCast(IODTNVRAM_removeProperty, callbackHBFX->orgIODTNVRAM_removeProperty)(that, key);
+	callbackHBFX->nvramDump.invalidate(key);
+}
+
+//==============================================================================
+
 IOReturn HBFX::IOPCIBridge_restoreMachineState(IOService *that, IOOptionBits options, IOService * device)
 {
+	uint64_t start_time, end_time, elapsed_ns;
 	if (kMachineRestoreDehibernate & options)
 		callbackHBFX->correct_pci_config_command = true;
 
+	clock_get_uptime(&start_time);
 	IOReturn result = FunctionCast(IOPCIBridge_restoreMachineState, callbackHBFX->orgIOPCIBridge_restoreMachineState)(that, options, device);
+	clock_get_uptime(&end_time);
 	DBGLOG("HBFX", "restoreMachineState returned 0x%x for device %s, options = 0x%x", result, that->getName(), options);
 
 	if (kMachineRestoreDehibernate & options)
+	{
 		callbackHBFX->correct_pci_config_command = false;
+
+		// interrupts can be disabled here, device names are resolved by publishRestoreStats
+		if (callbackHBFX->restoreStatsLock)
+		{
+			IOService *restored = device ? device : that;
+			absolutetime_to_nanoseconds(end_time - start_time, &elapsed_ns);
+			IOSimpleLockLock(callbackHBFX->restoreStatsLock);
+			bool added = callbackHBFX->restoreStats.recordRestore(restored, elapsed_ns / 1000);
+			IOSimpleLockUnlock(callbackHBFX->restoreStatsLock);
+			if (added)
+				restored->retain();
+		}
+
+		// publish once all devices are restored
+		if (callbackHBFX->restoreStatsTimer)
+		{
+			callbackHBFX->restoreStatsTimer->cancelTimeout();
+			callbackHBFX->restoreStatsTimer->setTimeoutMS(5000);
+		}
+	}
 	
 	if (callbackHBFX->nextSleepTimer)
 		callbackHBFX->nextSleepTimer->cancelTimeout();
 
-	if (callbackHBFX->checkCapacityTimer) {
-		callbackHBFX->checkCapacityTimer->cancelTimeout();
-		callbackHBFX->checkCapacityTimer->setTimeoutMS(60000);
-	}
+	callbackHBFX->restartCapacityCheck();
 
 	return result;
 }
@@ -590,12 +768,21 @@ void HBFX::IOPCIDevice_extendedConfigWrite16(IOService *that, UInt64 offset, UIn
 {
 	if (callbackHBFX->correct_pci_config_command && offset == WIOKit::PCIRegister::kIOPCIConfigCommand)
 	{
-		if (strlen(ADDPR(hbfx_config).ignored_device_list) == 0 || strstr(ADDPR(hbfx_config).ignored_device_list, that->getName()) != nullptr)
+		if (callbackHBFX->isPatchedDevice(that))
 		{
 			if (!(data & kIOPCICommandMemorySpace))
 			{
 				DBGLOG("HBFX", "HBFX will add flag kIOPCICommandMemorySpace for device %s, offset = %08llX, data = %04X", that->getName(), offset, data);
 				data |= kIOPCICommandMemorySpace;
+
+				if (callbackHBFX->restoreStatsLock)
+				{
+					IOSimpleLockLock(callbackHBFX->restoreStatsLock);
+					bool added = callbackHBFX->restoreStats.recordInjection(that);
+					IOSimpleLockUnlock(callbackHBFX->restoreStatsLock);
+					if (added)
+						that->retain();
+				}
 			}
 		}
 	}
@@ -605,14 +792,121 @@ void HBFX::IOPCIDevice_extendedConfigWrite16(IOService *that, UInt64 offset, UIn
 
 //==============================================================================
 
+bool HBFX::IOPCIDevice_terminated(void *target, void *refCon, IOService *newService, IONotifier *notifier)
+{
+	callbackHBFX->patchDecisions.remove(newService);
+	return true;
+}
+
+//==============================================================================
+
+void HBFX::restoreStatsKey(IOService *device, char (&key)[DeviceRestoreStats::NameLength])
+{
+	const char *location = device->getLocation();
+	if (location)
+		snprintf(key, sizeof(key), "%s@%s", device->getName(), location);
+	else
+		snprintf(key, sizeof(key), "%s", device->getName());
+}
+
+//==============================================================================
+
+void HBFX::publishRestoreStats()
+{
+	if (!restoreStatsLock)
+		return;
+
+	OSDictionary *devices = OSDictionary::withCapacity(DeviceRestoreStats::MaxDevices);
+	if (!devices)
+		return;
+
+	auto setNumber = [](OSDictionary *dict, const char *key, uint64_t value) {
+		OSNumber *number = OSNumber::withNumber(value, 64);
+		if (number) {
+			dict->setObject(key, number);
+			number->release();
+		}
+	};
+
+	IOSimpleLockLock(restoreStatsLock);
+	size_t count = restoreStats.count();
+	uint32_t dropped = restoreStats.dropped();
+	IOSimpleLockUnlock(restoreStatsLock);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		// devices are only appended, objects can't be allocated under a simple lock, so copy one device at a time
+		IOSimpleLockLock(restoreStatsLock);
+		DeviceRestoreStats::Device device = restoreStats.device(i);
+		IOSimpleLockUnlock(restoreStatsLock);
+
+		char name[DeviceRestoreStats::NameLength];
+		restoreStatsKey(static_cast<IOService *>(const_cast<void *>(device.device)), name);
+		OSDictionary *entry = OSDictionary::withCapacity(5);
+		OSArray *histogram = OSArray::withCapacity(DeviceRestoreStats::HistogramBuckets);
+		if (entry && histogram)
+		{
+			for (size_t j = 0; j < DeviceRestoreStats::HistogramBuckets; j++)
+			{
+				OSNumber *number = OSNumber::withNumber(device.restoreUS.bucket[j], 32);
+				if (number) {
+					histogram->setObject(number);
+					number->release();
+				}
+			}
+			setNumber(entry, "Restores", device.restoreUS.count);
+			setNumber(entry, "TotalUS", device.restoreUS.total);
+			setNumber(entry, "MaxUS", device.restoreUS.maximum);
+			setNumber(entry, "MemorySpaceInjected", device.memorySpaceInjected);
+			entry->setObject("HistogramUS", histogram);
+			devices->setObject(name, entry);
+		}
+		OSSafeReleaseNULL(histogram);
+		OSSafeReleaseNULL(entry);
+	}
+
+	if (!statistics && (statistics = OSDictionary::withCapacity(16)) == nullptr)
+	{
+		devices->release();
+		return;
+	}
+
+	statistics->setObject("RestoreMachineState", devices);
+	devices->release();
+	if (dropped != 0)
+		updateStatistic("RestoreStatsDropped", dropped);
+	publishStatistics();
+}
+
+//==============================================================================
+
+bool HBFX::isPatchedDevice(IOService *device)
+{
+	if (patchedDevices.empty())
+		return true;
+
+	// Decisions are cached only while terminated devices can be dropped from the cache
+	bool decision;
+	if (pciTerminationNotifier && patchDecisions.lookup(device, decision))
+		return decision;
+
+	decision = patchedDevices.contains(device->getName());
+	if (pciTerminationNotifier)
+		patchDecisions.insert(device, decision);
+	return decision;
+}
+
+//==============================================================================
+
 void HBFX::processKernel(KernelPatcher &patcher)
 {
 	if (!(progressState & ProcessingState::KernelRouted))
 	{
 		DBGLOG("HBFX", "current dumpNvram value: %d", ADDPR(hbfx_config).dumpNvram);
+		DBGLOG("HBFX", "current compressPanicInfo value: %d", ADDPR(hbfx_config).compressPanicInfo);
 		DBGLOG("HBFX", "current patchPCIFamily value: %d", ADDPR(hbfx_config).patchPCIFamily);
 		if (strlen(ADDPR(hbfx_config).ignored_device_list) != 0)
-			DBGLOG("HBFX", "current ignored_device_list value: %s", ADDPR(hbfx_config).ignored_device_list);
+			DBGLOG("HBFX", "current ignored_device_list value: %s (%lu devices)", ADDPR(hbfx_config).ignored_device_list, patchedDevices.count());
 		DBGLOG("HBFX", "current hbfx-ahbm value: %d", ADDPR(hbfx_config).autoHibernateMode);
 		
 		if (IOService::getPMRootDomain() == nullptr)
@@ -627,6 +921,20 @@ void HBFX::processKernel(KernelPatcher &patcher)
 		bool doNotOverrideWakeUpTime  = (ADDPR(hbfx_config).autoHibernateMode & Configuration::DoNotOverrideWakeUpTime);
 		int  minimalRemainingCapacity = ((ADDPR(hbfx_config).autoHibernateMode & 0xF00) >> 8);
 		
+		if (autoHibernateModeEnabled || whenBatteryIsAtWarnLevel || whenBatteryAtCriticalLevel || minimalRemainingCapacity != 0) {
+			// failed registration is retried on workLoop
+			if (!workLoop)
+				workLoop = IOWorkLoop::workLoop();
+			registerPowerSourceNotifications();
+			
+			// clamshell state is tracked by root domain messages, other settings are read again after sleep/wake UUID changes
+			if (!rootDomainNotifier) {
+				rootDomainNotifier = IOService::getPMRootDomain()->registerInterest(gIOGeneralInterest, IOPMrootDomain_message, this);
+				if (!rootDomainNotifier)
+					SYSLOG("HBFX", "failed to register IOPMrootDomain interest notification, PM settings are read at every sleep");
+			}
+		}
+		
 		if (whenBatteryIsAtWarnLevel || whenBatteryAtCriticalLevel || minimalRemainingCapacity != 0) {
 			if (!checkCapacityTimer) {
 				if (!workLoop)
@@ -640,7 +948,7 @@ void HBFX::processKernel(KernelPatcher &patcher)
 					[](OSObject *owner, IOTimerEventSource *sender) {
 						callbackHBFX->checkCapacity();
 						if (sender)
-							sender->setTimeoutMS(60000);
+							sender->setTimeoutMS(callbackHBFX->nextCapacityCheckDelay());
 					});
 					
 					if (checkCapacityTimer) {
@@ -648,7 +956,7 @@ void HBFX::processKernel(KernelPatcher &patcher)
 						if (result != kIOReturnSuccess)
 							SYSLOG("HBFX", "addEventSource failed");
 						else
-							checkCapacityTimer->setTimeoutMS(60000);
+							checkCapacityTimer->setTimeoutMS(nextCapacityCheckDelay());
 					}
 					else
 						SYSLOG("HBFX", "timerEventSource failed");
@@ -713,18 +1021,79 @@ void HBFX::processKernel(KernelPatcher &patcher)
 				}
 				else
 					SYSLOG("HBFX", "IOService instance does not have workLoop");
-			}			
+			}
+
+			// learned sleep durations are loaded from NVRAM after boot and saved after every full wake
+			if (autoHibernateModeEnabled && (ADDPR(hbfx_config).autoHibernateMode & Configuration::HibernateLongSleeps) && workLoop && !sleepHistoryTimer) {
+				sleepHistoryTimer = IOTimerEventSource::timerEventSource(workLoop,
+				[](OSObject *owner, IOTimerEventSource *sender) {
+					callbackHBFX->syncSleepHistory();
+				});
+
+				if (sleepHistoryTimer) {
+					IOReturn result = workLoop->addEventSource(sleepHistoryTimer);
+					if (result != kIOReturnSuccess) {
+						SYSLOG("HBFX", "addEventSource failed");
+						OSSafeReleaseNULL(sleepHistoryTimer);
+					}
+					else
+						sleepHistoryTimer->setTimeoutMS(10000);
+				}
+				else
+					SYSLOG("HBFX", "timerEventSource failed");
+			}
+
+			if (workLoop && !preArmTimer) {
+				preArmTimer = IOTimerEventSource::timerEventSource(workLoop,
+				[](OSObject *owner, IOTimerEventSource *sender) {
+					if (!callbackHBFX->preArm.ready)
+						callbackHBFX->preArmSleep();
+				});
+
+				if (preArmTimer) {
+					IOReturn result = workLoop->addEventSource(preArmTimer);
+					if (result != kIOReturnSuccess) {
+						SYSLOG("HBFX", "addEventSource failed");
+						OSSafeReleaseNULL(preArmTimer);
+					}
+				}
+				else
+					SYSLOG("HBFX", "timerEventSource failed");
+			}
 		}
 		
-		if (!ADDPR(hbfx_config).dumpNvram && emulatedNVRAM)
-			ADDPR(hbfx_config).dumpNvram = true;
-		bool nvram_patches_required = (ADDPR(hbfx_config).dumpNvram == true || !checkRTCExtendedMemory());
+		bool nvram_patches_required = (ADDPR(hbfx_config).dumpNvram == true || !rtcBank.available());
 		if (!nvram_patches_required)
 		{
 			DBGLOG("HBFX", "all nvram kernel patches will be skipped since the second bank of RTC memory is available");
 			return;
 		}
 
+		// initialize NVStorage in background, so that the first sleep or panic does not wait for it
+		if (!nvstorageWarmUpTimer) {
+			if (!workLoop)
+				workLoop = IOWorkLoop::workLoop();
+
+			if (workLoop) {
+				nvstorageWarmUpTimer = IOTimerEventSource::timerEventSource(workLoop,
+				[](OSObject *owner, IOTimerEventSource *sender) {
+					callbackHBFX->initializeNVStorage();
+				});
+
+				if (nvstorageWarmUpTimer) {
+					IOReturn result = workLoop->addEventSource(nvstorageWarmUpTimer);
+					if (result != kIOReturnSuccess)
+						SYSLOG("HBFX", "addEventSource failed");
+					else
+						nvstorageWarmUpTimer->setTimeoutMS(10000);
+				}
+				else
+					SYSLOG("HBFX", "timerEventSource failed");
+			}
+			else
+				SYSLOG("HBFX", "IOService instance does not have workLoop");
+		}
+
 		if (nvram_patches_required) {
 
 			ml_at_interrupt_context = reinterpret_cast<t_ml_at_interrupt_context>(patcher.solveSymbol(KernelPatcher::KernelID, "_ml_at_interrupt_context"));
@@ -756,6 +1125,13 @@ void HBFX::processKernel(KernelPatcher &patcher)
 					patcher.clearError();
 				}
 
+				// optional, nvram.plist is written in place without it
+				NVRAMDump::vnodeRename = reinterpret_cast<NVRAMDump::t_vnode_rename>(patcher.solveSymbol(KernelPatcher::KernelID, "_vnode_rename"));
+				if (!NVRAMDump::vnodeRename) {
+					DBGLOG("HBFX", "failed to resolve _vnode_rename %d", patcher.getError());
+					patcher.clearError();
+				}
+
 				preemption_enabled = reinterpret_cast<t_preemption_enabled>(patcher.solveSymbol(KernelPatcher::KernelID, "_preemption_enabled"));
 				if (!preemption_enabled) {
 					SYSLOG("HBFX", "failed to resolve _preemption_enabled %d", patcher.getError());
@@ -774,12 +1150,33 @@ void HBFX::processKernel(KernelPatcher &patcher)
 					patcher.clearError();
 				}
 
+				// macOS 11 and newer change variables in setPropertyInternal/removePropertyInternal,
+				// older versions have everything in setProperty/removeProperty
+				KernelPatcher::RouteRequest internalRequests[] {
+					{"__ZN9IODTNVRAM19setPropertyInternalEPK8OSSymbolP8OSObject", IODTNVRAM_setPropertyInternal, orgIODTNVRAM_setPropertyInternal},
+					{"__ZN9IODTNVRAM22removePropertyInternalEPK8OSSymbol", IODTNVRAM_removePropertyInternal, orgIODTNVRAM_removePropertyInternal}
+				};
+				KernelPatcher::RouteRequest publicRequests[] {
+					{"__ZN9IODTNVRAM11setPropertyEPK8OSSymbolP8OSObject", IODTNVRAM_setProperty, orgIODTNVRAM_setProperty},
+					{"__ZN9IODTNVRAM14removePropertyEPK8OSSymbol", IODTNVRAM_removeProperty, orgIODTNVRAM_removeProperty}
+				};
+				bool internal = patcher.solveSymbol(KernelPatcher::KernelID, internalRequests[0].symbol) != 0 &&
+								patcher.solveSymbol(KernelPatcher::KernelID, internalRequests[1].symbol) != 0;
+				patcher.clearError();
+				if (patcher.routeMultiple(KernelPatcher::KernelID, internal ? internalRequests : publicRequests, arrsize(publicRequests)))
+					nvramDump.track();
+				else
+					SYSLOG("HBFX", "NVRAM changes can't be tracked (error %d), every nvram.plist dump will serialize all variables", patcher.getError());
+				patcher.clearError();
+
 				if (sync && preemption_enabled && enable_preemption && disable_preemption && ml_at_interrupt_context &&
 					ml_get_interrupts_enabled && ml_set_interrupts_enabled)
 				{
 					KernelPatcher::RouteRequest request {"_packA", packA, orgPackA};
 					if (!patcher.routeMultiple(KernelPatcher::KernelID, &request, 1))
 						SYSLOG("HBFX", "patcher.routeMultiple for %s is failed with error %d", request.symbol, patcher.getError());
+					else if (!reservePanicArena())
+						SYSLOG("HBFX", "panic arena is not reserved, panic info will be stored using NVStorage");
 					patcher.clearError();
 				}
 			}
@@ -804,8 +1201,6 @@ void HBFX::processKext(KernelPatcher &patcher, size_t index, mach_vm_address_t a
 			return;
 		}
 		
-		if (!ADDPR(hbfx_config).dumpNvram && emulatedNVRAM)
-			ADDPR(hbfx_config).dumpNvram = true;
 		bool autoHibernateModeEnabled = (ADDPR(hbfx_config).autoHibernateMode & Configuration::EnableAutoHibernation);
 		bool doNotOverrideWakeUpTime = (ADDPR(hbfx_config).autoHibernateMode & Configuration::DoNotOverrideWakeUpTime);
 		
@@ -824,6 +1219,38 @@ void HBFX::processKext(KernelPatcher &patcher, size_t index, mach_vm_address_t a
 						SYSLOG("HBFX", "patcher.routeMultiple for %s is failed with error %d", requests[0].symbol, patcher.getError());
 					patcher.clearError();
 					progressState |= ProcessingState::IOPCIFamilyRouted;
+					
+					if (!workLoop)
+						workLoop = IOWorkLoop::workLoop();
+					
+					if (workLoop && !restoreStatsLock && (restoreStatsLock = IOSimpleLockAlloc()) != nullptr) {
+						restoreStatsTimer = IOTimerEventSource::timerEventSource(workLoop,
+						[](OSObject *owner, IOTimerEventSource *sender) {
+							callbackHBFX->publishRestoreStats();
+						});
+						
+						if (restoreStatsTimer) {
+							IOReturn result = workLoop->addEventSource(restoreStatsTimer);
+							if (result != kIOReturnSuccess) {
+								SYSLOG("HBFX", "addEventSource failed");
+								OSSafeReleaseNULL(restoreStatsTimer);
+							}
+						}
+						else
+							SYSLOG("HBFX", "timerEventSource failed");
+					}
+					
+					if (!patchedDevices.empty() && patchDecisions.init())
+					{
+						OSDictionary *matching = IOService::serviceMatching("IOPCIDevice");
+						if (matching)
+						{
+							pciTerminationNotifier = IOService::addMatchingNotification(gIOTerminatedNotification, matching, IOPCIDevice_terminated, this);
+							matching->release();
+						}
+						if (!pciTerminationNotifier)
+							SYSLOG("HBFX", "failed to register IOPCIDevice termination notification, device decisions won't be cached");
+					}
 				}
 				
 				if (autoHibernateModeEnabled && i == 1 && !(progressState & ProcessingState::AppleRTCRouted) && !doNotOverrideWakeUpTime)
@@ -874,32 +1301,213 @@ void HBFX::processKext(KernelPatcher &patcher, size_t index, mach_vm_address_t a
 
 //==============================================================================
 
-bool HBFX::checkRTCExtendedMemory()
+void HBFX::preArmSleep(bool prepareDump)
 {
-	bool result = false;
-	RTCStorage rtc_storage;
-	if (rtc_storage.init())
-	{
-		result = rtc_storage.checkExtendedMemory();
-		rtc_storage.deinit();
-	}
-	
-	return result;
+	uint64_t start_time, end_time;
+	clock_get_uptime(&start_time);
+
+	releasePreArm();
+
+	preArm.rtcExtendedMemory = rtcBank.available();
+	DBGLOG("HBFX", "second bank of RTC memory is %s (%u probes)", preArm.rtcExtendedMemory ? "available" : "not available", rtcBank.probes());
+	if (ADDPR(hbfx_config).dumpNvram || !preArm.rtcExtendedMemory)
+		preArm.nvstorageReady = initializeNVStorage();
+
+	// fill fragment cache, IOHibernateSystemSleep will serialize only variables changed by it
+	if (prepareDump && ADDPR(hbfx_config).dumpNvram && preArm.nvstorageReady && nvramDump.init())
+		nvramDump.refresh();
+
+	preArm.ready = true;
+
+	clock_get_uptime(&end_time);
+	absolutetime_to_nanoseconds(end_time - start_time, &preArm.duration);
+	DBGLOG("HBFX", "sleep is pre-armed in %llu us", preArm.duration / 1000);
 }
 
 //==============================================================================
 
-bool HBFX::initializeNVStorage()
+void HBFX::releasePreArm()
 {
-	static bool nvstorage_initialized = false;
-	if (!nvstorage_initialized)
-	{
-		if (nvstorage.init())
-		{
-			DBGLOG("HBFX", "NVStorage was initialized");
-			
-			nvstorage_initialized = true;
-			
+	preArm = {};
+}
+
+//==============================================================================
+
+void HBFX::schedulePreArm()
+{
+	if (!preArmTimer)
+		return;
+
+	preArmTimer->cancelTimeout();
+	cancelPreArm();
+	preArmTimer->setTimeoutUS(1);
+}
+
+//==============================================================================
+
+bool HBFX::completePreArm()
+{
+	if (preArmTimer)
+		preArmTimer->cancelTimeout();
+
+	bool wasReady = false;
+	auto action = [](OSObject *, void *arg0, void *, void *, void *) -> IOReturn {
+		*static_cast<bool *>(arg0) = callbackHBFX->preArm.ready;
+		// the dump is built by IOHibernateSystemSleep right after, so it is not prepared here
+		if (!callbackHBFX->preArm.ready)
+			callbackHBFX->preArmSleep(false);
+		return kIOReturnSuccess;
+	};
+
+	// closing the gate waits for pre-arm which might be running right now
+	if (workLoop)
+		workLoop->runAction(action, workLoop, &wasReady);
+	else
+		action(nullptr, &wasReady, nullptr, nullptr, nullptr);
+
+	return wasReady;
+}
+
+//==============================================================================
+
+void HBFX::cancelPreArm()
+{
+	auto action = [](OSObject *, void *, void *, void *, void *) -> IOReturn {
+		callbackHBFX->releasePreArm();
+		return kIOReturnSuccess;
+	};
+
+	if (workLoop)
+		workLoop->runAction(action, workLoop);
+	else
+		action(nullptr, nullptr, nullptr, nullptr, nullptr);
+}
+
+//==============================================================================
+
+void HBFX::commitHibernateVariables()
+{
+	struct {
+		const char *key;
+		uint64_t   &digest;
+		uint64_t    staged;
+	} variables[] {
+		{kIOHibernateRTCVariablesKey, rtcVariablesDigest, 0},
+		{kIOHibernateSMCVariablesKey, smcVariablesDigest, 0}
+	};
+
+	NVBatch &batch = hibernateBatch;
+	batch.reset();
+
+	for (auto &variable : variables)
+	{
+		OSData *data = OSDynamicCast(OSData, IOService::getPMRootDomain()->getProperty(variable.key));
+		if (!data)
+			continue;
+
+		// IOHibernateSystemWake removes RTC variables from NVRAM, so the variable must still exist to be skipped
+		uint64_t hash = NVRAMDump::digest(data);
+		if (hash == variable.digest && nvstorage.exists(variable.key))
+		{
+			DBGLOG("HBFX", "%s is not changed since last write", variable.key);
+			variableWritesSkipped++;
+		}
+		else if (batch.stage(variable.key, data))
+			variable.staged = hash;
+	}
+
+	if (batch.count() > 0)
+	{
+		// RTC and SMC variables are kept in NVRAM together or not at all
+		bool committed = batch.commit(nvstorage, NVStorage::OptRaw, true);
+		if (!committed)
+			SYSLOG("HBFX", "IOHibernateRTCVariablesKey/IOHibernateSMCVariablesKey can't be written to NVRAM.");
+
+		for (auto &variable : variables)
+			if (variable.staged != 0)
+				variable.digest = committed ? variable.staged : 0;
+	}
+
+	updateStatistic("VariableWritesPerformed", batch.stats().written);
+	updateStatistic("VariableWritesSkipped", variableWritesSkipped);
+	updateStatistic("VariableCopies", batch.stats().copied);
+	batch.reset();
+}
+
+//==============================================================================
+
+uint64_t HBFX::globalSync()
+{
+	if (!sync)
+		return 0;
+
+	uint64_t start_time, end_time, elapsed_ns;
+	clock_get_uptime(&start_time);
+	sync(kernproc, nullptr, nullptr);
+	clock_get_uptime(&end_time);
+	absolutetime_to_nanoseconds(end_time - start_time, &elapsed_ns);
+	return elapsed_ns;
+}
+
+//==============================================================================
+
+void HBFX::updateStatistic(const char *key, uint64_t value, bool increment)
+{
+	if (!statistics && (statistics = OSDictionary::withCapacity(16)) == nullptr)
+		return;
+
+	if (increment)
+	{
+		OSNumber *current = OSDynamicCast(OSNumber, statistics->getObject(key));
+		if (current)
+			value += current->unsigned64BitValue();
+	}
+
+	OSNumber *number = OSNumber::withNumber(value, 64);
+	if (number)
+	{
+		statistics->setObject(key, number);
+		number->release();
+	}
+}
+
+//==============================================================================
+
+void HBFX::publishStatistics()
+{
+	IOPMrootDomain *root = IOService::getPMRootDomain();
+	if (!statistics || !root)
+		return;
+
+	// publish a copy, so registry readers never see the dictionary being modified
+	OSDictionary *copy = OSDictionary::withDictionary(statistics);
+	if (copy)
+	{
+		root->setProperty(kHBFXStatisticsKey, copy);
+		copy->release();
+	}
+}
+
+//==============================================================================
+
+bool HBFX::initializeNVStorage(bool wait)
+{
+	if (nvstorageInit.ready())
+		return true;
+
+	// callers are serialized, so they wait for a running initialization, failed initialization is retried by the next caller
+	if (!nvstorageInit.lock.handle || !nvstorageInit.begin(wait))
+		return false;
+
+	bool nvstorage_initialized = nvstorageInit.ready();
+	if (!nvstorage_initialized)
+	{
+		if (nvstorage.init())
+		{
+			DBGLOG("HBFX", "NVStorage was initialized");
+			
+			nvstorage_initialized = true;
+			
 #if defined(DEBUG) && defined(DEBUG_NVSTORAGE)
 			// short NVStorage test
 			uint8_t value[] = {0x01, 0x02, 0x03, 0x04, 0xFF, 0x04, 0x03, 0x02, 0x01,
@@ -1008,6 +1616,8 @@ bool HBFX::initializeNVStorage()
 		}
 	}
 	
+	// NVStorage is completely initialized before other threads can see it ready
+	nvstorageInit.finish(nvstorage_initialized);
 	return nvstorage_initialized;
 }
 
@@ -1025,42 +1635,7 @@ void HBFX::readConfigFromNVRAM()
 		auto reg_variable  = OSDynamicCast(OSData, reg_entry->getProperty("EmuVariableUefiPresent"));
 		emulatedNVRAM      = (reg_variable != nullptr && reg_variable->isEqualTo("Yes", 3));
 		DBGLOG("HBFX", "EmuVariableUefiPresent is %s", (emulatedNVRAM ? "detected" : "not detected"));
-		if (!ADDPR(hbfx_config).dumpNvram) {
-			auto dump_nvram = OSDynamicCast(OSBoolean, reg_entry->getProperty(NVRAM_PREFIX(LILU_READ_ONLY_GUID, "hbfx-dump-nvram")));
-			if (dump_nvram != nullptr && dump_nvram->isTrue()) {
-				ADDPR(hbfx_config).dumpNvram = true;
-				DBGLOG("HBFX", "Variable hbfx-dump-nvram has been read from NVRAM, value: %d", ADDPR(hbfx_config).dumpNvram);
-			}
-		}
-		if (ADDPR(hbfx_config).patchPCIFamily) {
-			if (strlen(ADDPR(hbfx_config).ignored_device_list) == 0) {
-				auto patch_pci_list = OSDynamicCast(OSString, reg_entry->getProperty(NVRAM_PREFIX(LILU_READ_ONLY_GUID, "hbfx-patch-pci")));
-				if (patch_pci_list != nullptr && patch_pci_list->getLength() != 0) {
-					size_t length = patch_pci_list->getLength();
-					if (length > sizeof(ADDPR(hbfx_config).ignored_device_list))
-						length = sizeof(ADDPR(hbfx_config).ignored_device_list);
-					lilu_os_strlcpy(ADDPR(hbfx_config).ignored_device_list, patch_pci_list->getCStringNoCopy(), length);
-					DBGLOG("HBFX", "Variable hbfx-patch-pci has been read from NVRAM, ignored device list: %s", ADDPR(hbfx_config).ignored_device_list);
-					if (strstr(ADDPR(hbfx_config).ignored_device_list, "none") != nullptr ||
-						strstr(ADDPR(hbfx_config).ignored_device_list, "false") != nullptr ||
-						strstr(ADDPR(hbfx_config).ignored_device_list, "off") != nullptr)
-					{
-						ADDPR(hbfx_config).patchPCIFamily = false;
-						DBGLOG("HBFX", "Turn off PCIFamily patching since hbfx-patch-pci contains none, false or off");
-					}
-				}
-			}
-			auto disable_patch_pci = OSDynamicCast(OSBoolean, reg_entry->getProperty(NVRAM_PREFIX(LILU_READ_ONLY_GUID, "hbfx-disable-patch-pci")));
-			if (disable_patch_pci != nullptr && disable_patch_pci->isTrue()) {
-				ADDPR(hbfx_config).patchPCIFamily = false;
-				DBGLOG("HBFX", "Variable hbfx-disable-patch-pci has been read from NVRAM, turn off PCIFamily patching");
-			}
-		}
-		if (ADDPR(hbfx_config).autoHibernateMode == 0) {
-			if (WIOKit::getOSDataValue(reg_entry->getProperty(NVRAM_PREFIX(LILU_READ_ONLY_GUID, "hbfx-ahbm")), "hbfx-ahbm", ADDPR(hbfx_config).autoHibernateMode))
-				DBGLOG("HBFX", "Variable hbfx-ahbm has been read from NVRAM, value: %d", ADDPR(hbfx_config).autoHibernateMode);
-		}
-
+		ADDPR(hbfx_config).readNVRAM(reg_entry);
 		reg_entry->release();
 	}
 	else
@@ -1084,73 +1659,10 @@ void HBFX::readConfigFromNVRAM()
 					DBGLOG("HBFX", "Failed to read efi rt services for EmuVariableUefiPresent, error code: 0x%llx", status);
 				}
 
-				if (!ADDPR(hbfx_config).dumpNvram) {
-					size = sizeof(bool);
-					status = rt->getVariable(u"hbfx-dump-nvram", &EfiRuntimeServices::LiluReadOnlyGuid, &attr, &size, buf);
-					if (status == EFI_SUCCESS) {
-						if (size != sizeof(bool))
-							SYSLOG("HBFX", "Expected size of hbfx-dump-nvram = %ld, real size = %lld", sizeof(bool), size);
-						else {
-							ADDPR(hbfx_config).dumpNvram = *reinterpret_cast<bool*>(buf);
-							DBGLOG("HBFX", "Variable hbfx-dump-nvram has been read from NVRAM, value: %d", ADDPR(hbfx_config).dumpNvram);
-						}
-					}
-					else if (status != EFI_ERROR64(EFI_NOT_FOUND)) {
-						DBGLOG("HBFX", "Failed to read efi rt services for hbfx-dump-nvram, error code: 0x%llx", status);
-					}
-				}
-				if (ADDPR(hbfx_config).patchPCIFamily) {
-					if (strlen(ADDPR(hbfx_config).ignored_device_list) == 0) {
-						size = buf_size;
-						status = rt->getVariable(u"hbfx-patch-pci", &EfiRuntimeServices::LiluReadOnlyGuid, &attr, &size, buf);
-						if (status == EFI_SUCCESS) {
-							if (size < 4)
-								SYSLOG("HBFX", "Real size of string hbfx-patch-pci is too small: %lld", size);
-							else {
-								lilu_os_strlcpy(ADDPR(hbfx_config).ignored_device_list, reinterpret_cast<char*>(buf), size);
-								DBGLOG("HBFX", "Variable hbfx-patch-pci has been read from NVRAM, ignored device list: %s", ADDPR(hbfx_config).ignored_device_list);
-								if (strstr(ADDPR(hbfx_config).ignored_device_list, "none") != nullptr ||
-									strstr(ADDPR(hbfx_config).ignored_device_list, "false") != nullptr ||
-									strstr(ADDPR(hbfx_config).ignored_device_list, "off") != nullptr)
-								{
-									ADDPR(hbfx_config).patchPCIFamily = false;
-									DBGLOG("HBFX", "Turn off PCIFamily patching since hbfx-patch-pci contains none, false or off");
-								}
-							}
-						}
-						else if (status != EFI_ERROR64(EFI_NOT_FOUND)) {
-							DBGLOG("HBFX", "Failed to read efi rt services for hbfx-patch-pci, error code: 0x%llx", status);
-						}
-					}
-					size = sizeof(bool);
-					status = rt->getVariable(u"hbfx-disable-patch-pci", &EfiRuntimeServices::LiluReadOnlyGuid, &attr, &size, buf);
-					if (status == EFI_SUCCESS) {
-						if (size != sizeof(bool))
-							SYSLOG("HBFX", "Expected size of hbfx-disable-patch-pci = %ld, real size = %lld", sizeof(bool), size);
-						else if (*reinterpret_cast<bool*>(buf)) {
-							ADDPR(hbfx_config).patchPCIFamily = false;
-							DBGLOG("HBFX", "Variable hbfx-disable-patch-pci has been read from NVRAM, turn off PCIFamily patching");
-						}
-					}
-					else if (status != EFI_ERROR64(EFI_NOT_FOUND)) {
-						DBGLOG("HBFX", "Failed to read efi rt services for hbfx-disable-patch-pci, error code: 0x%llx", status);
-					}
-				}
-				if (ADDPR(hbfx_config).autoHibernateMode == 0) {
-					size = sizeof(ADDPR(hbfx_config).autoHibernateMode);
-					status = rt->getVariable(u"hbfx-ahbm", &EfiRuntimeServices::LiluReadOnlyGuid, &attr, &size, buf);
-					if (status == EFI_SUCCESS) {
-						if (size != sizeof(ADDPR(hbfx_config).autoHibernateMode))
-							SYSLOG("HBFX", "Expected size of hbfx-ahbm = %ld, real size = %lld", sizeof(ADDPR(hbfx_config).autoHibernateMode), size);
-						else {
-							ADDPR(hbfx_config).autoHibernateMode = *reinterpret_cast<int*>(buf);
-							DBGLOG("HBFX", "Variable hbfx-ahbm has been read from NVRAM, value: %d", ADDPR(hbfx_config).autoHibernateMode);
-						}
-					}
-					else if (status != EFI_ERROR64(EFI_NOT_FOUND)) {
-						DBGLOG("HBFX", "Failed to read efi rt services for hbfx-ahbm, error code: 0x%llx", status);
-					}
-				}
+				// options which are already set by boot-args are not requested
+				uint32_t calls = 1 + ADDPR(hbfx_config).readNVRAM(rt, buf, buf_size);
+				DBGLOG("HBFX", "readConfigFromNVRAM: %u runtime service calls", calls);
+				updateStatistic("ConfigRuntimeCalls", calls);
 
 				Buffer::deleter(buf);
 			}
@@ -1161,43 +1673,390 @@ void HBFX::readConfigFromNVRAM()
 		else
 			SYSLOG("HBFX", "failed to load efi rt services");
 	}
+
+	// With emulated NVRAM the bootloader restores variables (including IOHibernateRTCVariables
+	// needed to resume from hibernation) from nvram.plist only, so every hibernation has to
+	// leave a complete plist behind. An incremental/binary log can't be consumed at this point.
+	if (!ADDPR(hbfx_config).dumpNvram && emulatedNVRAM) {
+		ADDPR(hbfx_config).dumpNvram = true;
+		DBGLOG("HBFX", "Emulated NVRAM is detected, turn on writing NVRAM to file");
+	}
+}
+
+//==============================================================================
+
+uint32_t HBFX::panicInfoChunkSize() const
+{
+	// Firmware NVRAM drivers commonly limit a variable to 1 KB including its header and name,
+	// emulated NVRAM is a plist file written by the bootloader and has no such limit
+	return emulatedNVRAM ? 4096 : 768;
 }
 
 //==============================================================================
 
-IOPMPowerSource *HBFX::getPowerSource()
+bool HBFX::reservePanicArena()
 {
-	static int attempt_count = 5;
-	static IOPMPowerSource *power_source {nullptr};
-	if (power_source == nullptr && --attempt_count >= 0)
+	if (panicArena.serializer)
+		return true;
+
+	if (gIODTPlane == nullptr || (panicArena.nvram = IORegistryEntry::fromPath("/options", gIODTPlane)) == nullptr)
 	{
-		auto matching = IOService::serviceMatching("IOPMPowerSource");
-		if (matching) {
-			auto service = IOService::waitForMatchingService(matching, 300);
-			if (service) {
-				power_source = OSDynamicCast(IOPMPowerSource, service);
-				if (!power_source) {
-					SYSLOG("HBFX", "failed to cast service object to IOPMPowerSource");
-					OSSafeReleaseNULL(service);
-				}
-			}
-			else
-				SYSLOG("HBFX", "failed to get service object for IOPMPowerSource");
-			matching->release();
-		} else {
-			SYSLOG("HBFX", "failed to allocate IOPMPowerSource service matching");
+		SYSLOG("HBFX", "reservePanicArena: NVRAM registry entry is not available");
+		return false;
+	}
+
+	panicArena.chunkSize = panicInfoChunkSize();
+	panicArena.count     = PanicChunks::count(panicArena.chunkSize, PanicInfo::MaxChunks);
+	// compressed panic info is stored in HBFX variables, raw panic info goes through NVStorage when compression fails
+	panicArena.compressedKeys = ADDPR(hbfx_config).compressPanicInfo;
+	char key[NVBatch::MaxKeyLength];
+	for (uint32_t i = 0; i < panicArena.count; i++)
+	{
+		snprintf(key, sizeof(key), panicArena.compressedKeys ? PanicInfo::CompressedKeyFormat : PanicInfo::RawKeyFormat, i);
+		panicArena.keys[i]   = OSSymbol::withCString(key);
+		panicArena.chunks[i] = OSData::withCapacity(panicArena.chunkSize);
+		if (!panicArena.keys[i] || !panicArena.chunks[i])
+		{
+			SYSLOG("HBFX", "reservePanicArena: failed to allocate chunk %u", i);
+			releasePanicArena();
+			return false;
 		}
 	}
-	
-	return power_source;
+
+	panicArena.serializer = OSSerialize::withCapacity(PanicArena::SerializationSize);
+	if (!panicArena.serializer)
+	{
+		SYSLOG("HBFX", "reservePanicArena: failed to allocate serialization buffer");
+		releasePanicArena();
+		return false;
+	}
+
+	if (ADDPR(hbfx_config).compressPanicInfo)
+	{
+		// LZSS output may exceed its input by 1/8 for incompressible data
+		panicArena.compressedCapacity = sizeof(PanicInfo::Header) + PanicChunks::InfoSize + PanicChunks::InfoSize / 8 + 16;
+		panicArena.compressed = Buffer::create<uint8_t>(panicArena.compressedCapacity);
+		panicArena.raw = Buffer::create<char>(PanicChunks::InfoSize);
+		if (!panicArena.compressed || !panicArena.raw)
+		{
+			SYSLOG("HBFX", "reservePanicArena: failed to allocate compression buffers, panic info will not be compressed");
+			if (panicArena.compressed)
+				Buffer::deleter(panicArena.compressed);
+			if (panicArena.raw)
+				Buffer::deleter(panicArena.raw);
+			panicArena.compressed = nullptr;
+			panicArena.raw = nullptr;
+			panicArena.compressedCapacity = 0;
+		}
+	}
+
+	DBGLOG("HBFX", "reservePanicArena: %u chunks of %u bytes and %u bytes for serialization are reserved",
+		   panicArena.count, panicArena.chunkSize, PanicArena::SerializationSize);
+	return true;
+}
+
+//==============================================================================
+
+void HBFX::releasePanicArena()
+{
+	for (uint32_t i = 0; i < panicArena.count; i++)
+	{
+		OSSafeReleaseNULL(panicArena.keys[i]);
+		OSSafeReleaseNULL(panicArena.chunks[i]);
+	}
+	panicArena.count = 0;
+	if (panicArena.compressed)
+	{
+		Buffer::deleter(panicArena.compressed);
+		panicArena.compressed = nullptr;
+		panicArena.compressedCapacity = 0;
+	}
+	if (panicArena.raw)
+	{
+		Buffer::deleter(panicArena.raw);
+		panicArena.raw = nullptr;
+		panicArena.rawSize = 0;
+	}
+	OSSafeReleaseNULL(panicArena.serializer);
+	OSSafeReleaseNULL(panicArena.nvram);
+}
+
+//==============================================================================
+
+bool HBFX::writePanicInfoFromArena(const char *buf, uint32_t size, bool compressed, bool &flushed, uint64_t &flushTime)
+{
+	// Chunks can be filled only once, any further panic info goes through NVStorage
+	if (!panicArena.serializer || panicArena.used || compressed != panicArena.compressedKeys || size > panicArena.count * panicArena.chunkSize)
+		return false;
+	panicArena.used = true;
+
+	// chunks are filled within their reserved capacity, so appendBytes does not allocate
+	auto store = [this](uint32_t index, const char *data, uint32_t part) {
+		OSData *chunk = panicArena.chunks[index];
+		return chunk->appendBytes(data, part) && panicArena.nvram->setProperty(panicArena.keys[index], chunk);
+	};
+	uint32_t written = PanicChunks::split(buf, size, panicArena.chunkSize, panicArena.count, store);
+	if (static_cast<uint64_t>(written) * panicArena.chunkSize < size)
+	{
+		// written chunks are kept, NVStorage path will try to store the whole panic info
+		SYSLOG("HBFX", "panic info can't be written to NVRAM from arena, %u chunks were written", written);
+		return false;
+	}
+
+	panicArena.serializer->clearText();
+	if (panicArena.nvram->serializeProperties(panicArena.serializer))
+	{
+		const char *text = panicArena.serializer->text();
+		NVRAMDump::writePlist(FILE_NVRAM_NAME, text, strlen(text), flushed, flushTime);
+	}
+	else
+		SYSLOG("HBFX", "failed to serialize NVRAM");
+
+	DBGLOG("HBFX", "writePanicInfoFromArena: %u chunks of %u bytes were used", written, panicArena.chunkSize);
+	return true;
 }
 
 //==============================================================================
 
-bool HBFX::isStandbyEnabled(IOPMrootDomain* pm_root, uint32_t &standby_delay, bool &pmset_default_mode)
+const char *HBFX::compressPanicInfo(uint32_t limit, uint32_t &size)
 {
-	bool deepSleepEnabled = OSDynamicCast(OSBoolean, pm_root->getProperty(kIOPMDeepSleepEnabledKey)) == kOSBooleanTrue;
-	bool autoPowerOffEnabled = OSDynamicCast(OSBoolean, pm_root->getProperty(kIOPMAutoPowerOffEnabledKey)) == kOSBooleanTrue;
+	if (!panicArena.compressed || panicArena.rawSize == 0)
+		return nullptr;
+
+	// raw text compresses much better than 7-bit packed data
+	uint32_t dstlen = panicArena.compressedCapacity - sizeof(PanicInfo::Header);
+	if (!Compression::compress(Compression::ModeLZSS, dstlen, reinterpret_cast<const uint8_t *>(panicArena.raw), panicArena.rawSize,
+							   panicArena.compressed + sizeof(PanicInfo::Header)))
+	{
+		SYSLOG("HBFX", "failed to compress panic info, raw data will be stored");
+		return nullptr;
+	}
+
+	if (dstlen + sizeof(PanicInfo::Header) >= limit)
+	{
+		DBGLOG("HBFX", "compressed panic info is not smaller than packed data (%u >= %u)", dstlen, limit);
+		return nullptr;
+	}
+
+	PanicInfo::Header header {PanicInfo::Header::Signature, panicArena.rawSize, dstlen};
+	lilu_os_memcpy(panicArena.compressed, &header, sizeof(header));
+	DBGLOG("HBFX", "panic info is compressed from %u to %u bytes", panicArena.rawSize, dstlen);
+	size = static_cast<uint32_t>(sizeof(PanicInfo::Header) + dstlen);
+	return reinterpret_cast<const char *>(panicArena.compressed);
+}
+
+//==============================================================================
+
+AutoHibernate::PowerSnapshot HBFX::capturePowerSnapshot()
+{
+	// sources are queried without the list lock, registration is retried by powerSourceRetryTimer
+	AutoHibernate::PowerSnapshot snapshot {};
+	size_t count = powerSources.capture(snapshot);
+	snapshot.lidIsOpen = !(pmSettingsSnapshot(1) & PMSettings::ClamshellClosed);
+
+	DBGLOG("HBFX", "Power snapshot (%lu sources): battery %d, external %d, charging %d, warning level %d, critical level %d, capacity remaining %d, lid open %d",
+		   count, snapshot.batteryInstalled, snapshot.externalConnected, snapshot.charging, snapshot.atWarnLevel,
+		   snapshot.atCriticalLevel, snapshot.capacityPercentRemaining, snapshot.lidIsOpen);
+	return snapshot;
+}
+
+//==============================================================================
+
+AutoHibernate::Options HBFX::autoHibernateOptions()
+{
+	auto autoHibernateMode = ADDPR(hbfx_config).autoHibernateMode;
+	AutoHibernate::Options options {};
+	options.whenLidIsClosed                 = (autoHibernateMode & Configuration::WhenLidIsClosed);
+	options.whenExternalPowerIsDisconnected = (autoHibernateMode & Configuration::WhenExternalPowerIsDisconnected);
+	options.whenBatteryIsNotCharging        = (autoHibernateMode & Configuration::WhenBatteryIsNotCharging);
+	options.whenBatteryIsAtWarnLevel        = (autoHibernateMode & Configuration::WhenBatteryIsAtWarnLevel);
+	options.whenBatteryAtCriticalLevel      = (autoHibernateMode & Configuration::WhenBatteryAtCriticalLevel);
+	options.doNotOverrideWakeUpTime         = (autoHibernateMode & Configuration::DoNotOverrideWakeUpTime);
+	options.minimalRemainingCapacity        = ((autoHibernateMode & 0xF00) >> 8);
+	return options;
+}
+
+//==============================================================================
+
+void HBFX::beginSleepSession()
+{
+	auto autoHibernateMode = ADDPR(hbfx_config).autoHibernateMode;
+	if (!(autoHibernateMode & Configuration::EnableAutoHibernation) || !(autoHibernateMode & Configuration::HibernateLongSleeps) || sleepSessionStart != 0)
+		return;
+
+	clock_sec_t secs;
+	clock_usec_t microsecs;
+	clock_get_calendar_microtime(&secs, &microsecs);
+	sleepSessionStart = secs;
+}
+
+//==============================================================================
+
+void HBFX::endSleepSession()
+{
+	if (sleepSessionStart == 0)
+		return;
+
+	clock_sec_t secs;
+	clock_usec_t microsecs;
+	clock_get_calendar_microtime(&secs, &microsecs);
+	if (secs > sleepSessionStart)
+	{
+		struct tm tm;
+		gmtime_r(sleepSessionStart, &tm);
+		sleepHistory.add(tm.tm_wday, tm.tm_hour, secs - sleepSessionStart);
+		updateStatistic("SleepsLearned", 1, true);
+		DBGLOG("HBFX", "sleep started on weekday %d at %02d:%02d (UTC) lasted %llu seconds", tm.tm_wday, tm.tm_hour, tm.tm_min, secs - sleepSessionStart);
+
+		// NVRAM is written once the wake is finished, but not more often than SLEEP_HISTORY_SAVE_INTERVAL
+		sleepHistoryChanged = true;
+		if (sleepHistoryTimer)
+		{
+			uint64_t delay = 5;
+			if (sleepHistorySaved != 0 && secs + delay < sleepHistorySaved + SLEEP_HISTORY_SAVE_INTERVAL)
+				delay = sleepHistorySaved + SLEEP_HISTORY_SAVE_INTERVAL - secs;
+			sleepHistoryTimer->cancelTimeout();
+			sleepHistoryTimer->setTimeoutMS(static_cast<uint32_t>(delay * 1000));
+		}
+	}
+	sleepSessionStart = 0;
+}
+
+//==============================================================================
+
+void HBFX::syncSleepHistory()
+{
+	if (!initializeNVStorage())
+		return;
+
+	if (!sleepHistoryLoaded)
+	{
+		uint32_t size = 0;
+		uint8_t *state = nvstorage.read(kSleepHistoryKey, size, NVStorage::OptAuto);
+		if (state)
+		{
+			if (!sleepHistory.merge(state, size))
+				SYSLOG("HBFX", "%s has unsupported format (%u bytes), it will be overwritten", kSleepHistoryKey, size);
+			Buffer::deleter(state);
+		}
+		sleepHistoryLoaded = true;
+	}
+
+	if (!sleepHistoryChanged)
+		return;
+
+	uint8_t *state = Buffer::create<uint8_t>(SleepDurationPredictor::StateSize);
+	if (!state)
+		return;
+	sleepHistory.save(state);
+	if (nvstorage.write(kSleepHistoryKey, state, SleepDurationPredictor::StateSize, NVStorage::OptChecksum | NVStorage::OptCompressed)) {
+		clock_sec_t secs;
+		clock_usec_t microsecs;
+		clock_get_calendar_microtime(&secs, &microsecs);
+		sleepHistorySaved = secs;
+		sleepHistoryChanged = false;
+	}
+	else
+		SYSLOG("HBFX", "%s can't be written to NVRAM", kSleepHistoryKey);
+	Buffer::deleter(state);
+}
+
+//==============================================================================
+
+bool HBFX::predictLongSleep(uint32_t standby_delay)
+{
+	if (sleepSessionStart == 0 || standby_delay == 0)
+		return false;
+
+	clock_sec_t secs;
+	clock_usec_t microsecs;
+	clock_get_calendar_microtime(&secs, &microsecs);
+	uint64_t elapsed = secs > sleepSessionStart ? secs - sleepSessionStart : 0;
+
+	// sleep is long if it lasts at least standby delay after this sleep phase 0
+	struct tm tm;
+	gmtime_r(sleepSessionStart, &tm);
+	bool predicted = sleepHistory.predictLonger(tm.tm_wday, tm.tm_hour, elapsed + standby_delay, 80);
+	if (predicted)
+		updateStatistic("LongSleepPredictions", 1, true);
+	DBGLOG("HBFX", "Auto hibernate: sleep is%s expected to last longer than %llu seconds", predicted ? "" : " not", elapsed + standby_delay);
+	return predicted;
+}
+
+//==============================================================================
+
+UInt32 HBFX::refreshPMSettings()
+{
+	IOPMrootDomain *root = IOService::getPMRootDomain();
+	UInt32 current, updated;
+	do {
+		// the version changes with every store, so a message delivered while the registry is read
+		// makes the swap fail and its value is not overwritten by the older registry value
+		current = pmSettings;
+		UInt32 flags = PMSettings::Valid;
+		if (root) {
+			if (OSDynamicCast(OSBoolean, root->getProperty(kIOPMDeepSleepEnabledKey)) == kOSBooleanTrue)
+				flags |= PMSettings::DeepSleepEnabled;
+			if (OSDynamicCast(OSBoolean, root->getProperty(kIOPMAutoPowerOffEnabledKey)) == kOSBooleanTrue)
+				flags |= PMSettings::AutoPowerOffEnabled;
+			if (OSDynamicCast(OSBoolean, root->getProperty(kAppleClamshellStateKey)) == kOSBooleanTrue)
+				flags |= PMSettings::ClamshellClosed;
+		}
+		updated = ((current & ~PMSettings::FlagMask) | flags) + PMSettings::VersionIncrement;
+	} while (!OSCompareAndSwap(current, updated, &pmSettings));
+	DBGLOG("HBFX", "PM settings version %u read from registry", updated >> PMSettings::VersionShift);
+	return updated;
+}
+
+//==============================================================================
+
+UInt32 HBFX::storePMSettings(UInt32 flags, UInt32 mask)
+{
+	UInt32 current, updated;
+	do {
+		current = pmSettings;
+		updated = ((current & ~mask) | (flags & mask)) + PMSettings::VersionIncrement;
+	} while (!OSCompareAndSwap(current, updated, &pmSettings));
+	DBGLOG("HBFX", "PM settings version %u: deep sleep %d, auto power off %d, clamshell closed %d", updated >> PMSettings::VersionShift,
+		   (updated & PMSettings::DeepSleepEnabled) != 0, (updated & PMSettings::AutoPowerOffEnabled) != 0, (updated & PMSettings::ClamshellClosed) != 0);
+	return updated;
+}
+
+//==============================================================================
+
+UInt32 HBFX::pmSettingsSnapshot(SInt32 lookups)
+{
+	UInt32 settings = pmSettings;
+	if (!(settings & PMSettings::Valid))
+		return refreshPMSettings();
+	OSAddAtomic(lookups, &pmLookupsAvoided);
+	return settings;
+}
+
+//==============================================================================
+
+IOReturn HBFX::IOPMrootDomain_message(void *target, void *refCon, UInt32 messageType, IOService *provider, void *messageArgument, vm_size_t argSize)
+{
+	if (messageType == kIOPMMessageClamshellStateChange)
+	{
+		bool closed = (reinterpret_cast<uintptr_t>(messageArgument) & kClamshellStateBit) != 0;
+		callbackHBFX->storePMSettings(closed ? PMSettings::ClamshellClosed : 0, PMSettings::ClamshellClosed);
+	}
+	else if (messageType == kIOPMMessageSleepWakeUUIDChange)
+	{
+		// sleep starts or full wake is done, pmset could change settings meanwhile, the next lookup reads them
+		callbackHBFX->storePMSettings(0, PMSettings::Valid);
+	}
+	return kIOReturnSuccess;
+}
+
+//==============================================================================
+
+bool HBFX::isStandbyEnabled(uint32_t &standby_delay, bool &pmset_default_mode)
+{
+	UInt32 settings = pmSettingsSnapshot(2);
+	bool deepSleepEnabled = settings & PMSettings::DeepSleepEnabled;
+	bool autoPowerOffEnabled = settings & PMSettings::AutoPowerOffEnabled;
 	bool standbyEnabled = deepSleepEnabled || autoPowerOffEnabled;
 
 	if (deepSleepEnabled)
@@ -1218,11 +2077,9 @@ IOReturn HBFX::explicitlyCallSetMaintenanceWakeCalendar()
 	if (ADDPR(hbfx_config).autoHibernateMode & Configuration::DoNotOverrideWakeUpTime)
 		return KERN_SUCCESS;
 
-	struct tm tm;
 	struct timeval tv;
 	microtime(&tv);
-	gmtime_r(tv.tv_sec, &tm);
-	IOPMCalendarStruct calendar {(UInt32)tm.tm_year, (UInt8)tm.tm_mon, (UInt8)tm.tm_mday, (UInt8)tm.tm_hour, (UInt8)tm.tm_min, (UInt8)tm.tm_sec, (UInt8)kPMCalendarTypeMaintenance};
+	IOPMCalendarStruct calendar = Calendar::toPMCalendar(tv.tv_sec, kPMCalendarTypeMaintenance);
 	DBGLOG("HBFX", "call setMaintenanceWakeCalendar explicitly");
 	return IOPMrootDomain_setMaintenanceWakeCalendar(IOService::getPMRootDomain(), &calendar);
 }
@@ -1231,34 +2088,167 @@ IOReturn HBFX::explicitlyCallSetMaintenanceWakeCalendar()
 
 void HBFX::checkCapacity()
 {
-	bool forceSleep = false;
-	auto autoHibernateMode = ADDPR(hbfx_config).autoHibernateMode;
-	IOPMPowerSource *power_source = callbackHBFX->getPowerSource();
-	if (power_source && power_source->batteryInstalled() && !power_source->externalConnected() && !power_source->isCharging()) {
-		bool whenBatteryIsAtWarnLevel = (autoHibernateMode & Configuration::WhenBatteryIsAtWarnLevel);
-		bool whenBatteryAtCriticalLevel = (autoHibernateMode & Configuration::WhenBatteryAtCriticalLevel);
-		int  minimalRemainingCapacity = ((autoHibernateMode & 0xF00) >> 8);
-
-		if (whenBatteryIsAtWarnLevel && power_source->atWarnLevel()) {
-			DBGLOG("HBFX", "Auto hibernate: Battery is at warning level, capacity remaining: %d, force to sleep", power_source->capacityPercentRemaining());
-			forceSleep = true;
-		}
-
-		if (whenBatteryAtCriticalLevel && power_source->atCriticalLevel()) {
-			DBGLOG("HBFX", "Auto hibernate: battery is at critical level, capacity remaining: %d, force to sleep", power_source->capacityPercentRemaining());
-			forceSleep = true;
-		}
-
-		if (!forceSleep && minimalRemainingCapacity != 0 && power_source->capacityPercentRemaining() <= minimalRemainingCapacity)
-		{
-			DBGLOG("HBFX", "Auto hibernate: capacity remaining: %d less than minimal: %d, force to sleep", power_source->capacityPercentRemaining(), minimalRemainingCapacity);
-			forceSleep = true;
-		}
+	AutoHibernate::PowerSnapshot power = capturePowerSnapshot();
+	if (power.batteryInstalled && !power.externalConnected && !power.charging) {
+		clock_sec_t secs;
+		clock_usec_t microsecs;
+		clock_get_calendar_microtime(&secs, &microsecs);
+		dischargePredictor.add(secs, power.capacityPercentRemaining);
+	}
+	else
+		dischargePredictor.reset();
+
+	if (lastCapacityChecked && !lastCapacityForcedSleep && AutoHibernate::sameBatteryState(power, lastCapacitySnapshot))
+		return;
+
+	AutoHibernate::Reason reason = AutoHibernate::evaluateCapacity(autoHibernateOptions(), power);
+	lastCapacitySnapshot    = power;
+	lastCapacityChecked     = true;
+	lastCapacityForcedSleep = reason != AutoHibernate::Reason::None;
+	if (reason != AutoHibernate::Reason::None) {
+		DBGLOG("HBFX", "Auto hibernate: battery is at %s, capacity remaining: %d, force to sleep",
+			   reason == AutoHibernate::Reason::WarnLevel ? "warning level" :
+			   reason == AutoHibernate::Reason::CriticalLevel ? "critical level" : "minimal capacity",
+			   power.capacityPercentRemaining);
 		
-		if (forceSleep && callbackHBFX->nextSleepTimer) {
-			IOReturn result = callbackHBFX->nextSleepTimer->setTimeoutMS(2000);
+		if (nextSleepTimer) {
+			IOReturn result = nextSleepTimer->setTimeoutMS(2000);
 			if (result != kIOReturnSuccess)
 				SYSLOG("HBFX", "Failed to set timeout, error code: 0x%x", result);
 		}
 	}
 }
+
+//==============================================================================
+
+uint32_t HBFX::nextCapacityCheckDelay()
+{
+	clock_sec_t secs;
+	clock_usec_t microsecs;
+	clock_get_calendar_microtime(&secs, &microsecs);
+	uint32_t delay = powerSources.nextCheckDelay(autoHibernateOptions(), dischargePredictor, secs);
+	DBGLOG("HBFX", "next capacity check in %u ms (%lu samples)", delay, dischargePredictor.samples());
+	return delay;
+}
+
+//==============================================================================
+
+void HBFX::restartCapacityCheck()
+{
+	if (!checkCapacityTimer)
+		return;
+
+	checkCapacityTimer->cancelTimeout();
+	// discharge samples are updated by checkCapacity on workLoop
+	workLoop->closeGate();
+	uint32_t delay = nextCapacityCheckDelay();
+	workLoop->openGate();
+	checkCapacityTimer->setTimeoutMS(delay);
+}
+
+//==============================================================================
+
+void HBFX::registerPowerSourceNotifications()
+{
+	if (powerSourcePublishNotifier && powerSourceTerminateNotifier)
+		return;
+
+	if (!powerSources.lock.handle) {
+		SYSLOG("HBFX", "power source lock is not allocated, power sources are not tracked");
+		return;
+	}
+
+	OSDictionary *matching = IOService::serviceMatching("IOPMPowerSource");
+	if (matching) {
+		// existing power sources are reported immediately, new ones when they appear
+		if (!powerSourcePublishNotifier)
+			powerSourcePublishNotifier = IOService::addMatchingNotification(gIOFirstMatchNotification, matching, IOPMPowerSource_published, this);
+		if (!powerSourceTerminateNotifier)
+			powerSourceTerminateNotifier = IOService::addMatchingNotification(gIOTerminatedNotification, matching, IOPMPowerSource_terminated, this);
+		matching->release();
+		if (powerSourcePublishNotifier && powerSourceTerminateNotifier)
+			return;
+	}
+
+	SYSLOG("HBFX", "failed to register IOPMPowerSource matching notifications, registration will be retried");
+	if (!powerSourceRetryTimer && workLoop) {
+		powerSourceRetryTimer = IOTimerEventSource::timerEventSource(workLoop,
+		[](OSObject *owner, IOTimerEventSource *sender) {
+			callbackHBFX->registerPowerSourceNotifications();
+		});
+
+		if (powerSourceRetryTimer) {
+			IOReturn result = workLoop->addEventSource(powerSourceRetryTimer);
+			if (result != kIOReturnSuccess) {
+				SYSLOG("HBFX", "addEventSource failed");
+				OSSafeReleaseNULL(powerSourceRetryTimer);
+			}
+		}
+		else
+			SYSLOG("HBFX", "timerEventSource failed");
+	}
+
+	if (powerSourceRetryTimer)
+		powerSourceRetryTimer->setTimeoutMS(POWER_SOURCE_RETRY_MS);
+}
+
+//==============================================================================
+
+bool HBFX::IOPMPowerSource_published(void *target, void *refCon, IOService *newService, IONotifier *notifier)
+{
+	IOPMPowerSource *power_source = OSDynamicCast(IOPMPowerSource, newService);
+	if (!power_source)
+		return true;
+
+	if (!callbackHBFX->powerSources.add(power_source)) {
+		SYSLOG("HBFX", "power source %s is ignored, already known or too many power sources", power_source->getName());
+		return true;
+	}
+
+	DBGLOG("HBFX", "power source %s is published", power_source->getName());
+	IONotifier *interest = power_source->registerInterest(gIOGeneralInterest, IOPMPowerSource_statusChanged, callbackHBFX);
+	if (!interest)
+		SYSLOG("HBFX", "failed to register IOPMPowerSource interest notification, capacity is polled");
+
+	// power source was terminated meanwhile
+	if (interest && !callbackHBFX->powerSources.attach(power_source, interest))
+		interest->remove();
+
+	// evaluate new battery state
+	if (callbackHBFX->checkCapacityTimer)
+		callbackHBFX->checkCapacityTimer->setTimeoutUS(1);
+	return true;
+}
+
+//==============================================================================
+
+bool HBFX::IOPMPowerSource_terminated(void *target, void *refCon, IOService *newService, IONotifier *notifier)
+{
+	IOPMPowerSource *power_source = OSDynamicCast(IOPMPowerSource, newService);
+	IONotifier *interest = nullptr;
+	IOPMPowerSource *removed = power_source ? callbackHBFX->powerSources.remove(power_source, interest) : nullptr;
+	if (removed) {
+		DBGLOG("HBFX", "power source %s is terminated", removed->getName());
+		if (interest)
+			interest->remove();
+		removed->release();
+		if (callbackHBFX->checkCapacityTimer)
+			callbackHBFX->checkCapacityTimer->setTimeoutUS(1);
+	}
+	return true;
+}
+
+//==============================================================================
+
+IOReturn HBFX::IOPMPowerSource_statusChanged(void *target, void *refCon, UInt32 messageType, IOService *provider, void *messageArgument, vm_size_t argSize)
+{
+	if (messageType == kIOPMMessageBatteryStatusHasChanged && callbackHBFX->checkCapacityTimer)
+	{
+		// called in battery driver context, the check itself is done on workLoop
+		IOPMPowerSource *power_source = OSDynamicCast(IOPMPowerSource, provider);
+		if (power_source)
+			callbackHBFX->powerSources.notified(power_source);
+		callbackHBFX->checkCapacityTimer->setTimeoutUS(1);
+	}
+	return kIOReturnSuccess;
+}
@@ -10,10 +10,23 @@
 
 #include <Headers/kern_patcher.hpp>
 #include <Headers/kern_nvram.hpp>
+#include <Headers/kern_rtc.hpp>
 #include <IOKit/pwr_mgt/IOPMPowerSource.h>
 #include <IOKit/IOWorkLoop.h>
 
 #include "osx_defines.h"
+#include "kern_initonce.hpp"
+#include "kern_nvbatch.hpp"
+#include "kern_nvdump.hpp"
+#include "kern_panicinfo.hpp"
+#include "kern_panicchunks.hpp"
+#include "kern_rtcprobe.hpp"
+#include "kern_devset.hpp"
+#include "kern_stats.hpp"
+#include "kern_autohib.hpp"
+#include "kern_discharge.hpp"
+#include "kern_powerwatch.hpp"
+#include "kern_sleephist.hpp"
 
 class HBFX {
 public:
@@ -39,29 +52,174 @@ private:
 	void processKext(KernelPatcher &patcher, size_t index, mach_vm_address_t address, size_t size);
 	
 	/**
-	 *  Check the second RTC memory bank availability
+	 *  Initialize NVStorage, safe to be called from several threads at once
+	 *
+	 *  @param wait  wait for initialization running in another thread, false in panic context
+	 *
+	 *  @return true if NVStorage is ready
 	 */
-	bool checkRTCExtendedMemory();
+	bool initializeNVStorage(bool wait = true);
+	
+	// read supported options from NVRAM
+	void readConfigFromNVRAM();
 	
 	/**
-	 *  Initialize NVStorage
+	 *  Prepare everything IOHibernateSystemSleep needs except variables written by IOHibernateSystemSleep itself (runs on workLoop)
 	 *
+	 *  @param prepareDump  serialize NVRAM variables for nvram.plist ahead of IOHibernateSystemSleep
 	 */
-	bool initializeNVStorage();
+	void preArmSleep(bool prepareDump = true);
+	void releasePreArm();
 	
-	// read supported options from NVRAM
-	void readConfigFromNVRAM();
+	/**
+	 *  Start pre-arm on workLoop at sleep phase 0
+	 */
+	void schedulePreArm();
+	
+	/**
+	 *  Wait for pre-arm started at sleep phase 0 or pre-arm synchronously
+	 *
+	 *  @return true if sleep was pre-armed before the call
+	 */
+	bool completePreArm();
+	
+	/**
+	 *  Drop pre-armed state on workLoop
+	 */
+	void cancelPreArm();
+	
+	/**
+	 *  Write changed RTC/SMC variables to NVRAM in one batch, unchanged ones (same digest as written last time) are skipped
+	 */
+	void commitHibernateVariables();
+	
+	/**
+	 *  Flush all file systems (used when a file can't be flushed individually)
+	 *
+	 *  @return time spent in nanoseconds
+	 */
+	uint64_t globalSync();
+	
+	/**
+	 *  Set (or add to) a value in HBFX statistics, publishStatistics exports them as IOPMrootDomain property
+	 */
+	void updateStatistic(const char *key, uint64_t value, bool increment = false);
+	void publishStatistics();
+	
+	// return size of one AAPL,PanicInfo%04d variable
+	uint32_t panicInfoChunkSize() const;
+	
+	/**
+	 *  Reserve/release everything packA needs, so that panic info can be stored without memory allocations
+	 */
+	bool reservePanicArena();
+	void releasePanicArena();
 	
-	// return pointer to IOPMPowerSource
-	IOPMPowerSource *getPowerSource();
+	/**
+	 *  Store panic info using reserved panic arena
+	 *
+	 *  @param compressed  panic info is compressed (HBFX,PanicInfo%04d variables)
+	 *  @param flushed    set to true if nvram.plist was flushed without global sync
+	 *  @param flushTime  time spent flushing nvram.plist in nanoseconds
+	 *
+	 *  @return false if arena is not available, too small or a chunk can't be written, so that allocating path should be used
+	 */
+	bool writePanicInfoFromArena(const char *buf, uint32_t size, bool compressed, bool &flushed, uint64_t &flushTime);
+	
+	/**
+	 *  Compress raw panic text saved by packA into reserved panic arena (prefixed with PanicInfo::Header)
+	 *
+	 *  @param limit  size of uncompressed panic info, compressed data must be smaller
+	 *  @param size   size of compressed panic info
+	 *
+	 *  @return compressed panic info or nullptr when compression is disabled or useless
+	 */
+	const char *compressPanicInfo(uint32_t limit, uint32_t &size);
+	
+	/**
+	 *  Start tracking IOPMPowerSource instances (matching notifications), policy code never waits for them.
+	 *  Failed registration is retried on workLoop by powerSourceRetryTimer.
+	 */
+	void registerPowerSourceNotifications();
+	
+	static bool         IOPMPowerSource_published(void *target, void *refCon, IOService *newService, IONotifier *notifier);
+	static bool         IOPMPowerSource_terminated(void *target, void *refCon, IOService *newService, IONotifier *notifier);
+	
+	/**
+	 *  Read state of all power sources and lid state once and combine them,
+	 *  every value is requested from the battery driver only one time
+	 */
+	AutoHibernate::PowerSnapshot capturePowerSnapshot();
+	
+	// return auto hibernation options decoded from hbfx-ahbm
+	static AutoHibernate::Options autoHibernateOptions();
+	
+	/**
+	 *  Remember when sleep started (at sleep phase 0), dark wakes do not end the sleep
+	 */
+	void beginSleepSession();
+	
+	/**
+	 *  Account sleep duration in sleepHistory at full (user) wake and schedule saving it
+	 */
+	void endSleepSession();
+	
+	/**
+	 *  Load sleepHistory saved in NVRAM (once) and save learned durations (runs on workLoop),
+	 *  endSleepSession schedules it at most once per SLEEP_HISTORY_SAVE_INTERVAL
+	 */
+	void syncSleepHistory();
+	
+	/**
+	 *  Return true if current sleep is expected to last longer than standby delay (HibernateLongSleeps)
+	 */
+	bool predictLongSleep(uint32_t standby_delay);
 	
 	// return true if standby/autopoweroff is enabled
-	bool isStandbyEnabled(IOPMrootDomain* pm_root, uint32_t &standby_delay, bool &pmset_default_mode);
+	bool isStandbyEnabled(uint32_t &standby_delay, bool &pmset_default_mode);
+	
+	/**
+	 *  Read deep sleep, auto power off and clamshell state from IOPMrootDomain and store them in pmSettings
+	 *
+	 *  @return new pmSettings value
+	 */
+	UInt32 refreshPMSettings();
+	
+	/**
+	 *  Replace masked flags in pmSettings and increment its version
+	 */
+	UInt32 storePMSettings(UInt32 flags, UInt32 mask);
+	
+	/**
+	 *  Return cached pmSettings (single atomic load), settings are read from registry if they were never read
+	 *  or were invalidated by a sleep/wake UUID change (at sleep phase 0 without root domain messages)
+	 *
+	 *  @param lookups  amount of registry lookups replaced by this call
+	 */
+	UInt32 pmSettingsSnapshot(SInt32 lookups);
+	
+	static IOReturn     IOPMrootDomain_message(void *target, void *refCon, UInt32 messageType, IOService *provider, void *messageArgument, vm_size_t argSize);
 	
 	IOReturn explicitlyCallSetMaintenanceWakeCalendar();
 	
+	/**
+	 *  Put the system into sleep when battery is low, nothing is done when battery state did not change
+	 *  since the previous check (and it did not require sleep)
+	 */
 	void checkCapacity();
 	
+	/**
+	 *  Return delay (in milliseconds) of the next periodic capacity check
+	 */
+	uint32_t nextCapacityCheckDelay();
+	
+	/**
+	 *  Reschedule periodic capacity check after sleep state changes
+	 */
+	void restartCapacityCheck();
+	
+	static IOReturn     IOPMPowerSource_statusChanged(void *target, void *refCon, UInt32 messageType, IOService *provider, void *messageArgument, vm_size_t argSize);
+	
 	/**
 	 *  Hooked methods / callbacks
 	 */
@@ -75,8 +233,28 @@ private:
 	static IOReturn     X86PlatformPlugin_sleepPolicyHandler(void * target, IOPMSystemSleepPolicyVariables * vars, IOPMSystemSleepParameters * params);
 	
 	static int          packA(char *inbuf, uint32_t length, uint32_t buflen);
+	static IOReturn     IODTNVRAM_setPropertyInternal(IORegistryEntry *that, const OSSymbol *key, OSObject *value);
+	static IOReturn     IODTNVRAM_removePropertyInternal(IORegistryEntry *that, const OSSymbol *key);
+	static bool         IODTNVRAM_setProperty(IORegistryEntry *that, const OSSymbol *key, OSObject *value);
+	static void         IODTNVRAM_removeProperty(IORegistryEntry *that, const OSSymbol *key);
 	static IOReturn     IOPCIBridge_restoreMachineState(IOService *that, IOOptionBits options, IOService * device);
 	static void         IOPCIDevice_extendedConfigWrite16(IOService *that, UInt64 offset, UInt16 data);
+	static bool         IOPCIDevice_terminated(void *target, void *refCon, IOService *newService, IONotifier *notifier);
+	
+	/**
+	 *  Return true if kIOPCICommandMemorySpace has to be set for this device, decisions are cached per device
+	 */
+	bool isPatchedDevice(IOService *device);
+	
+	/**
+	 *  Return device name with location (name@location) used as a key in restore statistics
+	 */
+	static void restoreStatsKey(IOService *device, char (&key)[DeviceRestoreStats::NameLength]);
+	
+	/**
+	 *  Export restore statistics into HBFX statistics and publish them (runs on workLoop)
+	 */
+	void publishRestoreStats();
 	
 	
 	/**
@@ -91,6 +269,10 @@ private:
 	mach_vm_address_t orgX86PlatformPlugin_sleepPolicyHandler {};
 	mach_vm_address_t orgAppleRTC_setupDateTimeAlarm {};
 	mach_vm_address_t orgPackA {};
+	mach_vm_address_t orgIODTNVRAM_setPropertyInternal {};
+	mach_vm_address_t orgIODTNVRAM_removePropertyInternal {};
+	mach_vm_address_t orgIODTNVRAM_setProperty {};
+	mach_vm_address_t orgIODTNVRAM_removeProperty {};
 	mach_vm_address_t orgIOPCIBridge_restoreMachineState {};
 	mach_vm_address_t orgIOPCIDevice_extendedConfigWrite16 {};
 	
@@ -155,10 +337,125 @@ private:
 	};
 	int progressState {ProcessingState::NothingReady};
 	
+	/**
+	 *  IOLock adapter for InitOnce
+	 */
+	struct NVStorageLock {
+		IOLock *handle {nullptr};
+		void acquire() { IOLockLock(handle); }
+		bool tryAcquire() { return IOLockTryLock(handle); }
+		void release() { IOLockUnlock(handle); }
+	};
+	InitOnce<NVStorageLock> nvstorageInit;
+	
+	/**
+	 *  Root domain settings cached in one word: flags in low bits, version in high bits.
+	 *  Version is incremented by every store, refreshPMSettings uses it to detect concurrent updates.
+	 */
+	struct PMSettings {
+		enum : UInt32 {
+			DeepSleepEnabled    = 1,
+			AutoPowerOffEnabled = 2,
+			ClamshellClosed     = 4,
+			Valid               = 8,
+			FlagMask            = 0xFF,
+			VersionShift        = 8,
+			VersionIncrement    = 1U << VersionShift,
+		};
+	};
+	volatile UInt32 pmSettings {0};
+	volatile SInt32 pmLookupsAvoided {0};
+	IONotifier *rootDomainNotifier {};
+	
 	NVStorage nvstorage;
+	NVBatchStorage<PanicInfo::MaxChunks> panicBatch;
+	NVBatchStorage<2> hibernateBatch;
+	NVRAMDump nvramDump;
+	
+	/**
+	 *  Devices from hbfx-patch-pci list (all devices are patched when empty)
+	 */
+	DeviceNameSet patchedDevices;
+	DeviceDecisionCache patchDecisions;
+	IONotifier *pciTerminationNotifier {nullptr};
+	
+	/**
+	 *  restoreMachineState timings collected during wake from hibernation,
+	 *  the lock is a simple lock since restore hooks can run with interrupts disabled
+	 */
+	DeviceRestoreStats restoreStats;
+	IOSimpleLock *restoreStatsLock {nullptr};
+	IOTimerEventSource *restoreStatsTimer {};
+	
+	/**
+	 *  Objects reserved at boot time for packA
+	 */
+	struct PanicArena {
+		static constexpr uint32_t SerializationSize = 128 * 1024;
+		IORegistryEntry *nvram {nullptr};
+		const OSSymbol  *keys[PanicInfo::MaxChunks] {};
+		OSData          *chunks[PanicInfo::MaxChunks] {};
+		OSSerialize     *serializer {nullptr};
+		char            *raw {nullptr};
+		uint32_t         rawSize {0};
+		uint8_t         *compressed {nullptr};
+		uint32_t         compressedCapacity {0};
+		uint32_t         chunkSize {0};
+		uint32_t         count {0};
+		bool             compressedKeys {false};
+		bool             used {false};
+	};
+	PanicArena panicArena;
+	
+	/**
+	 *  Sleep entry work prepared at sleep phase 0
+	 */
+	struct PreArmState {
+		bool                ready {false};
+		bool                rtcExtendedMemory {false};
+		bool                nvstorageReady {false};
+		uint64_t            duration {0};
+	};
+	PreArmState preArm;
+	RTCBankProbe<RTCStorage> rtcBank;
+	uint64_t rtcVariablesDigest {0};
+	uint64_t smcVariablesDigest {0};
+	uint32_t variableWritesSkipped {0};
+	OSDictionary *statistics {};
 	IOWorkLoop *workLoop {};
 	IOTimerEventSource *nextSleepTimer {};
+	IOTimerEventSource *preArmTimer {};
+	IOTimerEventSource *nvstorageWarmUpTimer {};
 	IOTimerEventSource *checkCapacityTimer {};
+	
+	/**
+	 *  Known power sources with their status interest notifiers.
+	 *  The lock is allocated by init, a missing lock leaves the list empty since registration is not done.
+	 */
+	struct PowerSourceLock {
+		IOLock *handle {nullptr};
+		void acquire() { if (handle) IOLockLock(handle); }
+		void release() { if (handle) IOLockUnlock(handle); }
+	};
+	PowerSourceWatch<IOPMPowerSource, IONotifier, PowerSourceLock> powerSources;
+	IONotifier *powerSourcePublishNotifier {};
+	IONotifier *powerSourceTerminateNotifier {};
+	IOTimerEventSource *powerSourceRetryTimer {};
+	AutoHibernate::PowerSnapshot lastCapacitySnapshot {};
+	bool lastCapacityChecked {false};
+	bool lastCapacityForcedSleep {false};
+	DischargePredictor dischargePredictor;
+	
+	/**
+	 *  Sleep durations learned for HibernateLongSleeps
+	 */
+	SleepDurationPredictor sleepHistory;
+	IOTimerEventSource *sleepHistoryTimer {};
+	bool sleepHistoryLoaded {false};
+	bool sleepHistoryChanged {false};
+	uint64_t sleepHistorySaved {0};
+	uint64_t sleepSessionStart {0};
+	bool longSleepPredicted {false};
 	bool emulatedNVRAM {false};
 #ifdef DEBUG
 	int lastStimulus {};
@@ -0,0 +1,66 @@
+//
+//  kern_initonce.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_initonce_hpp
+#define kern_initonce_hpp
+
+/**
+ *  Lazy initialization shared by several threads.
+ *  Initialization runs under Lock, so callers arriving meanwhile block until it is finished
+ *  and then see its result. A failed initialization is retried by the next caller.
+ *  Lock provides acquire(), tryAcquire() and release(). Does not depend on kernel headers.
+ */
+template <typename Lock>
+class InitOnce {
+public:
+	Lock lock {};
+
+	/**
+	 *  @return true if initialization has succeeded, does not lock
+	 */
+	bool ready() const {
+		return __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+	}
+
+	/**
+	 *  Start initialization, ready() has to be checked again afterwards
+	 *
+	 *  @param wait  wait for a running initialization, give up instead when false (panic context)
+	 *
+	 *  @return true if finish has to be called
+	 */
+	bool begin(bool wait) {
+		if (wait) {
+			lock.acquire();
+			return true;
+		}
+		return lock.tryAcquire();
+	}
+
+	/**
+	 *  Finish initialization started by begin and publish its result
+	 *
+	 *  @param succeeded  initialization result
+	 */
+	void finish(bool succeeded) {
+		if (succeeded)
+			__atomic_store_n(&done, true, __ATOMIC_RELEASE);
+		lock.release();
+	}
+
+	/**
+	 *  Forget the result, the next caller initializes again
+	 */
+	void reset() {
+		__atomic_store_n(&done, false, __ATOMIC_RELEASE);
+	}
+
+private:
+	bool done {false};
+};
+
+#endif /* kern_initonce_hpp */
@@ -0,0 +1,123 @@
+//
+//  kern_nvbatch.cpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#include <Headers/kern_util.hpp>
+#include <Headers/kern_compat.hpp>
+
+#include "kern_nvbatch.hpp"
+
+//==============================================================================
+
+void NVBatch::reset()
+{
+	releaseSnapshots();
+	for (size_t i = 0; i < entries; i++)
+		OSSafeReleaseNULL(entry[i].object);
+	entries = 0;
+}
+
+//==============================================================================
+
+bool NVBatch::stage(const char *key, const uint8_t *src, uint32_t size)
+{
+	return stage(key, src, size, nullptr);
+}
+
+//==============================================================================
+
+bool NVBatch::stage(const char *key, const OSData *data)
+{
+	if (!data)
+		return false;
+	return stage(key, static_cast<const uint8_t *>(data->getBytesNoCopy()), data->getLength(), data);
+}
+
+//==============================================================================
+
+bool NVBatch::stage(const char *key, const uint8_t *src, uint32_t size, const OSData *object)
+{
+	if (entries >= limit || strlen(key) >= MaxKeyLength)
+		return false;
+
+	lilu_os_strlcpy(entry[entries].key, key, MaxKeyLength);
+	entry[entries].src    = src;
+	entry[entries].size   = size;
+	entry[entries].object = object;
+	entry[entries].previous = nullptr;
+	if (object)
+		object->retain();
+	entries++;
+	return true;
+}
+
+//==============================================================================
+
+bool NVBatch::commit(NVStorage &storage, uint8_t opts, bool rollback)
+{
+	counters.commits++;
+	// snapshots are taken before anything is written, a missing variable has no snapshot
+	if (rollback)
+		for (size_t i = 0; i < entries; i++)
+			entry[i].previous = storage.read(entry[i].key, NVStorage::OptRaw);
+
+	uint32_t copied = 0;
+	for (size_t i = 0; i < entries; i++)
+	{
+		// NVStorage stores raw OSData as is, anything else is copied into a new OSData
+		bool asIs = entry[i].object && opts == NVStorage::OptRaw;
+		bool written = asIs ? storage.write(entry[i].key, const_cast<OSData *>(entry[i].object), opts) :
+							  storage.write(entry[i].key, entry[i].src, entry[i].size, opts);
+		if (!written)
+		{
+			if (rollback)
+			{
+				SYSLOG("HBFX", "NVBatch: %s can't be written, rollback %lu variables", entry[i].key, i);
+				counters.rolledBack += static_cast<uint32_t>(i);
+				restore(storage, i);
+				releaseSnapshots();
+			}
+			else
+			{
+				SYSLOG("HBFX", "NVBatch: %s can't be written, %lu variables are kept", entry[i].key, i);
+				counters.written += static_cast<uint32_t>(i);
+				counters.copied  += copied;
+			}
+			return false;
+		}
+
+		if (!asIs)
+			copied++;
+	}
+
+	releaseSnapshots();
+	counters.written += static_cast<uint32_t>(entries);
+	counters.copied  += copied;
+	DBGLOG("HBFX", "NVBatch: %lu variables were written, %u copied", entries, copied);
+	return true;
+}
+
+//==============================================================================
+
+void NVBatch::restore(NVStorage &storage, size_t count)
+{
+	// newest variables are restored first, the reverse order of commit
+	while (count-- > 0)
+	{
+		bool restored = entry[count].previous ? storage.write(entry[count].key, entry[count].previous, NVStorage::OptRaw) :
+												storage.remove(entry[count].key);
+		if (!restored)
+			SYSLOG("HBFX", "NVBatch: %s can't be restored", entry[count].key);
+	}
+}
+
+//==============================================================================
+
+void NVBatch::releaseSnapshots()
+{
+	for (size_t i = 0; i < entries; i++)
+		OSSafeReleaseNULL(entry[i].previous);
+}
@@ -0,0 +1,138 @@
+//
+//  kern_nvbatch.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_nvbatch_hpp
+#define kern_nvbatch_hpp
+
+#include <Headers/kern_nvram.hpp>
+#include <libkern/c++/OSData.h>
+
+/**
+ *  A best-effort batch of NVRAM variables. NVStorage has no multi-variable commit,
+ *  so variables are written one by one and a failed write leaves the previous ones
+ *  in NVRAM unless rollback is requested. Rollback restores the values the variables had
+ *  before commit (or removes variables which did not exist), restoring is best-effort too.
+ *  Staged data is borrowed and must stay valid until commit, staged OSData objects
+ *  are retained until reset.
+ *  Entries are provided by NVBatchStorage, which is sized for the variables of its batch.
+ */
+class NVBatch {
+public:
+	/**
+	 *  Maximum key length
+	 */
+	static constexpr size_t MaxKeyLength = 64;
+
+	NVBatch(const NVBatch &) = delete;
+	NVBatch &operator=(const NVBatch &) = delete;
+
+	/**
+	 *  Batch counters, kept across reset
+	 */
+	struct Stats {
+		uint32_t commits;    // commit calls
+		uint32_t written;    // variables written by successful commits
+		uint32_t copied;     // variables whose data was copied by NVStorage
+		uint32_t rolledBack; // variables restored or removed after a failed write
+	};
+
+	/**
+	 *  Drop all staged variables, counters are kept
+	 */
+	void reset();
+
+	/**
+	 *  Stage a variable, no data is copied
+	 *
+	 *  @param key   variable name
+	 *  @param src   variable data
+	 *  @param size  data size
+	 *
+	 *  @return false if the batch is full or the key is too long
+	 */
+	bool stage(const char *key, const uint8_t *src, uint32_t size);
+
+	/**
+	 *  Stage a variable, OSData is written as is (NVStorage::OptRaw), so no data is copied
+	 *
+	 *  @param key   variable name
+	 *  @param data  variable data
+	 *
+	 *  @return false if the batch is full or the key is too long
+	 */
+	bool stage(const char *key, const OSData *data);
+
+	/**
+	 *  Write staged variables in order, stop at the first failed write
+	 *
+	 *  @param storage   initialized NVStorage instance
+	 *  @param opts      NVStorage write options
+	 *  @param rollback  restore already written variables if a write fails, previous values
+	 *                   are read before the first write
+	 *
+	 *  @return true if every staged variable was written
+	 */
+	bool commit(NVStorage &storage, uint8_t opts = NVStorage::OptRaw, bool rollback = false);
+
+	/**
+	 *  Amount of staged variables
+	 */
+	size_t count() const { return entries; }
+
+	/**
+	 *  Maximum amount of staged variables
+	 */
+	size_t capacity() const { return limit; }
+
+	/**
+	 *  Counters since the batch was created
+	 */
+	const Stats &stats() const { return counters; }
+
+protected:
+	struct Entry {
+		char key[MaxKeyLength];
+		const uint8_t *src;
+		uint32_t size;
+		const OSData *object;
+		OSData *previous;
+	};
+
+	NVBatch(Entry *entry, size_t limit) : entry(entry), limit(limit) {}
+
+private:
+	bool stage(const char *key, const uint8_t *src, uint32_t size, const OSData *object);
+
+	/**
+	 *  Restore the first count variables from their snapshots, remove variables without one
+	 */
+	void restore(NVStorage &storage, size_t count);
+
+	/**
+	 *  Release snapshots taken for rollback
+	 */
+	void releaseSnapshots();
+
+	Entry *entry;
+	size_t limit;
+	size_t entries {0};
+	Stats counters {};
+};
+
+/**
+ *  NVBatch with room for Capacity variables
+ */
+template <size_t Capacity>
+class NVBatchStorage : public NVBatch {
+public:
+	NVBatchStorage() : NVBatch(storage, Capacity) {}
+
+private:
+	Entry storage[Capacity] {};
+};
+
+#endif /* kern_nvbatch_hpp */
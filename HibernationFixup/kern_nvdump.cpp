@@ -0,0 +1,535 @@
+//
+//  kern_nvdump.cpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#include <IOKit/IODeviceTreeSupport.h>
+#include <libkern/c++/OSBoolean.h>
+#include <libkern/c++/OSCollectionIterator.h>
+#include <libkern/c++/OSNumber.h>
+#include <libkern/c++/OSString.h>
+#include <libkern/c++/OSSymbol.h>
+#include <sys/fcntl.h>
+#include <sys/mount.h>
+#include <sys/vnode.h>
+#include <sys/vnode_if.h>
+#include <kern/clock.h>
+
+#include <Headers/kern_util.hpp>
+#include <Headers/kern_file.hpp>
+#include <Headers/kern_compat.hpp>
+
+#include "kern_nvdump.hpp"
+#include "kern_plist.hpp"
+
+/**
+ *  OSData as a Plist sink
+ */
+struct FragmentSink {
+	OSData *fragment;
+	bool append(const void *data, size_t size) { return fragment->appendBytes(data, static_cast<unsigned int>(size)); }
+};
+
+//==============================================================================
+
+bool NVRAMDump::init()
+{
+	if (nvram)
+		return true;
+
+	if (gIODTPlane == nullptr || (nvram = IORegistryEntry::fromPath("/options", gIODTPlane)) == nullptr)
+	{
+		SYSLOG("HBFX", "NVRAMDump: NVRAM registry entry is not available");
+		return false;
+	}
+
+	lock = IOLockAlloc();
+	changed = OSSet::withCapacity(16);
+	if (!lock || !changed)
+	{
+		SYSLOG("HBFX", "NVRAMDump: failed to allocate change tracking, every dump is a full one");
+		tracked = false;
+	}
+
+	return true;
+}
+
+//==============================================================================
+
+void NVRAMDump::deinit()
+{
+	OSSafeReleaseNULL(fragments);
+	OSSafeReleaseNULL(changed);
+	OSSafeReleaseNULL(nvram);
+	if (lock)
+	{
+		IOLockFree(lock);
+		lock = nullptr;
+	}
+	complete = bodyValid = false;
+	if (image)
+	{
+		Buffer::deleter(image);
+		image = nullptr;
+	}
+	imageSize = imageCapacity = bodySize = 0;
+}
+
+//==============================================================================
+
+void NVRAMDump::invalidate(const OSSymbol *key)
+{
+	if (!lock || !key)
+		return;
+
+	IOLockLock(lock);
+	// fragments are rebuilt from scratch if a change can't be recorded
+	if (complete && !changed->setObject(key) && !changed->containsObject(key))
+		complete = false;
+	IOLockUnlock(lock);
+}
+
+//==============================================================================
+
+bool NVRAMDump::refresh()
+{
+	if (!nvram)
+		return false;
+
+	OSSet *keys = nullptr;
+	bool incremental = false;
+	if (lock)
+	{
+		IOLockLock(lock);
+		incremental = complete && fragments != nullptr;
+		if (incremental && changed->getCount() > 0 && (keys = OSSet::withSet(changed)) == nullptr)
+			incremental = false;
+		changed->flushCollection();
+		// changes made while variables are read are recorded for the next refresh
+		complete = tracked;
+		IOLockUnlock(lock);
+	}
+
+	uint32_t serialized = 0;
+	bool success = true;
+	if (!incremental)
+	{
+		OSDictionary *updated = serializeAll(serialized);
+		success = updated != nullptr;
+		if (success)
+		{
+			OSSafeReleaseNULL(fragments);
+			fragments = updated;
+		}
+		bodyValid = false;
+	}
+	else if (keys)
+	{
+		success = serializeChanged(keys, serialized);
+		bodyValid = bodyValid && serialized == 0;
+	}
+	OSSafeReleaseNULL(keys);
+
+	if (success)
+		DBGLOG("HBFX", "NVRAMDump: %u variables serialized (%s)", serialized, incremental ? "changed" : "all");
+	else
+		invalidateAll();
+	return success;
+}
+
+//==============================================================================
+
+void NVRAMDump::invalidateAll()
+{
+	bodyValid = false;
+	if (lock)
+	{
+		IOLockLock(lock);
+		complete = false;
+		IOLockUnlock(lock);
+	}
+}
+
+//==============================================================================
+
+bool NVRAMDump::build(const Variable *extra, size_t extraCount)
+{
+	bool success = refresh();
+
+	// extra variables are appended after the body, their names are excluded from it
+	uint64_t extras = 0xCBF29CE484222325ULL;
+	for (size_t i = 0; i < extraCount; i++)
+		for (const char *c = extra[i].key; ; c++) {
+			extras = (extras ^ static_cast<uint8_t>(*c)) * 0x100000001B3ULL;
+			if (*c == '\0')
+				break;
+		}
+
+	if (success && (!bodyValid || extras != bodyExtras))
+	{
+		imageSize = 0;
+		success = append(Plist::Prologue, sizeof(Plist::Prologue) - 1) && append(Plist::DictOpen, sizeof(Plist::DictOpen) - 1);
+
+		OSCollectionIterator *iterator = OSCollectionIterator::withCollection(fragments);
+		success = success && iterator != nullptr;
+		const OSSymbol *key;
+		while (success && (key = OSDynamicCast(OSSymbol, iterator->getNextObject())) != nullptr)
+		{
+			bool replaced = false;
+			for (size_t i = 0; i < extraCount && !replaced; i++)
+				replaced = key->isEqualTo(extra[i].key);
+			OSData *fragment = OSDynamicCast(OSData, fragments->getObject(key));
+			if (!replaced && fragment)
+				success = append(fragment->getBytesNoCopy(), fragment->getLength());
+		}
+		OSSafeReleaseNULL(iterator);
+
+		bodySize = imageSize;
+		bodyExtras = extras;
+		bodyValid = success;
+	}
+
+	imageSize = bodySize;
+	for (size_t i = 0; i < extraCount && success; i++)
+	{
+		OSData *fragment = serialize(extra[i].key, extra[i].data, extra[i].size);
+		success = fragment != nullptr && append(fragment->getBytesNoCopy(), fragment->getLength());
+		OSSafeReleaseNULL(fragment);
+	}
+
+	success = success && append(Plist::DictClose, sizeof(Plist::DictClose) - 1) && append(Plist::Epilogue, sizeof(Plist::Epilogue) - 1);
+
+	if (success)
+		DBGLOG("HBFX", "NVRAMDump: %u bytes", imageSize);
+	else
+	{
+		SYSLOG("HBFX", "NVRAMDump: failed to serialize NVRAM");
+		invalidateAll();
+	}
+
+	return success;
+}
+
+//==============================================================================
+
+OSDictionary *NVRAMDump::serializeAll(uint32_t &serialized)
+{
+	OSDictionary *variables = nvram->dictionaryWithProperties();
+	if (!variables)
+	{
+		SYSLOG("HBFX", "NVRAMDump: failed to get NVRAM variables");
+		return nullptr;
+	}
+
+	OSDictionary *updated = OSDictionary::withCapacity(variables->getCount());
+	OSCollectionIterator *iterator = OSCollectionIterator::withCollection(variables);
+	bool success = updated != nullptr && iterator != nullptr;
+
+	const OSSymbol *key;
+	while (success && (key = OSDynamicCast(OSSymbol, iterator->getNextObject())) != nullptr)
+	{
+		OSData *fragment = serialize(key->getCStringNoCopy(), variables->getObject(key));
+		success = fragment != nullptr && updated->setObject(key, fragment);
+		OSSafeReleaseNULL(fragment);
+		serialized++;
+	}
+
+	OSSafeReleaseNULL(iterator);
+	variables->release();
+	if (!success)
+		OSSafeReleaseNULL(updated);
+	return updated;
+}
+
+//==============================================================================
+
+bool NVRAMDump::serializeChanged(OSSet *keys, uint32_t &serialized)
+{
+	OSCollectionIterator *iterator = OSCollectionIterator::withCollection(keys);
+	if (!iterator)
+		return false;
+
+	bool success = true;
+	const OSSymbol *key;
+	while (success && (key = OSDynamicCast(OSSymbol, iterator->getNextObject())) != nullptr)
+	{
+		// copyProperty applies the same access rules as dictionaryWithProperties
+		OSObject *value = nvram->copyProperty(key);
+		if (value)
+		{
+			OSData *fragment = serialize(key->getCStringNoCopy(), value);
+			success = fragment != nullptr && fragments->setObject(key, fragment);
+			OSSafeReleaseNULL(fragment);
+			value->release();
+		}
+		else
+			fragments->removeObject(key);
+		serialized++;
+	}
+
+	iterator->release();
+	return success;
+}
+
+//==============================================================================
+
+bool NVRAMDump::save(const char *filename)
+{
+	lastFlushed = false;
+	lastFlushTime = 0;
+	if (!image || imageSize == 0)
+		return false;
+
+	Chunk chunk {image, imageSize};
+	return writeFile(filename, &chunk, 1, lastFlushed, lastFlushTime) == 0;
+}
+
+//==============================================================================
+
+NVRAMDump::t_vnode_rename NVRAMDump::vnodeRename {nullptr};
+
+//==============================================================================
+
+struct NVRAMDump::KernelVfs {
+	int write(const char *path, const Chunk *chunks, size_t count, bool &flushed, uint64_t &flushTime) {
+		return writeVnode(path, chunks, count, flushed, flushTime);
+	}
+
+	bool canRename() {
+		return vnodeRename != nullptr;
+	}
+
+	int rename(const char *from, const char *to) {
+		vfs_context_t ctxt = vfs_context_create(nullptr);
+		int error = vnodeRename(from, to, 0, ctxt);
+		vfs_context_rele(ctxt);
+		if (error != 0)
+			SYSLOG("HBFX", "NVRAMDump: failed to rename %s to %s, error %d", from, to, error);
+		return error;
+	}
+
+	bool flushDirectory(const char *path, uint64_t &flushTime) {
+		return NVRAMDump::flushDirectory(path, flushTime);
+	}
+};
+
+//==============================================================================
+
+int NVRAMDump::writeFile(const char *filename, const Chunk *chunks, size_t count, bool &flushed, uint64_t &flushTime)
+{
+	char temp[128];
+	snprintf(temp, sizeof(temp), "%s.tmp", filename);
+	KernelVfs vfs;
+	return AtomicFile::write(vfs, filename, temp, chunks, count, flushed, flushTime);
+}
+
+//==============================================================================
+
+int NVRAMDump::writeVnode(const char *filename, const Chunk *chunks, size_t count, bool &flushed, uint64_t &flushTime)
+{
+	flushed = false;
+	flushTime = 0;
+
+	vnode_t vnode = NULLVP;
+	vfs_context_t ctxt = vfs_context_create(nullptr);
+	int error = vnode_open(filename, O_TRUNC | O_CREAT | FWRITE | O_NOFOLLOW, 0600, VNODE_LOOKUP_NOFOLLOW, &vnode, ctxt);
+	if (error == 0)
+	{
+		off_t offset = 0;
+		for (size_t i = 0; i < count && error == 0; i++)
+		{
+			error = FileIO::writeToFile(vnode, ctxt, const_cast<void *>(chunks[i].data), chunks[i].size, offset);
+			offset += chunks[i].size;
+		}
+
+		if (error == 0)
+			flushed = fsyncVnode(vnode, ctxt, filename, flushTime);
+
+		int close_error = vnode_close(vnode, FWASWRITTEN, ctxt);
+		if (error == 0)
+			error = close_error;
+	}
+
+	vfs_context_rele(ctxt);
+
+	if (error != 0)
+	{
+		SYSLOG("HBFX", "NVRAMDump: failed to write %s, error %d", filename, error);
+		flushed = false;
+	}
+
+	return error;
+}
+
+//==============================================================================
+
+bool NVRAMDump::flushDirectory(const char *filename, uint64_t &flushTime)
+{
+	flushTime = 0;
+
+	char directory[128];
+	lilu_os_strlcpy(directory, filename, sizeof(directory));
+	char *slash = nullptr;
+	for (char *c = directory; *c != '\0'; c++)
+		if (*c == '/')
+			slash = c;
+	if (!slash)
+		return false;
+	// "/nvram.plist" is in the root directory
+	slash[slash == directory ? 1 : 0] = '\0';
+
+	bool flushed = false;
+	vnode_t vnode = NULLVP;
+	vfs_context_t ctxt = vfs_context_create(nullptr);
+	int error = vnode_lookup(directory, 0, &vnode, ctxt);
+	if (error == 0)
+	{
+		flushed = fsyncVnode(vnode, ctxt, directory, flushTime);
+		vnode_put(vnode);
+	}
+	else
+		SYSLOG("HBFX", "NVRAMDump: failed to look up %s, error %d", directory, error);
+
+	vfs_context_rele(ctxt);
+	return flushed;
+}
+
+//==============================================================================
+
+bool NVRAMDump::fsyncVnode(vnode_t vnode, vfs_context_t ctxt, const char *filename, uint64_t &flushTime)
+{
+	uint64_t start_time, end_time;
+	clock_get_uptime(&start_time);
+	int error = VNOP_FSYNC(vnode, MNT_WAIT, ctxt);
+	clock_get_uptime(&end_time);
+	absolutetime_to_nanoseconds(end_time - start_time, &flushTime);
+	if (error != 0)
+		SYSLOG("HBFX", "NVRAMDump: fsync of %s failed with error %d", filename, error);
+	return error == 0;
+}
+
+//==============================================================================
+
+int NVRAMDump::writePlist(const char *filename, const char *dict, size_t size, bool &flushed, uint64_t &flushTime)
+{
+	Chunk chunks[] {
+		{Plist::Prologue, sizeof(Plist::Prologue) - 1},
+		{dict, size},
+		{Plist::Epilogue, sizeof(Plist::Epilogue) - 1}
+	};
+
+	return writeFile(filename, chunks, arrsize(chunks), flushed, flushTime);
+}
+
+//==============================================================================
+
+uint64_t NVRAMDump::digest(const OSObject *value)
+{
+	// FNV-1a over value type and contents
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	auto mix = [&hash](const void *src, size_t size) {
+		auto bytes = static_cast<const uint8_t *>(src);
+		for (size_t i = 0; i < size; i++) {
+			hash ^= bytes[i];
+			hash *= 0x100000001B3ULL;
+		}
+	};
+
+	uint8_t type;
+	if (auto data = OSDynamicCast(OSData, value)) {
+		uint32_t length = data->getLength();
+		type = 'D';
+		mix(&type, sizeof(type));
+		mix(&length, sizeof(length));
+		mix(data->getBytesNoCopy(), length);
+	} else if (auto string = OSDynamicCast(OSString, value)) {
+		uint32_t length = string->getLength();
+		type = 'S';
+		mix(&type, sizeof(type));
+		mix(&length, sizeof(length));
+		mix(string->getCStringNoCopy(), length);
+	} else if (auto boolean = OSDynamicCast(OSBoolean, value)) {
+		type = boolean->isTrue() ? 'T' : 'F';
+		mix(&type, sizeof(type));
+	} else if (auto number = OSDynamicCast(OSNumber, value)) {
+		uint64_t num = number->unsigned64BitValue();
+		uint32_t bits = number->numberOfBits();
+		type = 'N';
+		mix(&type, sizeof(type));
+		mix(&bits, sizeof(bits));
+		mix(&num, sizeof(num));
+	} else {
+		return 0;
+	}
+
+	return hash != 0 ? hash : 1;
+}
+
+//==============================================================================
+
+OSData *NVRAMDump::serialize(const char *key, const OSObject *value)
+{
+	OSData *fragment = OSData::withCapacity(128);
+	if (!fragment)
+		return nullptr;
+
+	FragmentSink sink {fragment};
+	bool success = Plist::appendKey(sink, key, strlen(key));
+	if (auto data = OSDynamicCast(OSData, value)) {
+		success = success && Plist::appendData(sink, static_cast<const uint8_t *>(data->getBytesNoCopy()), data->getLength());
+	} else if (auto string = OSDynamicCast(OSString, value)) {
+		success = success && Plist::appendString(sink, string->getCStringNoCopy(), string->getLength());
+	} else if (auto boolean = OSDynamicCast(OSBoolean, value)) {
+		success = success && Plist::appendBoolean(sink, boolean->isTrue());
+	} else if (auto number = OSDynamicCast(OSNumber, value)) {
+		success = success && Plist::appendInteger(sink, number->numberOfBits(), number->unsigned64BitValue());
+	} else if (value) {
+		OSSerialize *s = OSSerialize::withCapacity(256);
+		success = success && s != nullptr && value->serialize(s) && fragment->appendBytes(s->text(), static_cast<unsigned int>(strlen(s->text())));
+		OSSafeReleaseNULL(s);
+	} else {
+		success = false;
+	}
+
+	if (!success)
+		OSSafeReleaseNULL(fragment);
+	return fragment;
+}
+
+//==============================================================================
+
+OSData *NVRAMDump::serialize(const char *key, const uint8_t *data, uint32_t size)
+{
+	OSData *fragment = OSData::withCapacity(128);
+	if (!fragment)
+		return nullptr;
+
+	FragmentSink sink {fragment};
+	if (!Plist::appendKey(sink, key, strlen(key)) || !Plist::appendData(sink, data, size))
+		OSSafeReleaseNULL(fragment);
+	return fragment;
+}
+
+//==============================================================================
+
+bool NVRAMDump::append(const void *data, uint32_t size)
+{
+	if (imageSize + size > imageCapacity)
+	{
+		uint32_t capacity = imageCapacity ? imageCapacity : 0x10000;
+		while (capacity < imageSize + size)
+			capacity *= 2;
+		if (!Buffer::resize(image, capacity))
+		{
+			SYSLOG("HBFX", "NVRAMDump: failed to grow image to %u bytes", capacity);
+			return false;
+		}
+		imageCapacity = capacity;
+	}
+
+	lilu_os_memcpy(image + imageSize, data, size);
+	imageSize += size;
+	return true;
+}
@@ -0,0 +1,191 @@
+//
+//  kern_nvdump.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_nvdump_hpp
+#define kern_nvdump_hpp
+
+#include <libkern/c++/OSDictionary.h>
+#include <libkern/c++/OSSerialize.h>
+#include <libkern/c++/OSSet.h>
+#include <IOKit/IORegistryEntry.h>
+#include <IOKit/IOLocks.h>
+#include <sys/vnode.h>
+
+#include "kern_atomicfile.hpp"
+
+/**
+ *  Serializes NVRAM into nvram.plist. Serialized variables are cached, HBFX reports every
+ *  changed variable (invalidate), so that only these variables are serialized again and
+ *  the rest of NVRAM is not read at all. Without change tracking every dump is a full one.
+ */
+class NVRAMDump {
+public:
+	/**
+	 *  Variable which is not stored in NVRAM but has to be present in the dump
+	 */
+	struct Variable {
+		const char    *key;
+		const uint8_t *data;
+		uint32_t       size;
+	};
+
+	bool init();
+	void deinit();
+
+	/**
+	 *  Enable change tracking, invalidate has to be called for every NVRAM variable change from now on
+	 */
+	void track() { tracked = true; }
+
+	/**
+	 *  Drop cached fragment of a changed (or removed) variable
+	 *
+	 *  @param key  variable name
+	 */
+	void invalidate(const OSSymbol *key);
+
+	/**
+	 *  Bring serialized variables up to date with NVRAM without building the image
+	 *
+	 *  @return true on success
+	 */
+	bool refresh();
+
+	/**
+	 *  Build plist image from current NVRAM contents (refreshes serialized variables as well)
+	 *
+	 *  @param extra      additional variables, they replace NVRAM variables with the same name
+	 *  @param extraCount amount of additional variables
+	 *
+	 *  @return true on success
+	 */
+	bool build(const Variable *extra = nullptr, size_t extraCount = 0);
+
+	/**
+	 *  Write last built image to a file
+	 *
+	 *  @param filename  file path
+	 *
+	 *  @return true on success
+	 */
+	bool save(const char *filename);
+
+	/**
+	 *  Last built image
+	 */
+	const char *data() const { return image; }
+	uint32_t size() const { return imageSize; }
+
+	/**
+	 *  Whether the file written by last save was flushed and how long it took (in nanoseconds)
+	 */
+	bool flushed() const { return lastFlushed; }
+	uint64_t flushTime() const { return lastFlushTime; }
+
+	using Chunk = AtomicFile::Chunk;
+
+	/**
+	 *  vnode_rename (private KPI), resolved by HBFX when available
+	 */
+	using t_vnode_rename = int (*)(const char *from, const char *to, int flags, vfs_context_t ctx);
+	static t_vnode_rename vnodeRename;
+
+	/**
+	 *  Write chunks to a file and flush this file only (VNOP_FSYNC).
+	 *  When vnodeRename is available, a temporary file is written, flushed and renamed to filename,
+	 *  then the directory is flushed (see AtomicFile::write).
+	 *
+	 *  @param filename   file path
+	 *  @param chunks     file contents
+	 *  @param count      amount of chunks
+	 *  @param flushed    set to true if the file (and the rename) was flushed, global sync is required otherwise
+	 *  @param flushTime  time spent flushing in nanoseconds
+	 *
+	 *  @return 0 on success, error code otherwise
+	 */
+	static int writeFile(const char *filename, const Chunk *chunks, size_t count, bool &flushed, uint64_t &flushTime);
+
+	/**
+	 *  Write serialized dictionary (OSSerialize text) as a plist file, see writeFile
+	 */
+	static int writePlist(const char *filename, const char *dict, size_t size, bool &flushed, uint64_t &flushTime);
+
+	/**
+	 *  Return digest of a variable value, 0 if the value type can't be digested
+	 */
+	static uint64_t digest(const OSObject *value);
+
+private:
+	/**
+	 *  AtomicFile::write file system access
+	 */
+	struct KernelVfs;
+
+	/**
+	 *  Write chunks to a file in place and flush it
+	 */
+	static int writeVnode(const char *filename, const Chunk *chunks, size_t count, bool &flushed, uint64_t &flushTime);
+
+	/**
+	 *  Flush the directory containing filename
+	 */
+	static bool flushDirectory(const char *filename, uint64_t &flushTime);
+	static bool fsyncVnode(vnode_t vnode, vfs_context_t ctxt, const char *filename, uint64_t &flushTime);
+
+	/**
+	 *  Serialize one <key>/<value> pair into a new fragment
+	 */
+	static OSData *serialize(const char *key, const OSObject *value);
+	static OSData *serialize(const char *key, const uint8_t *data, uint32_t size);
+
+	/**
+	 *  Forget cached image body and serialize all variables next time
+	 */
+	void invalidateAll();
+
+	/**
+	 *  Serialize all variables, used when changes are not tracked
+	 */
+	OSDictionary *serializeAll(uint32_t &serialized);
+
+	/**
+	 *  Serialize variables changed since previous build into cached fragments
+	 */
+	bool serializeChanged(OSSet *keys, uint32_t &serialized);
+
+	/**
+	 *  Append raw bytes to the image
+	 */
+	bool append(const void *data, uint32_t size);
+
+	IORegistryEntry *nvram {nullptr};
+	OSDictionary *fragments {nullptr};
+
+	/**
+	 *  Variables changed since previous build, valid only when fragments are complete
+	 */
+	IOLock *lock {nullptr};
+	OSSet *changed {nullptr};
+	bool tracked {false};
+	bool complete {false};
+
+	/**
+	 *  Image up to the first extra variable, rebuilt when fragments or extra variable names change
+	 */
+	uint32_t bodySize {0};
+	uint64_t bodyExtras {0};
+	bool bodyValid {false};
+
+	char *image {nullptr};
+	uint32_t imageSize {0};
+	uint32_t imageCapacity {0};
+
+	bool lastFlushed {false};
+	uint64_t lastFlushTime {0};
+};
+
+#endif /* kern_nvdump_hpp */
@@ -0,0 +1,60 @@
+//
+//  kern_panicchunks.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_panicchunks_hpp
+#define kern_panicchunks_hpp
+
+#include <stdint.h>
+
+/**
+ *  Splitting of panic info into NVRAM variables, shared by the panic arena and the NVStorage path of packA.
+ *  Nothing here allocates memory. Does not depend on kernel headers.
+ */
+namespace PanicChunks {
+	/**
+	 *  Panic log size the panic arena is reserved for
+	 */
+	static constexpr uint32_t InfoSize = 64 * 1024;
+
+	/**
+	 *  Amount of chunks needed for InfoSize bytes
+	 *
+	 *  @param chunkSize  size of one variable
+	 *  @param maxChunks  maximum amount of variables
+	 */
+	static inline uint32_t count(uint32_t chunkSize, uint32_t maxChunks) {
+		uint32_t chunks = (InfoSize + chunkSize - 1) / chunkSize;
+		return chunks < maxChunks ? chunks : maxChunks;
+	}
+
+	/**
+	 *  Pass panic info to store(index, data, size) in chunks of chunkSize bytes
+	 *
+	 *  @param buf        panic info
+	 *  @param size       panic info size
+	 *  @param chunkSize  size of one variable
+	 *  @param maxChunks  maximum amount of variables
+	 *  @param store      called for every chunk in order, false stops splitting
+	 *
+	 *  @return amount of stored chunks
+	 */
+	template <typename Store>
+	static inline uint32_t split(const char *buf, uint32_t size, uint32_t chunkSize, uint32_t maxChunks, Store store) {
+		uint32_t chunk = 0;
+		while (size > 0 && chunk < maxChunks) {
+			uint32_t part = size > chunkSize ? chunkSize : size;
+			if (!store(chunk, buf, part))
+				break;
+			chunk++;
+			size -= part;
+			buf  += part;
+		}
+		return chunk;
+	}
+}
+
+#endif /* kern_panicchunks_hpp */
@@ -0,0 +1,42 @@
+//
+//  kern_panicinfo.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_panicinfo_hpp
+#define kern_panicinfo_hpp
+
+#include <stdint.h>
+
+/**
+ *  NVRAM layout of panic info written by HBFX.
+ *  Uncompressed panic info is the packed (7-bit) buffer in AAPL,PanicInfo%04d variables, as macOS expects it.
+ *  Compressed panic info (-hbfx-compress-panic) is LZSS data of the raw panic text prefixed with Header,
+ *  it is stored in HBFX,PanicInfo%04d variables, since macOS can't decode it.
+ */
+namespace PanicInfo {
+	static constexpr const char *RawKeyFormat        {"AAPL,PanicInfo%04u"};
+	static constexpr const char *CompressedKeyFormat {"HBFX,PanicInfo%04u"};
+	static constexpr const char *CompressedKeyPrefix {"HBFX,PanicInfo"};
+
+	/**
+	 *  Maximum amount of panic info variables
+	 */
+	static constexpr uint32_t MaxChunks = 128;
+
+	/**
+	 *  Header of compressed panic info, stored in front of LZSS data in HBFX,PanicInfo0000
+	 */
+	struct Header {
+		static constexpr uint32_t Signature = 0x5A584248; // HBXZ
+		uint32_t signature;
+		uint32_t originalSize;
+		uint32_t compressedSize;
+	};
+
+	static_assert(sizeof(Header) == 12, "Header layout is a part of NVRAM format");
+}
+
+#endif /* kern_panicinfo_hpp */
@@ -0,0 +1,121 @@
+//
+//  kern_plist.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_plist_hpp
+#define kern_plist_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  XML plist encoding of NVRAM variables (the same text OSSerialize produces for OSData, OSString,
+ *  OSBoolean and OSNumber). Sink is any type with bool append(const void *data, size_t size).
+ */
+namespace Plist {
+	static constexpr char Prologue[] {
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+		"<plist version=\"1.0\">\n"
+	};
+	static constexpr char Epilogue[]  {"\n</plist>\n"};
+	static constexpr char DictOpen[]  {"<dict>"};
+	static constexpr char DictClose[] {"\n</dict>"};
+
+	template <typename Sink, size_t N>
+	bool appendLiteral(Sink &sink, const char (&literal)[N]) {
+		return sink.append(literal, N - 1);
+	}
+
+	template <typename Sink>
+	bool appendEscaped(Sink &sink, const char *str, size_t length) {
+		size_t start = 0;
+		for (size_t i = 0; i < length; i++) {
+			const char *entity = nullptr;
+			size_t entityLength = 0;
+			switch (str[i]) {
+				case '&': entity = "&amp;"; entityLength = 5; break;
+				case '<': entity = "&lt;"; entityLength = 4; break;
+				case '>': entity = "&gt;"; entityLength = 4; break;
+				default: continue;
+			}
+
+			if ((i > start && !sink.append(str + start, i - start)) || !sink.append(entity, entityLength))
+				return false;
+			start = i + 1;
+		}
+
+		return length == start || sink.append(str + start, length - start);
+	}
+
+	template <typename Sink>
+	bool appendBase64(Sink &sink, const uint8_t *data, size_t size) {
+		static constexpr char alphabet[] {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"};
+		char buf[64];
+		size_t pos = 0;
+		for (size_t i = 0; i < size; i += 3) {
+			uint32_t triple = static_cast<uint32_t>(data[i]) << 16;
+			if (i + 1 < size) triple |= static_cast<uint32_t>(data[i + 1]) << 8;
+			if (i + 2 < size) triple |= data[i + 2];
+			buf[pos++] = alphabet[(triple >> 18) & 0x3F];
+			buf[pos++] = alphabet[(triple >> 12) & 0x3F];
+			buf[pos++] = (i + 1 < size) ? alphabet[(triple >> 6) & 0x3F] : '=';
+			buf[pos++] = (i + 2 < size) ? alphabet[triple & 0x3F] : '=';
+
+			if (pos == sizeof(buf)) {
+				if (!sink.append(buf, pos))
+					return false;
+				pos = 0;
+			}
+		}
+
+		return pos == 0 || sink.append(buf, pos);
+	}
+
+	/**
+	 *  <key>...</key> of a dictionary entry, entries are separated by new lines
+	 */
+	template <typename Sink>
+	bool appendKey(Sink &sink, const char *key, size_t length) {
+		return appendLiteral(sink, "\n<key>") && appendEscaped(sink, key, length) && appendLiteral(sink, "</key>\n");
+	}
+
+	template <typename Sink>
+	bool appendData(Sink &sink, const uint8_t *data, size_t size) {
+		return appendLiteral(sink, "<data>") && appendBase64(sink, data, size) && appendLiteral(sink, "</data>");
+	}
+
+	template <typename Sink>
+	bool appendString(Sink &sink, const char *str, size_t length) {
+		return appendLiteral(sink, "<string>") && appendEscaped(sink, str, length) && appendLiteral(sink, "</string>");
+	}
+
+	template <typename Sink>
+	bool appendBoolean(Sink &sink, bool value) {
+		return value ? appendLiteral(sink, "<true/>") : appendLiteral(sink, "<false/>");
+	}
+
+	template <typename Sink>
+	bool appendInteger(Sink &sink, uint32_t bits, uint64_t value) {
+		char buf[24];
+		size_t pos = sizeof(buf);
+		do {
+			buf[--pos] = static_cast<char>('0' + bits % 10);
+			bits /= 10;
+		} while (bits != 0);
+		if (!appendLiteral(sink, "<integer size=\"") || !sink.append(buf + pos, sizeof(buf) - pos) || !appendLiteral(sink, "\">0x"))
+			return false;
+
+		pos = sizeof(buf);
+		do {
+			buf[--pos] = "0123456789abcdef"[value & 0xF];
+			value >>= 4;
+		} while (value != 0);
+		return sink.append(buf + pos, sizeof(buf) - pos) && appendLiteral(sink, "</integer>");
+	}
+}
+
+#endif /* kern_plist_hpp */
@@ -0,0 +1,221 @@
+//
+//  kern_powerwatch.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_powerwatch_hpp
+#define kern_powerwatch_hpp
+
+#include "kern_autohib.hpp"
+#include "kern_discharge.hpp"
+
+/**
+ *  Power sources known to HBFX, their status notifications and scheduling of capacity checks.
+ *  Source provides retain(), release() and the IOPMPowerSource getters used by capture(),
+ *  Notifier is the status interest notifier kept with a source, Lock provides acquire() and release().
+ *  The lock protects only the list: capture() retains the sources under it and queries them after
+ *  it is released, so a slow battery driver never blocks publish, terminate and notification handlers.
+ *  Does not depend on kernel headers.
+ */
+template <typename Source, typename Notifier, typename Lock>
+class PowerSourceWatch {
+public:
+	static constexpr size_t MaxSources = 4;
+
+	/**
+	 *  Capacity check intervals in milliseconds: polling while some source has not sent status notifications,
+	 *  fallback once every source has, and the shortest interval for predicted threshold crossing
+	 */
+	static constexpr uint32_t PollInterval     = 60000;
+	static constexpr uint32_t FallbackInterval = 600000;
+	static constexpr uint32_t MinInterval      = 15000;
+
+	Lock lock {};
+
+	/**
+	 *  Start tracking a source, it is retained
+	 *
+	 *  @return false if the source is already known or there are too many sources
+	 */
+	bool add(Source *source) {
+		lock.acquire();
+		bool added = entryCount < MaxSources && find(source) == nullptr;
+		if (added) {
+			source->retain();
+			entries[entryCount++] = {source, nullptr, 0};
+		}
+		lock.release();
+		return added;
+	}
+
+	/**
+	 *  Keep status notifier of a source
+	 *
+	 *  @return false if the source is not known (terminated meanwhile), the caller removes the notifier
+	 */
+	bool attach(Source *source, Notifier *interest) {
+		lock.acquire();
+		Entry *entry = find(source);
+		if (entry)
+			entry->interest = interest;
+		lock.release();
+		return entry != nullptr;
+	}
+
+	/**
+	 *  Stop tracking a source
+	 *
+	 *  @param interest  notifier kept with the source, the caller removes it
+	 *
+	 *  @return retained source, the caller releases it, nullptr if the source is not known
+	 */
+	Source *remove(Source *source, Notifier *&interest) {
+		lock.acquire();
+		Entry *entry = find(source);
+		Source *removed = nullptr;
+		interest = nullptr;
+		if (entry) {
+			removed  = entry->source;
+			interest = entry->interest;
+			*entry = entries[--entryCount];
+			entries[entryCount] = {};
+		}
+		lock.release();
+		return removed;
+	}
+
+	/**
+	 *  Count a status notification of a source
+	 *
+	 *  @return false if the source is not known
+	 */
+	bool notified(Source *source) {
+		lock.acquire();
+		Entry *entry = find(source);
+		if (entry)
+			entry->notifications++;
+		lock.release();
+		return entry != nullptr;
+	}
+
+	/**
+	 *  @return true if every known source has sent a status notification, so capacity checks can be rare
+	 */
+	bool notifying() {
+		lock.acquire();
+		bool result = entryCount > 0;
+		for (size_t i = 0; i < entryCount; i++)
+			result &= entries[i].notifications != 0;
+		lock.release();
+		return result;
+	}
+
+	/**
+	 *  Amount of status notifications sent by a source
+	 */
+	uint32_t notifications(Source *source) {
+		lock.acquire();
+		Entry *entry = find(source);
+		uint32_t result = entry ? entry->notifications : 0;
+		lock.release();
+		return result;
+	}
+
+	/**
+	 *  Read every value of every source once and combine them (AutoHibernate::aggregate)
+	 *
+	 *  @param snapshot  combined state, lid state is not changed
+	 *
+	 *  @return amount of sources
+	 */
+	size_t capture(AutoHibernate::PowerSnapshot &snapshot) {
+		Source *sources[MaxSources] {};
+		lock.acquire();
+		size_t count = entryCount;
+		for (size_t i = 0; i < count; i++) {
+			sources[i] = entries[i].source;
+			sources[i]->retain();
+		}
+		lock.release();
+
+		AutoHibernate::PowerSourceState states[MaxSources] {};
+		for (size_t i = 0; i < count; i++) {
+			Source *source = sources[i];
+			AutoHibernate::PowerSourceState &state = states[i];
+			state.batteryInstalled  = source->batteryInstalled();
+			state.externalConnected = source->externalConnected();
+			if (state.batteryInstalled) {
+				state.charging                 = source->isCharging();
+				state.atWarnLevel              = source->atWarnLevel();
+				state.atCriticalLevel          = source->atCriticalLevel();
+				state.currentCapacity          = source->currentCapacity();
+				state.maxCapacity              = source->maxCapacity();
+				state.capacityPercentRemaining = source->capacityPercentRemaining();
+			}
+			source->release();
+		}
+
+		snapshot = AutoHibernate::aggregate(states, count, snapshot);
+		return count;
+	}
+
+	/**
+	 *  Delay of the next capacity check in milliseconds
+	 *
+	 *  @param options    auto hibernation options
+	 *  @param predictor  discharge samples
+	 *  @param now        wall clock time in seconds
+	 */
+	uint32_t nextCheckDelay(const AutoHibernate::Options &options, const DischargePredictor &predictor, uint64_t now) {
+		// poll rarely once every power source is known to send status notifications
+		uint32_t fallback = notifying() ? FallbackInterval : PollInterval;
+		if (options.minimalRemainingCapacity == 0)
+			return fallback;
+
+		// warning and critical levels are defined by the battery driver, they can't be predicted
+		uint32_t maximum = (options.whenBatteryIsAtWarnLevel || options.whenBatteryAtCriticalLevel) ? fallback : FallbackInterval;
+		uint64_t delay = predictor.nextCheckDelay(options.minimalRemainingCapacity, now, MinInterval / 1000, maximum / 1000, fallback / 1000);
+		return static_cast<uint32_t>(delay * 1000);
+	}
+
+	/**
+	 *  Stop tracking every source
+	 *
+	 *  @param release  called with every source and its notifier outside of the lock
+	 */
+	template <typename Release>
+	void clear(Release release) {
+		while (true) {
+			lock.acquire();
+			Entry entry = entryCount > 0 ? entries[--entryCount] : Entry {};
+			if (entry.source)
+				entries[entryCount] = {};
+			lock.release();
+			if (!entry.source)
+				break;
+			release(entry.source, entry.interest);
+		}
+	}
+
+private:
+	struct Entry {
+		Source   *source;
+		Notifier *interest;
+		uint32_t  notifications;
+	};
+
+	// called with the lock held
+	Entry *find(Source *source) {
+		for (size_t i = 0; i < entryCount; i++)
+			if (entries[i].source == source)
+				return &entries[i];
+		return nullptr;
+	}
+
+	Entry entries[MaxSources] {};
+	size_t entryCount {0};
+};
+
+#endif /* kern_powerwatch_hpp */
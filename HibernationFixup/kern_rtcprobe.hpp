@@ -0,0 +1,66 @@
+//
+//  kern_rtcprobe.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_rtcprobe_hpp
+#define kern_rtcprobe_hpp
+
+#include <stdint.h>
+
+/**
+ *  Cached availability of the second RTC memory bank, RTC ports are accessed only when the answer is not known.
+ *  RTC provides bool init(), bool checkExtendedMemory() and void deinit() (RTCStorage in the kext),
+ *  it is created for every probe. Does not depend on kernel headers.
+ */
+template <typename RTC>
+class RTCBankProbe {
+public:
+	/**
+	 *  Check the second RTC memory bank availability, probe RTC if the result is not cached
+	 *
+	 *  @return true if the second bank is available
+	 */
+	bool available() {
+		if (state != State::Unknown)
+			return state == State::Available;
+
+		bool result = false;
+		RTC rtc;
+		if (rtc.init()) {
+			result = rtc.checkExtendedMemory();
+			rtc.deinit();
+			// the answer is not cached when RTC is not accessible yet
+			state = result ? State::Available : State::Unavailable;
+		}
+		probeCount++;
+		return result;
+	}
+
+	/**
+	 *  Forget cached result, so that the next check probes RTC again (firmware may reinitialize RTC)
+	 */
+	void invalidate() {
+		state = State::Unknown;
+	}
+
+	/**
+	 *  Amount of RTC probes
+	 */
+	uint32_t probes() const {
+		return probeCount;
+	}
+
+private:
+	enum class State {
+		Unknown,
+		Available,
+		Unavailable
+	};
+	State state {State::Unknown};
+	uint32_t probeCount {0};
+};
+
+#endif /* kern_rtcprobe_hpp */
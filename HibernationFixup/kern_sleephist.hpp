@@ -0,0 +1,146 @@
+//
+//  kern_sleephist.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_sleephist_hpp
+#define kern_sleephist_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ *  Histogram of past sleep durations per weekday and hour when sleep started.
+ *  Used to predict whether a sleep will last longer than standby delay, so that the system
+ *  can hibernate right away instead of waking up after standby delay to hibernate.
+ *  Fixed size (7 * 24 * Buckets bytes), can be saved to NVRAM, does not depend on kernel headers.
+ */
+class SleepDurationPredictor {
+public:
+	static constexpr size_t   Buckets    = 8;
+	static constexpr size_t   Slots      = 7 * 24;
+	static constexpr uint32_t MinSamples = 4;
+	static constexpr uint32_t PoolRadius = 1;  // hours pooled around a slot with too few samples
+
+	/**
+	 *  Saved state: signature (little endian) followed by the counters
+	 */
+	static constexpr uint32_t Signature = 0x48534248;  // HBSH
+	static constexpr size_t   StateSize = sizeof(uint32_t) + Slots * Buckets;
+
+	/**
+	 *  Lower bound (in seconds) of every duration bucket
+	 */
+	static constexpr uint32_t bucketStart(size_t bucket) {
+		return bucket == 0 ? 0 : 900U << (bucket - 1);  // 0, 15m, 30m, 1h, 2h, 4h, 8h, 16h
+	}
+
+	static constexpr size_t bucketOf(uint64_t duration) {
+		size_t bucket = Buckets - 1;
+		while (bucket > 0 && duration < bucketStart(bucket))
+			bucket--;
+		return bucket;
+	}
+
+	/**
+	 *  Account finished sleep
+	 *
+	 *  @param weekday   weekday when sleep started (0 is Sunday)
+	 *  @param hour      hour when sleep started
+	 *  @param duration  sleep duration in seconds
+	 */
+	void add(uint32_t weekday, uint32_t hour, uint64_t duration) {
+		if (weekday >= 7 || hour >= 24)
+			return;
+
+		increment(count[weekday * 24 + hour], bucketOf(duration), 1);
+	}
+
+	/**
+	 *  Predict whether sleep started at given weekday and hour lasts at least minimum seconds.
+	 *  Only buckets entirely above minimum are counted, so the prediction is conservative.
+	 *  When fewer than MinSamples sleeps started in this hour, sleeps started up to PoolRadius
+	 *  hours earlier or later are counted as well (across midnight too).
+	 *
+	 *  @param confidence  required share of such sleeps in percent
+	 */
+	bool predictLonger(uint32_t weekday, uint32_t hour, uint64_t minimum, uint32_t confidence) const {
+		if (weekday >= 7 || hour >= 24)
+			return false;
+
+		size_t slot = weekday * 24 + hour;
+		uint32_t total = 0, longer = 0;
+		accumulate(slot, minimum, total, longer);
+		for (size_t radius = 1; radius <= PoolRadius && total < MinSamples; radius++) {
+			accumulate((slot + Slots - radius) % Slots, minimum, total, longer);
+			accumulate((slot + radius) % Slots, minimum, total, longer);
+		}
+		return total >= MinSamples && longer * 100 >= confidence * total;
+	}
+
+	/**
+	 *  Save learned durations
+	 *
+	 *  @param state  StateSize bytes
+	 */
+	void save(uint8_t *state) const {
+		for (size_t i = 0; i < sizeof(uint32_t); i++)
+			state[i] = static_cast<uint8_t>(Signature >> (i * 8));
+		for (size_t i = 0; i < Slots; i++)
+			for (size_t j = 0; j < Buckets; j++)
+				state[sizeof(uint32_t) + i * Buckets + j] = count[i][j];
+	}
+
+	/**
+	 *  Add durations saved earlier to the learned ones
+	 *
+	 *  @return false if the state has a different layout
+	 */
+	bool merge(const uint8_t *state, size_t size) {
+		if (!state || size != StateSize)
+			return false;
+		uint32_t signature = 0;
+		for (size_t i = 0; i < sizeof(uint32_t); i++)
+			signature |= static_cast<uint32_t>(state[i]) << (i * 8);
+		if (signature != Signature)
+			return false;
+
+		for (size_t i = 0; i < Slots; i++)
+			for (size_t j = 0; j < Buckets; j++)
+				increment(count[i], j, state[sizeof(uint32_t) + i * Buckets + j]);
+		return true;
+	}
+
+private:
+	/**
+	 *  Add value to a counter, old samples of the slot are halved when the counter saturates,
+	 *  so that recent habits outweigh old ones
+	 */
+	static void increment(uint8_t *slot, size_t bucket, uint32_t value) {
+		uint32_t sum = slot[bucket] + value;
+		while (sum > UINT8_MAX) {
+			for (size_t i = 0; i < Buckets; i++)
+				slot[i] /= 2;
+			sum = slot[bucket] + (value + 1) / 2;
+			value = (value + 1) / 2;
+		}
+		slot[bucket] = static_cast<uint8_t>(sum);
+	}
+
+	void accumulate(size_t slot, uint64_t minimum, uint32_t &total, uint32_t &longer) const {
+		for (size_t i = 0; i < Buckets; i++) {
+			total += count[slot][i];
+			if (bucketStart(i) >= minimum)
+				longer += count[slot][i];
+		}
+	}
+
+	uint8_t count[Slots][Buckets] {};
+};
+
+static_assert(SleepDurationPredictor::bucketOf(0) == 0 && SleepDurationPredictor::bucketOf(899) == 0, "shortest bucket");
+static_assert(SleepDurationPredictor::bucketOf(3600) == 3 && SleepDurationPredictor::bucketOf(100000) == 7, "hour and longest buckets");
+
+#endif /* kern_sleephist_hpp */
@@ -7,6 +7,8 @@
 
 #include <Headers/plugin_start.hpp>
 #include <Headers/kern_api.hpp>
+#include <Headers/kern_iokit.hpp>
+#include <IOKit/IORegistryEntry.h>
 
 #include "kern_config.hpp"
 #include "kern_hbfx.hpp"
@@ -27,43 +29,40 @@ const char *Configuration::bootargBeta[] {
 
 Configuration ADDPR(hbfx_config);
 
-void Configuration::readArguments() {
-	if (checkKernelArgument(bootargDumpNvram)) {
-		dumpNvram = true;
-		DBGLOG("HBFX", "boot-arg %s specified, turn on writing NVRAM to file", bootargDumpNvram);
-	}
+void Configuration::readNVRAM(IORegistryEntry *entry) {
+	for (int id = 0; id < OptionCount; id++) {
+		const Option &option = options[id];
+		if (!isWanted(static_cast<OptionId>(id), NVRAM))
+			continue;
+
+		OSObject *object = entry->getProperty(option.nvram);
+		if (!object)
+			continue;
 
-	if ((getKernelVersion() == KernelVersion::Sierra && getKernelMinorVersion() >= 1) ||
-		getKernelVersion() >= KernelVersion::HighSierra)
-	{
-		if (PE_parse_boot_argn(bootargPatchPCIWithList, ignored_device_list, sizeof(ignored_device_list)))
-		{
-			DBGLOG("HBFX", "boot-arg %s specified, ignored device list: %s", bootargPatchPCIWithList, ignored_device_list);
-			if (strstr(ignored_device_list, "none") != nullptr ||
-				strstr(ignored_device_list, "false") != nullptr ||
-				strstr(ignored_device_list, "off") != nullptr)
-			{
-				patchPCIFamily = false;
-				DBGLOG("HBFX", "Turn off PCIFamily patching since %s contains none, false or off", bootargPatchPCIWithList);
+		switch (option.type) {
+			case Option::Flag: {
+				auto value = OSDynamicCast(OSBoolean, object);
+				if (value) {
+					bool flag = value->isTrue();
+					set(static_cast<OptionId>(id), &flag, sizeof(flag), NVRAM);
+				}
+				break;
+			}
+			case Option::String: {
+				auto value = OSDynamicCast(OSString, object);
+				if (value && value->getLength() != 0)
+					set(static_cast<OptionId>(id), value->getCStringNoCopy(), value->getLength(), NVRAM);
+				break;
+			}
+			case Option::Number: {
+				int value = 0;
+				if (WIOKit::getOSDataValue(object, option.nvram, value))
+					set(static_cast<OptionId>(id), &value, sizeof(value), NVRAM);
+				break;
 			}
 		}
-		
-		if (checkKernelArgument(bootargDisablePatchPCI))
-		{
-			patchPCIFamily = false;
-			DBGLOG("HBFX", "boot-arg %s specified, turn off PCIFamily patching", bootargDisablePatchPCI);
-		}
-	}
-	else
-	{
-		patchPCIFamily = false;
-		DBGLOG("HBFX", "Running on Darwin %d.%d. Turn off PCIFamily patching since it is not required in this macOS version", getKernelVersion(), getKernelMinorVersion());
-	}
-
-	if (PE_parse_boot_argn(bootargAutoHibernateMode, &autoHibernateMode, sizeof(autoHibernateMode)))
-	{
-		DBGLOG("HBFX", "boot-arg %s specified, value: %d", bootargAutoHibernateMode, autoHibernateMode);
 	}
+	update();
 }
 
 PluginConfiguration ADDPR(config) {
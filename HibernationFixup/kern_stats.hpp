@@ -0,0 +1,125 @@
+//
+//  kern_stats.hpp
+//  HibernationFixup
+//
+//  Copyright © 2020 lvs1974. All rights reserved.
+//
+
+#ifndef kern_stats_hpp
+#define kern_stats_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ *  Histogram with power of two buckets: bucket 0 counts values 0 and 1, bucket i counts
+ *  values in [2^i, 2^(i+1)), the last bucket counts everything above as well.
+ *  Does not depend on kernel headers.
+ */
+template <size_t N>
+struct Log2Histogram {
+	static_assert(N > 1 && N <= 64, "unsupported amount of buckets");
+	static constexpr size_t Buckets = N;
+
+	uint32_t bucket[N] {};
+	uint32_t count {0};
+	uint64_t total {0};
+	uint64_t maximum {0};
+
+	static constexpr size_t bucketOf(uint64_t value) {
+		size_t index = 0;
+		while (value > 1 && index < N - 1) {
+			value >>= 1;
+			index++;
+		}
+		return index;
+	}
+
+	void add(uint64_t value) {
+		bucket[bucketOf(value)]++;
+		count++;
+		total += value;
+		if (value > maximum)
+			maximum = value;
+	}
+};
+
+/**
+ *  restoreMachineState statistics collected per device (IOService pointer) during wake from hibernation.
+ *  Recording neither allocates nor resolves device names, so it can be done with interrupts disabled
+ *  under a simple lock, names are resolved when the statistics are published.
+ */
+class DeviceRestoreStats {
+public:
+	static constexpr size_t MaxDevices       = 32;
+	static constexpr size_t NameLength       = 48;
+	static constexpr size_t HistogramBuckets = 20;
+
+	struct Device {
+		const void                     *device;
+		Log2Histogram<HistogramBuckets> restoreUS;
+		uint32_t                        memorySpaceInjected;
+	};
+
+	/**
+	 *  Account one restoreMachineState call which took given amount of microseconds
+	 *
+	 *  @return true if the device was added to the table by this call
+	 */
+	bool recordRestore(const void *device, uint64_t us) {
+		bool added = false;
+		Device *entry = find(device, added);
+		if (entry)
+			entry->restoreUS.add(us);
+		return added;
+	}
+
+	/**
+	 *  Account kIOPCICommandMemorySpace added to a command register write
+	 *
+	 *  @return true if the device was added to the table by this call
+	 */
+	bool recordInjection(const void *device) {
+		bool added = false;
+		Device *entry = find(device, added);
+		if (entry)
+			entry->memorySpaceInjected++;
+		return added;
+	}
+
+	size_t count() const { return devices; }
+	const Device &device(size_t index) const { return entry[index]; }
+
+	/**
+	 *  Amount of records lost because the device table was full
+	 */
+	uint32_t dropped() const { return droppedRecords; }
+
+private:
+	/**
+	 *  Find device, a new device is added when there is space left
+	 */
+	Device *find(const void *device, bool &added) {
+		if (!device)
+			return nullptr;
+
+		for (size_t i = 0; i < devices; i++)
+			if (entry[i].device == device)
+				return &entry[i];
+
+		if (devices == MaxDevices) {
+			droppedRecords++;
+			return nullptr;
+		}
+
+		added = true;
+		entry[devices].device = device;
+		return &entry[devices++];
+	}
+
+	Device entry[MaxDevices] {};
+	size_t devices {0};
+	uint32_t droppedRecords {0};
+};
+
+#endif /* kern_stats_hpp */
@@ -44,6 +44,11 @@
  */
 #define kIOPMUserIsActiveKey                    "IOPMUserIsActive"
 
+/* kIOPMMessageSleepWakeUUIDChange
+ * Root domain message sent when sleep/wake UUID is set at sleep entry and cleared at full wake.
+ */
+#define kIOPMMessageSleepWakeUUIDChange         iokit_family_msg(sub_iokit_powermanagement, 0x140)
+
 struct IOPMSystemSleepPolicyVariables
 {
 	uint32_t    signature;           // kIOPMSystemSleepPolicySignature
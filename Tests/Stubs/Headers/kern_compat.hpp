@@ -0,0 +1,6 @@
+//
+//  kern_compat.hpp
+//  HibernationFixup host tests
+//
+//  Empty stub, compatibility definitions are not needed on the host.
+//
@@ -0,0 +1,72 @@
+//
+//  kern_efi.hpp
+//  HibernationFixup host tests
+//
+//  EFI runtime services with scripted variables, every getVariable call is counted.
+//
+
+#ifndef host_kern_efi_hpp
+#define host_kern_efi_hpp
+
+#include <stdint.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#define EFI_SUCCESS          0ULL
+#define EFI_ERROR64(a)       (0x8000000000000000ULL | (a))
+#define EFI_BUFFER_TOO_SMALL 5ULL
+#define EFI_NOT_FOUND        14ULL
+
+struct EFI_GUID {
+	uint32_t Data1;
+	uint16_t Data2;
+	uint16_t Data3;
+	uint8_t  Data4[8];
+};
+
+static constexpr EFI_GUID HostLiluReadOnlyGuid { 0xE09B9297, 0x7928, 0x4440, { 0x9A, 0xAB, 0xD1, 0xF8, 0x53, 0x6F, 0xBF, 0x0A } };
+
+class EfiRuntimeServices {
+public:
+	// a reference needs no out-of-line definition in C++14
+	static constexpr const EFI_GUID &LiluReadOnlyGuid = HostLiluReadOnlyGuid;
+
+	uint64_t getVariable(const char16_t *name, const EFI_GUID *guid, uint32_t *attr, uint64_t *size, void *data) {
+		(void)attr;
+		calls++;
+		auto it = variables.find(key(name, guid));
+		if (it == variables.end())
+			return EFI_ERROR64(EFI_NOT_FOUND);
+		uint64_t length = it->second.size();
+		if (*size < length) {
+			*size = length;
+			return EFI_ERROR64(EFI_BUFFER_TOO_SMALL);
+		}
+		memcpy(data, it->second.data(), it->second.size());
+		*size = length;
+		return EFI_SUCCESS;
+	}
+
+	/**
+	 *  Add a variable
+	 */
+	void set(const char16_t *name, const EFI_GUID *guid, const void *data, size_t size) {
+		auto bytes = static_cast<const uint8_t *>(data);
+		variables[key(name, guid)].assign(bytes, bytes + size);
+	}
+
+	long calls {0};
+
+private:
+	static std::u16string key(const char16_t *name, const EFI_GUID *guid) {
+		std::u16string result(name);
+		result.append(reinterpret_cast<const char16_t *>(guid), sizeof(EFI_GUID) / sizeof(char16_t));
+		return result;
+	}
+
+	std::map<std::u16string, std::vector<uint8_t>> variables;
+};
+
+#endif /* host_kern_efi_hpp */
@@ -0,0 +1,98 @@
+//
+//  kern_nvram.hpp
+//  HibernationFixup host tests
+//
+//  In-memory NVStorage with the subset of the Lilu interface used by HBFX sources built on the host.
+//  Variables are kept as OSData, so a test can tell whether written data was copied,
+//  and any write can be made to fail.
+//
+
+#ifndef host_kern_nvram_hpp
+#define host_kern_nvram_hpp
+
+#include <libkern/c++/OSData.h>
+#include <map>
+#include <string>
+
+#define LILU_READ_ONLY_GUID "E09B9297-7928-4440-9AAB-D1F8536FBF0A"
+#define NVRAM_PREFIX(x, y) x ":" y
+
+class NVStorage {
+public:
+	enum Options {
+		OptAuto       = 0,
+		OptRaw        = 1,
+		OptCompressed = 2,
+		OptEncrypted  = 4,
+		OptChecksum   = 8
+	};
+
+	~NVStorage() {
+		for (auto &variable : variables)
+			variable.second->release();
+	}
+
+	OSData *read(const char *key, uint8_t opts = OptAuto) {
+		(void)opts;
+		reads++;
+		auto it = variables.find(key);
+		if (it == variables.end())
+			return nullptr;
+		return OSData::withBytes(it->second->getBytesNoCopy(), it->second->getLength());
+	}
+
+	bool write(const char *key, const uint8_t *src, uint32_t size, uint8_t opts = OptAuto) {
+		auto data = OSData::withBytes(src, size);
+		bool result = write(key, data, opts);
+		data->release();
+		return result;
+	}
+
+	bool write(const char *key, const OSData *data, uint8_t opts = OptAuto) {
+		(void)opts;
+		if (writes++ == failWrite)
+			return false;
+		data->retain();
+		auto it = variables.find(key);
+		if (it != variables.end()) {
+			it->second->release();
+			it->second = data;
+		} else {
+			variables[key] = data;
+		}
+		return true;
+	}
+
+	bool remove(const char *key, bool sync = true) {
+		(void)sync;
+		removes++;
+		auto it = variables.find(key);
+		if (it == variables.end())
+			return false;
+		it->second->release();
+		variables.erase(it);
+		return true;
+	}
+
+	/**
+	 *  Stored object of a variable, nullptr if it does not exist
+	 */
+	const OSData *stored(const char *key) const {
+		auto it = variables.find(key);
+		return it != variables.end() ? it->second : nullptr;
+	}
+
+	/**
+	 *  Index of the write call to fail, counted from 0, -1 never fails
+	 */
+	long failWrite {-1};
+
+	long reads {0};
+	long writes {0};
+	long removes {0};
+
+private:
+	std::map<std::string, const OSData *> variables;
+};
+
+#endif /* host_kern_nvram_hpp */
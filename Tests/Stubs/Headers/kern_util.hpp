@@ -0,0 +1,95 @@
+//
+//  kern_util.hpp
+//  HibernationFixup host tests
+//
+//  Minimal subset of Lilu kern_util.hpp used by HBFX sources built on the host.
+//
+
+#ifndef host_kern_util_hpp
+#define host_kern_util_hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYSLOG(module, str, ...) fprintf(stderr, module ": " str "\n", ## __VA_ARGS__)
+#define DBGLOG(module, str, ...) do { if (false) fprintf(stderr, module ": " str "\n", ## __VA_ARGS__); } while (0)
+
+#define lilu_os_memcpy memcpy
+
+static inline size_t lilu_os_strlcpy(char *dst, const char *src, size_t size) {
+	size_t length = strlen(src);
+	if (size > 0) {
+		size_t count = length < size ? length : size - 1;
+		memcpy(dst, src, count);
+		dst[count] = '\0';
+	}
+	return length;
+}
+
+#define ADDPR(a) a
+
+template <typename T, typename Y>
+static inline T min(T a, Y b) { return a < static_cast<T>(b) ? a : static_cast<T>(b); }
+
+using KernelVersion_t = int;
+namespace KernelVersion {
+	static constexpr KernelVersion_t Sierra     = 16;
+	static constexpr KernelVersion_t HighSierra = 17;
+}
+
+/**
+ *  Kernel version and boot-args seen by host tests, boot-args are separated by spaces
+ */
+struct HostKernel {
+	static KernelVersion_t &version() { static KernelVersion_t value = 19; return value; }
+	static const char *&bootArgs() { static const char *value = ""; return value; }
+
+	/**
+	 *  Find name or name=value in boot-args
+	 *
+	 *  @return value (empty for a flag) or nullptr
+	 */
+	static const char *find(const char *name) {
+		size_t length = strlen(name);
+		for (const char *arg = bootArgs(); *arg; ) {
+			const char *end = strchr(arg, ' ');
+			if (!end)
+				end = arg + strlen(arg);
+			if (static_cast<size_t>(end - arg) >= length && strncmp(arg, name, length) == 0 && (arg[length] == ' ' || arg[length] == '\0' || arg[length] == '='))
+				return arg[length] == '=' ? arg + length + 1 : arg + length;
+			arg = *end ? end + 1 : end;
+		}
+		return nullptr;
+	}
+};
+
+static inline KernelVersion_t getKernelVersion() { return HostKernel::version(); }
+static inline int getKernelMinorVersion() { return 0; }
+
+static inline bool checkKernelArgument(const char *name) {
+	const char *value = HostKernel::find(name);
+	return value && (*value == ' ' || *value == '\0');
+}
+
+/**
+ *  Numbers are parsed into int, anything else is copied as a string like xnu does it
+ */
+static inline bool PE_parse_boot_argn(const char *name, void *buf, int size) {
+	const char *value = HostKernel::find(name);
+	if (!value || *value == ' ' || *value == '\0')
+		return false;
+	size_t length = strcspn(value, " ");
+	if (value[0] >= '0' && value[0] <= '9') {
+		int number = static_cast<int>(strtol(value, nullptr, 0));
+		memcpy(buf, &number, min(sizeof(number), size));
+	} else {
+		size_t count = min(length, size - 1);
+		memcpy(buf, value, count);
+		static_cast<char *>(buf)[count] = '\0';
+	}
+	return true;
+}
+
+#endif /* host_kern_util_hpp */
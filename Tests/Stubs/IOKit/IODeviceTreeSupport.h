@@ -0,0 +1,6 @@
+//
+//  IODeviceTreeSupport.h
+//  HibernationFixup host tests
+//
+//  Empty stub, nothing from this header is used by portable HBFX headers.
+//
@@ -0,0 +1,20 @@
+//
+//  IOLocks.h
+//  HibernationFixup host tests
+//
+//  IOSimpleLock backed by std::mutex for HBFX sources built on the host.
+//
+
+#ifndef host_IOLocks_h
+#define host_IOLocks_h
+
+#include <mutex>
+
+typedef std::mutex IOSimpleLock;
+
+static inline IOSimpleLock *IOSimpleLockAlloc() { return new std::mutex; }
+static inline void IOSimpleLockFree(IOSimpleLock *lock) { delete lock; }
+static inline void IOSimpleLockLock(IOSimpleLock *lock) { lock->lock(); }
+static inline void IOSimpleLockUnlock(IOSimpleLock *lock) { lock->unlock(); }
+
+#endif /* host_IOLocks_h */
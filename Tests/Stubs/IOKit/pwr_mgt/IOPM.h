@@ -0,0 +1,29 @@
+//
+//  IOPM.h
+//  HibernationFixup host tests
+//
+//  Minimal subset of IOKit/pwr_mgt/IOPM.h used by portable HBFX headers.
+//
+
+#ifndef host_IOPM_h
+#define host_IOPM_h
+
+#include <stdint.h>
+
+typedef uint8_t  UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int32_t  SInt32;
+
+struct IOPMCalendarStruct {
+	UInt32 year;
+	UInt8  month;
+	UInt8  day;
+	UInt8  hour;
+	UInt8  minute;
+	UInt8  second;
+	UInt8  selector;
+};
+
+#endif /* host_IOPM_h */
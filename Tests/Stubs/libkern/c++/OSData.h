@@ -0,0 +1,44 @@
+//
+//  OSData.h
+//  HibernationFixup host tests
+//
+//  Reference counted byte buffer with the subset of OSData used by HBFX sources built on the host.
+//
+
+#ifndef host_OSData_h
+#define host_OSData_h
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#define OSSafeReleaseNULL(inst) do { if (inst) (inst)->release(); (inst) = nullptr; } while (0)
+
+class OSData {
+public:
+	static OSData *withBytes(const void *bytes, unsigned int length) {
+		auto data = new OSData;
+		data->bytes.assign(static_cast<const uint8_t *>(bytes), static_cast<const uint8_t *>(bytes) + length);
+		return data;
+	}
+
+	const void *getBytesNoCopy() const { return bytes.data(); }
+	unsigned int getLength() const { return static_cast<unsigned int>(bytes.size()); }
+
+	void retain() const { references++; }
+	void release() const { if (--references == 0) delete this; }
+
+	/**
+	 *  Objects which are not released yet
+	 */
+	static int &alive() { static int count = 0; return count; }
+
+private:
+	OSData() { alive()++; }
+	~OSData() { alive()--; }
+
+	std::vector<uint8_t> bytes;
+	mutable int references {1};
+};
+
+#endif /* host_OSData_h */
@@ -0,0 +1,93 @@
+//
+//  bench_devset.cpp
+//  HibernationFixup host tests
+//
+//  Cost of the IOPCIDevice_extendedConfigWrite16 decision on a synthetic PCI tree of 200 devices,
+//  every device writes its command register a few times during wake:
+//  substring - strlen and strstr of hbfx-patch-pci for every write (previous behaviour)
+//  set       - exact match in DeviceNameSet
+//  cache     - decision cached per device, DeviceNameSet is searched once per device
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "kern_devset.hpp"
+
+/**
+ *  Device with virtual getName like IOService
+ */
+struct Device {
+	virtual ~Device() = default;
+	virtual const char *getName() const { return name.c_str(); }
+	std::string name;
+};
+
+static constexpr int Devices = 200;
+static constexpr int Writes  = 4;
+static constexpr int Rounds  = 2000;
+static const char *List = "XHC,IMEI,IGPU";
+
+static std::vector<Device *> pciTree()
+{
+	static const char *bridges[] {"RP01", "RP02", "RP03", "RP04", "RP05", "RP06", "RP07", "RP08", "PEG0", "PEG1"};
+	static const char *functions[] {"XHC", "IMEI", "IGPU", "HDEF", "SATA", "SBUS", "LPCB", "GFX0", "PXSX", "ARPT", "GIGE", "EH01"};
+	std::vector<Device *> tree;
+	for (int i = 0; static_cast<int>(tree.size()) < Devices; i++) {
+		auto device = new Device;
+		device->name = i % 4 == 0 ? bridges[(i / 4) % 10] : functions[i % 12];
+		tree.push_back(device);
+	}
+	return tree;
+}
+
+template <typename Decide>
+static double measure(const std::vector<Device *> &tree, Decide decide, unsigned &matched)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < Rounds; round++)
+		for (auto device : tree)
+			for (int write = 0; write < Writes; write++)
+				matched += decide(device);
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (Rounds * Devices * Writes);
+}
+
+int main()
+{
+	std::vector<Device *> tree = pciTree();
+	char list[256];
+	strncpy(list, List, sizeof(list));
+	DeviceNameSet set;
+	set.parse(list);
+	DeviceDecisionCache cache;
+	cache.init();
+
+	unsigned substringMatches = 0, setMatches = 0, cacheMatches = 0;
+	double substring = measure(tree, [&](Device *device) {
+		return strlen(list) == 0 || strstr(list, device->getName()) != nullptr;
+	}, substringMatches);
+	double exact = measure(tree, [&](Device *device) {
+		return set.contains(device->getName());
+	}, setMatches);
+	double cached = measure(tree, [&](Device *device) {
+		bool decision;
+		if (cache.lookup(device, decision))
+			return decision;
+		decision = set.contains(device->getName());
+		cache.insert(device, decision);
+		return decision;
+	}, cacheMatches);
+
+	printf("%d devices, %d writes per device, list \"%s\"\n", Devices, Writes, List);
+	printf("substring: %6.1f ns per write (%u matches)\n", substring, substringMatches);
+	printf("set:       %6.1f ns per write (%u matches)\n", exact, setMatches);
+	printf("cache:     %6.1f ns per write (%u matches, %u hits, %u misses)\n", cached, cacheMatches, cache.stats().hits, cache.stats().misses);
+
+	cache.deinit();
+	for (auto device : tree)
+		delete device;
+	return 0;
+}
@@ -0,0 +1,39 @@
+//
+//  bench_gmtime.cpp
+//  HibernationFixup host tests
+//
+//  Compare HBFX gmtime_r speed with libc gmtime_r.
+//
+
+#include <stdio.h>
+#include <time.h>
+#include <chrono>
+
+#include "gmtime_shim.hpp"
+
+int main()
+{
+	constexpr int64_t Count = 20000000;
+	constexpr int64_t Step  = 7919;   // walks over ~5000 years
+	volatile int sink = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int64_t i = 0; i < Count; i++) {
+		int fields[TmFieldCount];
+		hbfxGmtime(i * Step, fields);
+		sink += fields[3];
+	}
+	auto middle = std::chrono::steady_clock::now();
+	for (int64_t i = 0; i < Count; i++) {
+		time_t t = static_cast<time_t>(i * Step);
+		struct tm tm;
+		gmtime_r(&t, &tm);
+		sink += tm.tm_mday;
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	double hbfx = std::chrono::duration<double, std::nano>(middle - start).count() / Count;
+	double libc = std::chrono::duration<double, std::nano>(end - middle).count() / Count;
+	printf("HBFX gmtime_r: %.1f ns/call, libc gmtime_r: %.1f ns/call\n", hbfx, libc);
+	return sink == 42 ? 1 : 0;
+}
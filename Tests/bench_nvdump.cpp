@@ -0,0 +1,108 @@
+//
+//  bench_nvdump.cpp
+//  HibernationFixup host tests
+//
+//  nvram.plist dump strategies with kern_plist.hpp encoding:
+//  full     - copy all variables, digest every value and serialize changed ones (previous NVRAMDump)
+//  tracked  - serialize only variables reported as changed and reassemble the image (current NVRAMDump)
+//
+
+#include <stdio.h>
+#include <chrono>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+
+#include "kern_plist.hpp"
+#include "string_sink.hpp"
+
+using Variables = std::map<std::string, std::string>;
+
+static std::string serialize(const std::string &key, const std::string &value)
+{
+	StringSink sink;
+	Plist::appendKey(sink, key.data(), key.size());
+	Plist::appendData(sink, reinterpret_cast<const uint8_t *>(value.data()), value.size());
+	return sink.text;
+}
+
+static uint64_t digest(const std::string &value)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for (unsigned char c : value)
+		hash = (hash ^ c) * 0x100000001B3ULL;
+	return hash;
+}
+
+static void compose(const std::map<std::string, std::string> &fragments, std::string &image)
+{
+	image.assign(Plist::Prologue);
+	image += Plist::DictOpen;
+	for (auto &fragment : fragments)
+		image += fragment.second;
+	image += Plist::DictClose;
+	image += Plist::Epilogue;
+}
+
+int main()
+{
+	std::mt19937 random(42);
+	Variables nvram;
+	char key[96];
+	for (int i = 0; i < 200; i++) {
+		snprintf(key, sizeof(key), "7C436110-AB2A-4BBB-A880-FE41995C9F82:variable-%03d", i);
+		nvram[key] = std::string(64 + random() % 1024, static_cast<char>('a' + i % 26));
+	}
+	size_t total = 0;
+	for (auto &variable : nvram)
+		total += variable.second.size();
+
+	printf("%zu variables, %zu bytes of NVRAM\n%8s %12s %12s\n", nvram.size(), total, "changed", "full_us", "tracked_us");
+	for (int changes : {0, 2, 20}) {
+		constexpr int Rounds = 200;
+		std::map<std::string, std::pair<uint64_t, std::string>> digested;
+		std::map<std::string, std::string> fragments;
+		for (auto &variable : nvram) {
+			digested[variable.first] = {digest(variable.second), serialize(variable.first, variable.second)};
+			fragments[variable.first] = digested[variable.first].second;
+		}
+
+		double full = 0, tracked = 0;
+		std::string image;
+		for (int round = 0; round < Rounds; round++) {
+			std::set<std::string> dirty;
+			for (int i = 0; i < changes; i++) {
+				auto it = std::next(nvram.begin(), random() % nvram.size());
+				it->second[random() % it->second.size()] ^= 1;
+				dirty.insert(it->first);
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			{
+				Variables copy = nvram;
+				std::map<std::string, std::string> current;
+				for (auto &variable : copy) {
+					auto &cached = digested[variable.first];
+					uint64_t hash = digest(variable.second);
+					if (hash != cached.first)
+						cached = {hash, serialize(variable.first, variable.second)};
+					current[variable.first] = cached.second;
+				}
+				compose(current, image);
+			}
+			auto middle = std::chrono::steady_clock::now();
+			{
+				for (auto &name : dirty)
+					fragments[name] = serialize(name, nvram[name]);
+				if (!dirty.empty() || image.empty())
+					compose(fragments, image);
+			}
+			auto end = std::chrono::steady_clock::now();
+			full += std::chrono::duration<double, std::micro>(middle - start).count();
+			tracked += std::chrono::duration<double, std::micro>(end - middle).count();
+		}
+		printf("%8d %12.1f %12.1f\n", changes, full / Rounds, tracked / Rounds);
+	}
+	return 0;
+}
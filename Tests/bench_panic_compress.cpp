@@ -0,0 +1,36 @@
+//
+//  bench_panic_compress.cpp
+//  HibernationFixup host tests
+//
+//  Compare NVRAM usage of raw, packed and compressed panic info and decoder speed.
+//
+
+#include <stdio.h>
+#include <chrono>
+
+#include "panic_decode.hpp"
+#include "panic_sample.hpp"
+
+int main()
+{
+	printf("%8s %8s %12s %12s %10s %10s\n", "text", "packed", "lzss(text)", "lzss(packed)", "chunks768", "decode_us");
+	for (size_t size : {4096, 16384, 65536}) {
+		const std::string text = samplePanic(size);
+		const std::string packed = packA(text);
+		auto fromText = LZSS::compress(reinterpret_cast<const uint8_t *>(text.data()), text.size());
+		auto fromPacked = LZSS::compress(reinterpret_cast<const uint8_t *>(packed.data()), packed.size());
+
+		constexpr int Rounds = 200;
+		std::string output(text.size(), '\0');
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < Rounds; i++)
+			LZSS::decompress(reinterpret_cast<uint8_t *>(&output[0]), output.size(), fromText.data(), fromText.size());
+		auto end = std::chrono::steady_clock::now();
+
+		size_t stored = sizeof(PanicInfo::Header) + fromText.size();
+		printf("%8zu %8zu %12zu %12zu %4zu->%-5zu %10.1f\n", text.size(), packed.size(), fromText.size(), fromPacked.size(),
+			   (packed.size() + 767) / 768, (stored + 767) / 768,
+			   std::chrono::duration<double, std::micro>(end - start).count() / Rounds);
+	}
+	return 0;
+}
@@ -0,0 +1,127 @@
+//
+//  bench_sleephist.cpp
+//  HibernationFixup host tests
+//
+//  Replay of half a year of sleeps of a synthetic user with HibernateLongSleeps:
+//  memory  - learned durations are lost at every reboot (previous behaviour)
+//  saved   - learned durations are saved after every full wake and loaded after boot
+//  A sleep is long if it lasts longer than standby delay (3 hours), long sleeps predicted at sleep
+//  phase 0 hibernate at once, short sleeps predicted as long hibernate needlessly.
+//
+
+#include <stdio.h>
+#include <chrono>
+#include <random>
+
+#include "kern_sleephist.hpp"
+
+static constexpr uint64_t Hour         = 3600;
+static constexpr uint64_t StandbyDelay = 3 * Hour;
+static constexpr uint32_t Confidence   = 80;
+static constexpr int      Weeks        = 26;
+static constexpr int      RebootDays   = 10;
+
+struct Sleep {
+	uint32_t weekday;
+	uint32_t hour;
+	uint64_t duration;
+};
+
+/**
+ *  Workdays: night sleep starting between 22:00 and 0:59 and a lunch break sleep,
+ *  weekends: night sleep starting between 23:00 and 2:59 and a few short afternoon sleeps
+ */
+template <typename Callback>
+static void replay(unsigned seed, Callback callback)
+{
+	std::mt19937 random(seed);
+	auto uniform = [&](int from, int to) { return std::uniform_int_distribution<int>(from, to)(random); };
+	for (int day = 0; day < Weeks * 7; day++) {
+		uint32_t weekday = day % 7;
+		bool workday = weekday >= 1 && weekday <= 5;
+		if (workday) {
+			callback(day, Sleep {weekday, 12, static_cast<uint64_t>(uniform(30, 70)) * 60});
+			int start = uniform(22, 24);
+			callback(day, Sleep {start == 24 ? (weekday + 1) % 7 : weekday, static_cast<uint32_t>(start % 24), static_cast<uint64_t>(uniform(6 * 60, 9 * 60)) * 60});
+		}
+		else {
+			for (int i = uniform(0, 3); i > 0; i--)
+				callback(day, Sleep {weekday, static_cast<uint32_t>(uniform(13, 18)), static_cast<uint64_t>(uniform(10, 90)) * 60});
+			int start = uniform(23, 26);
+			callback(day, Sleep {start >= 24 ? (weekday + 1) % 7 : weekday, static_cast<uint32_t>(start % 24), static_cast<uint64_t>(uniform(7 * 60, 10 * 60)) * 60});
+		}
+	}
+}
+
+struct Result {
+	unsigned longSleeps {0}, predicted {0}, shortSleeps {0}, needless {0};
+};
+
+static Result run(bool saved, unsigned seed)
+{
+	SleepDurationPredictor history;
+	uint8_t state[SleepDurationPredictor::StateSize];
+	history.save(state);
+	int lastBoot = 0;
+	Result result;
+
+	replay(seed, [&](int day, const Sleep &sleep) {
+		if (day - lastBoot >= RebootDays) {
+			lastBoot = day;
+			history = SleepDurationPredictor {};
+			if (saved)
+				history.merge(state, sizeof(state));
+		}
+
+		bool prediction = history.predictLonger(sleep.weekday, sleep.hour, StandbyDelay, Confidence);
+		if (sleep.duration >= StandbyDelay) {
+			result.longSleeps++;
+			result.predicted += prediction;
+		}
+		else {
+			result.shortSleeps++;
+			result.needless += prediction;
+		}
+		history.add(sleep.weekday, sleep.hour, sleep.duration);
+		history.save(state);
+	});
+	return result;
+}
+
+int main()
+{
+	for (bool saved : {false, true}) {
+		Result total;
+		for (unsigned seed = 1; seed <= 20; seed++) {
+			Result result = run(saved, seed);
+			total.longSleeps += result.longSleeps;
+			total.predicted += result.predicted;
+			total.shortSleeps += result.shortSleeps;
+			total.needless += result.needless;
+		}
+		printf("%-6s: %5u of %5u long sleeps hibernated at once (%4.1f%%), %3u of %5u short sleeps hibernated needlessly (%4.2f%%)\n",
+			   saved ? "saved" : "memory", total.predicted, total.longSleeps, 100.0 * total.predicted / total.longSleeps,
+			   total.needless, total.shortSleeps, 100.0 * total.needless / total.shortSleeps);
+	}
+
+	// cost of the work done at sleep phase 0 and at full wake
+	SleepDurationPredictor history;
+	replay(1, [&](int, const Sleep &sleep) { history.add(sleep.weekday, sleep.hour, sleep.duration); });
+	constexpr int Iterations = 10000000;
+	unsigned predicted = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < Iterations; i++)
+		predicted += history.predictLonger(i % 7, (i / 7) % 24, StandbyDelay, Confidence);
+	double predictNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / Iterations;
+
+	uint8_t state[SleepDurationPredictor::StateSize];
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < Iterations / 100; i++) {
+		history.save(state);
+		SleepDurationPredictor loaded;
+		predicted += loaded.merge(state, sizeof(state));
+	}
+	double stateNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (Iterations / 100);
+	printf("predictLonger %.1f ns, save + merge of %zu bytes %.0f ns (%u)\n", predictNs, sizeof(state), stateNs, predicted);
+	return 0;
+}
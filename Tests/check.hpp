@@ -0,0 +1,41 @@
+//
+//  check.hpp
+//  HibernationFixup host tests
+//
+//  Checks shared by host tests: a failed check is printed with its location and fails the test.
+//
+
+#ifndef check_hpp
+#define check_hpp
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static bool failed = false;
+
+#define CHECK(condition) \
+	do { if (!(condition)) { fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #condition); failed = true; } } while (0)
+
+/**
+ *  CHECK for tests running many cases, what and value name the failed case (round, crash step, timestamp)
+ */
+#define CHECK_CASE(condition, what, value) \
+	do { if (!(condition)) { fprintf(stderr, "%s:%d: %s failed (%s %lld)\n", __FILE__, __LINE__, #condition, what, static_cast<long long>(value)); failed = true; } } while (0)
+
+/**
+ *  Print test summary followed by the result
+ *
+ *  @return exit code of the test
+ */
+static inline int report(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static inline int report(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	printf(": %s\n", failed ? "FAILED" : "ok");
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif /* check_hpp */
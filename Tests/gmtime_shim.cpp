@@ -0,0 +1,22 @@
+//
+//  gmtime_shim.cpp
+//  HibernationFixup host tests
+//
+//  HBFX gmtime.h declares its own struct tm, which can't be used together with libc <time.h>,
+//  so HBFX gmtime_r is wrapped here and tests compare plain field arrays.
+//
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "gmtime.h"
+#include "gmtime_shim.hpp"
+
+void hbfxGmtime(int64_t seconds, int fields[TmFieldCount])
+{
+	struct tm tm {};
+	gmtime_r(static_cast<time_t>(seconds), &tm);
+	int values[TmFieldCount] {tm.tm_sec, tm.tm_min, tm.tm_hour, tm.tm_mday, tm.tm_mon, tm.tm_year, tm.tm_wday, tm.tm_yday, tm.tm_isdst};
+	for (int i = 0; i < TmFieldCount; i++)
+		fields[i] = values[i];
+}
@@ -0,0 +1,16 @@
+//
+//  gmtime_shim.hpp
+//  HibernationFixup host tests
+//
+
+#ifndef gmtime_shim_hpp
+#define gmtime_shim_hpp
+
+#include <stdint.h>
+
+// tm_sec, tm_min, tm_hour, tm_mday, tm_mon, tm_year, tm_wday, tm_yday, tm_isdst
+static constexpr int TmFieldCount = 9;
+
+void hbfxGmtime(int64_t seconds, int fields[TmFieldCount]);
+
+#endif /* gmtime_shim_hpp */
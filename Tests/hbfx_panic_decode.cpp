@@ -0,0 +1,37 @@
+//
+//  hbfx_panic_decode.cpp
+//  HibernationFixup host tests
+//
+//  Print panic info compressed by -hbfx-compress-panic.
+//  Usage: nvram -p | hbfx_panic_decode   or   hbfx_panic_decode <file with nvram -p output>
+//
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#include "panic_decode.hpp"
+
+int main(int argc, char *argv[])
+{
+	std::string input;
+	if (argc > 1) {
+		std::ifstream file(argv[1], std::ios::binary);
+		if (!file) {
+			fprintf(stderr, "can't open %s\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+		input.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	} else {
+		input.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+	}
+
+	std::string panic, error;
+	if (!PanicDecode::decode(input, panic, error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return EXIT_FAILURE;
+	}
+
+	fwrite(panic.data(), 1, panic.size(), stdout);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,111 @@
+//
+//  lzss.hpp
+//  HibernationFixup host tests
+//
+//  LZSS format produced by Lilu Compression::compress(ModeLZSS) (Okumura LZSS: 4 KB ring buffer
+//  initialised with spaces, 18-byte lookahead, 8 flag bits per group, set bit is a literal).
+//
+
+#ifndef lzss_hpp
+#define lzss_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace LZSS {
+	static constexpr int N         = 4096;
+	static constexpr int F         = 18;
+	static constexpr int Threshold = 2;
+
+	/**
+	 *  Decompress src into dst
+	 *
+	 *  @return amount of bytes written to dst
+	 */
+	inline size_t decompress(uint8_t *dst, size_t dstlen, const uint8_t *src, size_t srclen) {
+		uint8_t text[N + F - 1];
+		for (int i = 0; i < N - F; i++)
+			text[i] = ' ';
+
+		const uint8_t *srcend = src + srclen;
+		size_t written = 0;
+		int r = N - F;
+		unsigned flags = 0;
+		while (written < dstlen) {
+			if (((flags >>= 1) & 0x100) == 0) {
+				if (src >= srcend)
+					break;
+				flags = *src++ | 0xFF00;
+			}
+
+			if (flags & 1) {
+				if (src >= srcend)
+					break;
+				uint8_t c = *src++;
+				dst[written++] = c;
+				text[r++] = c;
+				r &= N - 1;
+			} else {
+				if (srcend - src < 2)
+					break;
+				int i = src[0] | ((src[1] & 0xF0) << 4);
+				int j = (src[1] & 0x0F) + Threshold;
+				src += 2;
+				for (int k = 0; k <= j && written < dstlen; k++) {
+					uint8_t c = text[(i + k) & (N - 1)];
+					dst[written++] = c;
+					text[r++] = c;
+					r &= N - 1;
+				}
+			}
+		}
+		return written;
+	}
+
+	/**
+	 *  Compress src with a greedy search over the whole window.
+	 *  Slow, but produces the same format as the kernel compressor, which is enough for tests.
+	 */
+	inline std::vector<uint8_t> compress(const uint8_t *src, size_t srclen) {
+		// position p < 0 is a part of initial ring buffer filled with spaces
+		auto byteAt = [src](ptrdiff_t p) -> uint8_t { return p < 0 ? ' ' : src[p]; };
+
+		std::vector<uint8_t> out;
+		size_t flagsAt = 0;
+		int bit = 8;
+		for (ptrdiff_t pos = 0; pos < static_cast<ptrdiff_t>(srclen); ) {
+			if (bit == 8) {
+				flagsAt = out.size();
+				out.push_back(0);
+				bit = 0;
+			}
+
+			const ptrdiff_t limit = static_cast<ptrdiff_t>(srclen) - pos < F ? static_cast<ptrdiff_t>(srclen) - pos : F;
+			ptrdiff_t best = 0, bestLength = 0;
+			for (ptrdiff_t s = pos - 1; s >= pos - N && s >= -(N - F) && bestLength < limit; s--) {
+				ptrdiff_t length = 0;
+				while (length < limit && byteAt(s + length) == src[pos + length])
+					length++;
+				if (length > bestLength) {
+					best = s;
+					bestLength = length;
+				}
+			}
+
+			if (bestLength > Threshold) {
+				const int i = static_cast<int>((N - F + best) & (N - 1));
+				out.push_back(static_cast<uint8_t>(i & 0xFF));
+				out.push_back(static_cast<uint8_t>(((i >> 4) & 0xF0) | (bestLength - Threshold - 1)));
+				pos += bestLength;
+			} else {
+				out[flagsAt] |= 1U << bit;
+				out.push_back(src[pos++]);
+			}
+			bit++;
+		}
+		return out;
+	}
+}
+
+#endif /* lzss_hpp */
@@ -0,0 +1,121 @@
+//
+//  panic_decode.hpp
+//  HibernationFixup host tests
+//
+//  Decoder of compressed panic info (HBFX,PanicInfo%04d variables, see kern_panicinfo.hpp).
+//
+
+#ifndef panic_decode_hpp
+#define panic_decode_hpp
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include "kern_panicinfo.hpp"
+#include "lzss.hpp"
+
+namespace PanicDecode {
+	/**
+	 *  Undo percent escaping used by `nvram -p` for binary data
+	 */
+	inline std::string unescape(const std::string &value) {
+		std::string result;
+		for (size_t i = 0; i < value.size(); i++) {
+			if (value[i] == '%' && i + 2 < value.size() && isxdigit(static_cast<unsigned char>(value[i + 1])) &&
+				isxdigit(static_cast<unsigned char>(value[i + 2]))) {
+				result.push_back(static_cast<char>(strtoul(value.substr(i + 1, 2).c_str(), nullptr, 16)));
+				i += 2;
+			} else {
+				result.push_back(value[i]);
+			}
+		}
+		return result;
+	}
+
+	/**
+	 *  Escape binary data the same way as `nvram -p` does
+	 */
+	inline std::string escape(const std::string &value) {
+		std::string result;
+		char hex[4];
+		for (unsigned char c : value) {
+			if (c < 0x20 || c >= 0x7F || c == '%') {
+				snprintf(hex, sizeof(hex), "%%%02x", c);
+				result += hex;
+			} else {
+				result.push_back(static_cast<char>(c));
+			}
+		}
+		return result;
+	}
+
+	/**
+	 *  Decode panic info from `nvram -p` output
+	 *
+	 *  @param nvram  `nvram -p` output, lines are "<name>\t<value>"
+	 *  @param panic  decoded panic text
+	 *  @param error  reason of a failure
+	 *
+	 *  @return true on success
+	 */
+	inline bool decode(const std::string &nvram, std::string &panic, std::string &error) {
+		// chunks are ordered by their four-digit index
+		std::map<std::string, std::string> chunks;
+		std::istringstream lines(nvram);
+		std::string line;
+		const size_t prefixLength = strlen(PanicInfo::CompressedKeyPrefix);
+		while (std::getline(lines, line)) {
+			size_t tab = line.find('\t');
+			if (tab == std::string::npos || line.compare(0, prefixLength, PanicInfo::CompressedKeyPrefix) != 0)
+				continue;
+			chunks[line.substr(0, tab)] = unescape(line.substr(tab + 1));
+		}
+
+		if (chunks.empty()) {
+			error = "no HBFX,PanicInfo variables found";
+			return false;
+		}
+
+		std::string data;
+		unsigned expected = 0;
+		char key[32];
+		for (auto &chunk : chunks) {
+			snprintf(key, sizeof(key), PanicInfo::CompressedKeyFormat, expected++);
+			if (chunk.first != key) {
+				error = "missing variable " + std::string(key);
+				return false;
+			}
+			data += chunk.second;
+		}
+
+		PanicInfo::Header header {};
+		if (data.size() < sizeof(header)) {
+			error = "panic info is too short";
+			return false;
+		}
+		memcpy(&header, data.data(), sizeof(header));
+		if (header.signature != PanicInfo::Header::Signature) {
+			error = "unknown panic info signature";
+			return false;
+		}
+		if (header.compressedSize > data.size() - sizeof(header)) {
+			error = "panic info is truncated";
+			return false;
+		}
+
+		panic.assign(header.originalSize, '\0');
+		size_t size = LZSS::decompress(reinterpret_cast<uint8_t *>(&panic[0]), panic.size(),
+									   reinterpret_cast<const uint8_t *>(data.data()) + sizeof(header), header.compressedSize);
+		if (size != header.originalSize) {
+			error = "LZSS data is corrupted";
+			return false;
+		}
+		return true;
+	}
+}
+
+#endif /* panic_decode_hpp */
@@ -0,0 +1,61 @@
+//
+//  panic_sample.hpp
+//  HibernationFixup host tests
+//
+//  Synthetic panic reports and xnu packA emulation.
+//
+
+#ifndef panic_sample_hpp
+#define panic_sample_hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <random>
+#include <string>
+
+/**
+ *  Text shaped like a macOS panic report: header, backtraces and a loaded kext list
+ */
+inline std::string samplePanic(size_t size, uint32_t seed = 1) {
+	std::mt19937 random(seed);
+	std::string text = "panic(cpu 2 caller 0xffffff801b4e5a3d): Kernel trap at 0xffffff7f9c2d1e4f, type 14=page fault, registers:\n"
+		"CR0: 0x0000000080010033, CR2: 0x0000000000000028, CR3: 0x000000001a2b3000, CR4: 0x00000000003626e0\n"
+		"Backtrace (CPU 2), Frame : Return Address\n";
+	char line[160];
+	while (text.size() < size) {
+		switch (random() % 3) {
+			case 0:
+				snprintf(line, sizeof(line), "0xffffff83%08x : 0xffffff801b%06x \n", static_cast<unsigned>(random()), static_cast<unsigned>(random() & 0xFFFFFF));
+				break;
+			case 1:
+				snprintf(line, sizeof(line), "      com.apple.driver.AppleIntel%u(%u.%u)[%08X-%04X]@0xffffff7f%08x->0xffffff7f%08x\n",
+						 static_cast<unsigned>(random() % 16), static_cast<unsigned>(random() % 900), static_cast<unsigned>(random() % 10),
+						 static_cast<unsigned>(random()), static_cast<unsigned>(random() & 0xFFFF), static_cast<unsigned>(random()), static_cast<unsigned>(random()));
+				break;
+			default:
+				snprintf(line, sizeof(line), "         dependency: com.apple.iokit.IOPCIFamily(2.9)[%08X]@0xffffff7f%08x\n",
+						 static_cast<unsigned>(random()), static_cast<unsigned>(random()));
+				break;
+		}
+		text += line;
+	}
+	text.resize(size);
+	return text;
+}
+
+/**
+ *  xnu packA: 8 ASCII characters are packed into 7 bytes (7 bits each, little-endian bitfields)
+ */
+inline std::string packA(const std::string &text) {
+	std::string packed;
+	for (size_t i = 0; i < text.size(); i += 8) {
+		uint64_t bits = 0;
+		for (size_t k = 0; k < 8; k++)
+			bits |= static_cast<uint64_t>(i + k < text.size() ? text[i + k] & 0x7F : 0) << (7 * k);
+		for (size_t k = 0; k < 7; k++)
+			packed.push_back(static_cast<char>((bits >> (8 * k)) & 0xFF));
+	}
+	return packed;
+}
+
+#endif /* panic_sample_hpp */
@@ -0,0 +1,22 @@
+//
+//  string_sink.hpp
+//  HibernationFixup host tests
+//
+
+#ifndef string_sink_hpp
+#define string_sink_hpp
+
+#include <string>
+
+/**
+ *  std::string as a Plist sink
+ */
+struct StringSink {
+	std::string text;
+	bool append(const void *data, size_t size) {
+		text.append(static_cast<const char *>(data), size);
+		return true;
+	}
+};
+
+#endif /* string_sink_hpp */
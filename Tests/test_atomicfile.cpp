@@ -0,0 +1,158 @@
+//
+//  test_atomicfile.cpp
+//  HibernationFixup host tests
+//
+//  AtomicFile::write against a fake file system which loses everything not flushed on a crash.
+//
+
+#include <map>
+#include <string>
+
+#include "check.hpp"
+#include "kern_atomicfile.hpp"
+
+/**
+ *  Files are inodes referenced by directory entries. File contents survive a crash only when
+ *  the file is flushed, directory entries only when the directory is flushed.
+ *  Every operation is a step, the file system "crashes" before step crashAt.
+ */
+struct FakeVfs {
+	struct Inode {
+		std::string data;
+		std::string persistent;
+	};
+
+	std::map<int, Inode> inodes;
+	std::map<std::string, int> entries;
+	std::map<std::string, int> persistentEntries;
+	int nextInode {1};
+
+	bool renameSupported {true};
+	bool directoryFlushFails {false};
+	int crashAt {-1};
+	int steps {0};
+
+	bool step() {
+		return crashAt < 0 || steps++ < crashAt;
+	}
+
+	int write(const char *path, const AtomicFile::Chunk *chunks, size_t count, bool &flushed, uint64_t &flushTime) {
+		flushed = false;
+		flushTime = 0;
+		if (!step())
+			return 5;
+		// open with O_TRUNC | O_CREAT
+		auto entry = entries.find(path);
+		int inode = entry != entries.end() ? entry->second : (entries[path] = nextInode++);
+		inodes[inode].data.clear();
+		for (size_t i = 0; i < count; i++) {
+			if (!step())
+				return 5;
+			inodes[inode].data.append(static_cast<const char *>(chunks[i].data), chunks[i].size);
+		}
+		if (!step())
+			return 5;
+		inodes[inode].persistent = inodes[inode].data;
+		flushed = true;
+		flushTime = 1;
+		return 0;
+	}
+
+	bool canRename() {
+		return renameSupported;
+	}
+
+	int rename(const char *from, const char *to) {
+		if (!step())
+			return 5;
+		entries[to] = entries[from];
+		entries.erase(from);
+		return 0;
+	}
+
+	bool flushDirectory(const char *, uint64_t &flushTime) {
+		if (!step() || directoryFlushFails)
+			return false;
+		persistentEntries = entries;
+		flushTime = 1;
+		return true;
+	}
+
+	/**
+	 *  Contents of path after a crash, "<missing>" if there is no such file
+	 */
+	std::string recovered(const std::string &path) const {
+		auto entry = persistentEntries.find(path);
+		return entry == persistentEntries.end() ? "<missing>" : inodes.at(entry->second).persistent;
+	}
+
+	/**
+	 *  File system with path written and flushed completely
+	 */
+	static FakeVfs with(const std::string &path, const std::string &data) {
+		FakeVfs vfs;
+		vfs.entries[path] = vfs.nextInode;
+		vfs.inodes[vfs.nextInode++] = {data, data};
+		vfs.persistentEntries = vfs.entries;
+		return vfs;
+	}
+};
+
+int main()
+{
+	const std::string previous = "<plist>previous</plist>";
+	const std::string next[] {"<plist>", "next", "</plist>"};
+	const AtomicFile::Chunk chunks[] {{next[0].data(), next[0].size()}, {next[1].data(), next[1].size()}, {next[2].data(), next[2].size()}};
+	const std::string complete = next[0] + next[1] + next[2];
+	size_t scenarios = 0;
+
+	// with rename the file is either previous or complete after a crash at any step
+	for (int crash = 0; crash < 16; crash++, scenarios++) {
+		FakeVfs vfs = FakeVfs::with("/nvram.plist", previous);
+		vfs.crashAt = crash;
+		bool flushed = false;
+		uint64_t flushTime = 0;
+		int error = AtomicFile::write(vfs, "/nvram.plist", "/nvram.plist.tmp", chunks, 3, flushed, flushTime);
+		std::string contents = vfs.recovered("/nvram.plist");
+		CHECK_CASE(contents == previous || contents == complete, "step", crash);
+		// flushed means that the new contents survive a crash
+		if (error == 0 && flushed)
+			CHECK_CASE(contents == complete, "step", crash);
+	}
+
+	// file is written and renamed, but the directory can't be flushed: global sync is required
+	{
+		FakeVfs vfs = FakeVfs::with("/nvram.plist", previous);
+		vfs.directoryFlushFails = true;
+		bool flushed = true;
+		uint64_t flushTime = 0;
+		int error = AtomicFile::write(vfs, "/nvram.plist", "/nvram.plist.tmp", chunks, 3, flushed, flushTime);
+		CHECK(error == 0 && !flushed && vfs.recovered("/nvram.plist") == previous);
+		scenarios++;
+	}
+
+	// without rename the file is written in place, flushed still means persistent
+	for (int crash = 0; crash < 8; crash++, scenarios++) {
+		FakeVfs vfs = FakeVfs::with("/nvram.plist", previous);
+		vfs.renameSupported = false;
+		vfs.crashAt = crash;
+		bool flushed = false;
+		uint64_t flushTime = 0;
+		int error = AtomicFile::write(vfs, "/nvram.plist", "/nvram.plist.tmp", chunks, 3, flushed, flushTime);
+		if (error == 0 && flushed)
+			CHECK_CASE(vfs.recovered("/nvram.plist") == complete, "step", crash);
+	}
+
+	// first dump creates the file
+	{
+		FakeVfs vfs;
+		bool flushed = false;
+		uint64_t flushTime = 0;
+		int error = AtomicFile::write(vfs, "/nvram.plist", "/nvram.plist.tmp", chunks, 3, flushed, flushTime);
+		CHECK(error == 0 && flushed && flushTime == 2 && vfs.recovered("/nvram.plist") == complete);
+		CHECK(vfs.recovered("/nvram.plist.tmp") == "<missing>");
+		scenarios++;
+	}
+
+	return report("%zu atomic write scenarios", scenarios);
+}
@@ -0,0 +1,253 @@
+//
+//  test_autohib.cpp
+//  HibernationFixup host tests
+//
+//  Exhaustive check of AutoHibernate decisions against the original sleepPolicyHandler logic.
+//  Every combination of hbfx-ahbm bits, power state, sleep phase, wake state and long sleep prediction is evaluated
+//  by all CPUs, the checker reports states per second.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "kern_autohib.hpp"
+
+using namespace AutoHibernate;
+
+/**
+ *  One evaluated state: 18 bits of options and power state, sleep phase, 5 wake state flags
+ *  and long sleep prediction (HibernateLongSleeps)
+ */
+struct State {
+	uint32_t bits;
+	uint32_t sleepPhase;
+	bool     standbyDelay;
+	bool     wakeCalendarSet;
+	bool     sleepServiceWake;
+	bool     maintenanceWakeSetsCalendar;
+	bool     standbyTimer;
+	bool     longSleepPredicted;
+
+	static constexpr uint64_t Count = (1ULL << 18) * 4 * 64;
+
+	static State decode(uint64_t index) {
+		State state {};
+		state.bits = index & ((1U << 18) - 1);
+		index >>= 18;
+		state.sleepPhase = index & 3;
+		index >>= 2;
+		state.standbyDelay                = index & 1;
+		state.wakeCalendarSet             = index & 2;
+		state.sleepServiceWake            = index & 4;
+		state.maintenanceWakeSetsCalendar = index & 8;
+		state.standbyTimer                = index & 16;
+		state.longSleepPredicted          = index & 32;
+		return state;
+	}
+
+	bool bit(uint32_t index) const { return bits & (1U << index); }
+	uint32_t minimalCapacity() const { return (bits >> 12) & 15; }
+	int capacity() const { return static_cast<int>((bits >> 16) & 3) * 6; }
+};
+
+/**
+ *  Outcome of one policy handler call
+ */
+struct Outcome {
+	Action action;
+	bool   sleepServiceWake;
+	bool   wakeCalendarSet;
+	int    maintenanceWakes;
+
+	bool operator==(const Outcome &other) const {
+		return action == other.action && sleepServiceWake == other.sleepServiceWake &&
+			   wakeCalendarSet == other.wakeCalendarSet && maintenanceWakes == other.maintenanceWakes;
+	}
+};
+
+/**
+ *  Decision of X86PlatformPlugin_sleepPolicyHandler before it was moved to kern_autohib.hpp,
+ *  a predicted long sleep skips the maintenance wake and hibernates at once like forced hibernation
+ */
+static Outcome reference(const State &state)
+{
+	bool lidClosedOnly = state.bit(0), externalDisconnectedOnly = state.bit(1), notChargingOnly = state.bit(2);
+	bool warnLevel = state.bit(3), criticalLevel = state.bit(4), doNotOverride = state.bit(5);
+	bool battery = state.bit(6), external = state.bit(7), charging = state.bit(8);
+	bool atWarn = state.bit(9), atCritical = state.bit(10), lidIsOpen = state.bit(11);
+	uint32_t standbyDelay = state.standbyDelay ? 3600 : 0;
+
+	Outcome outcome {Action::None, state.sleepServiceWake, state.wakeCalendarSet, 0};
+	auto setMaintenanceWake = [&]() {
+		outcome.maintenanceWakes++;
+		if (state.maintenanceWakeSetsCalendar)
+			outcome.wakeCalendarSet = true;
+	};
+	auto notAllowed = [&]() {
+		if (state.sleepPhase > kIOPMSleepPhase0) {
+			outcome.sleepServiceWake = false;
+			if (standbyDelay != 0 && !outcome.wakeCalendarSet)
+				setMaintenanceWake();
+		}
+		return outcome;
+	};
+
+	bool forceHibernate = false;
+	if (battery) {
+		if (externalDisconnectedOnly && external)
+			return notAllowed();
+		if (notChargingOnly && charging)
+			return notAllowed();
+		if (!charging) {
+			if ((warnLevel && atWarn) || (criticalLevel && atCritical))
+				forceHibernate = true;
+			if (!forceHibernate && state.minimalCapacity() != 0 && state.capacity() <= static_cast<int>(state.minimalCapacity()))
+				forceHibernate = true;
+		}
+	}
+
+	if (!forceHibernate && lidClosedOnly && lidIsOpen)
+		return notAllowed();
+
+	bool hibernateAtOnce = forceHibernate || state.longSleepPredicted;
+	if (state.sleepPhase > kIOPMSleepPhase0 && standbyDelay != 0 && !hibernateAtOnce && !outcome.wakeCalendarSet && !outcome.sleepServiceWake)
+		setMaintenanceWake();
+
+	bool setupHibernate = hibernateAtOnce || !outcome.wakeCalendarSet || outcome.sleepServiceWake || standbyDelay == 0;
+	if (setupHibernate && doNotOverride && !hibernateAtOnce && state.standbyTimer)
+		outcome.action = Action::Cancel;
+	else if (state.sleepPhase < kIOPMSleepPhase2 && setupHibernate)
+		outcome.action = Action::Standby;
+	else if (state.sleepPhase == kIOPMSleepPhase2) {
+		outcome.action = setupHibernate ? Action::HibernateNow : Action::Postpone;
+		outcome.sleepServiceWake = false;
+		outcome.wakeCalendarSet = false;
+	}
+	return outcome;
+}
+
+/**
+ *  The same decision made by AutoHibernate::evaluateGate and evaluateAction
+ */
+static Outcome model(const State &state)
+{
+	GateInput in {};
+	in.options.whenLidIsClosed                 = state.bit(0);
+	in.options.whenExternalPowerIsDisconnected = state.bit(1);
+	in.options.whenBatteryIsNotCharging        = state.bit(2);
+	in.options.whenBatteryIsAtWarnLevel        = state.bit(3);
+	in.options.whenBatteryAtCriticalLevel      = state.bit(4);
+	in.options.doNotOverrideWakeUpTime         = state.bit(5);
+	in.options.minimalRemainingCapacity        = state.minimalCapacity();
+	in.power.batteryInstalled = state.bit(6);
+	if (in.power.batteryInstalled) {
+		in.power.externalConnected        = state.bit(7);
+		in.power.charging                 = state.bit(8);
+		in.power.atWarnLevel              = state.bit(9);
+		in.power.atCriticalLevel          = state.bit(10);
+		in.power.capacityPercentRemaining = state.capacity();
+	}
+	in.power.lidIsOpen    = state.bit(11);
+	in.sleepPhase         = state.sleepPhase;
+	in.standbyDelay       = state.standbyDelay ? 3600 : 0;
+	in.wakeCalendarSet    = state.wakeCalendarSet;
+	in.sleepServiceWake   = state.sleepServiceWake;
+	in.longSleepPredicted = state.longSleepPredicted;
+
+	Outcome outcome {Action::None, state.sleepServiceWake, state.wakeCalendarSet, 0};
+	Gate gate = evaluateGate(in);
+	if (gate.clearSleepServiceWake)
+		outcome.sleepServiceWake = false;
+	if (gate.setMaintenanceWake) {
+		outcome.maintenanceWakes++;
+		if (state.maintenanceWakeSetsCalendar)
+			outcome.wakeCalendarSet = true;
+	}
+	if (!gate.proceed)
+		return outcome;
+
+	ActionInput action {};
+	action.forceHibernate          = gate.forceHibernate;
+	action.wakeCalendarSet         = outcome.wakeCalendarSet;
+	action.sleepServiceWake        = outcome.sleepServiceWake;
+	action.doNotOverrideWakeUpTime = in.options.doNotOverrideWakeUpTime;
+	action.standbyDelay            = in.standbyDelay;
+	action.standbyTimer            = state.standbyTimer ? 60 : 0;
+	action.sleepPhase              = in.sleepPhase;
+	action.longSleepPredicted      = in.longSleepPredicted;
+
+	Decision decision = evaluateAction(action);
+	outcome.action = decision.action;
+	if (decision.resetWakeState) {
+		outcome.sleepServiceWake = false;
+		outcome.wakeCalendarSet = false;
+	}
+	return outcome;
+}
+
+/**
+ *  Decisions which must never be made
+ */
+static bool violates(const State &state, const Outcome &outcome)
+{
+	bool hibernate = outcome.action == Action::Standby || outcome.action == Action::HibernateNow;
+	bool battery = state.bit(6), external = state.bit(7), charging = state.bit(8), lidIsOpen = state.bit(11);
+	bool lowBattery = battery && !charging && ((state.bit(3) && state.bit(9)) || (state.bit(4) && state.bit(10)) ||
+		(state.minimalCapacity() != 0 && state.capacity() <= static_cast<int>(state.minimalCapacity())));
+	bool externalBlocks = battery && state.bit(1) && external;
+	bool chargingBlocks = battery && state.bit(2) && charging;
+	bool lidBlocks = state.bit(0) && lidIsOpen && !lowBattery;
+
+	// WhenExternalPowerIsDisconnected with external power connected, WhenBatteryIsNotCharging while charging,
+	// WhenLidIsClosed with open lid unless battery is low
+	if (hibernate && (externalBlocks || chargingBlocks || lidBlocks))
+		return true;
+
+	// a predicted long sleep which is allowed hibernates at once: no maintenance wake, not cancelled
+	// by DoNotOverrideWakeUpTime and not postponed
+	if (state.longSleepPredicted && !externalBlocks && !chargingBlocks && !lidBlocks) {
+		if (outcome.maintenanceWakes != 0 || outcome.action == Action::Cancel || outcome.action == Action::Postpone)
+			return true;
+		if (!hibernate && state.sleepPhase <= kIOPMSleepPhase2)
+			return true;
+	}
+	return false;
+}
+
+int main()
+{
+	constexpr uint64_t Block = 4096;
+	std::atomic<uint64_t> next {0}, mismatches {0}, violations {0};
+
+	auto worker = [&]() {
+		for (uint64_t start; (start = next.fetch_add(Block)) < State::Count; ) {
+			for (uint64_t index = start; index < start + Block && index < State::Count; index++) {
+				State state = State::decode(index);
+				Outcome expected = reference(state);
+				Outcome actual = model(state);
+				if (!(expected == actual) && mismatches++ == 0)
+					fprintf(stderr, "first mismatch at state %llu\n", static_cast<unsigned long long>(index));
+				if (violates(state, actual))
+					violations++;
+			}
+		}
+	};
+
+	auto start = std::chrono::steady_clock::now();
+	unsigned threads = std::thread::hardware_concurrency();
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < (threads ? threads : 1); i++)
+		workers.emplace_back(worker);
+	for (auto &thread : workers)
+		thread.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%llu states, %llu mismatches, %llu violations, %.0f states/sec on %zu threads\n",
+		   static_cast<unsigned long long>(State::Count), static_cast<unsigned long long>(mismatches.load()),
+		   static_cast<unsigned long long>(violations.load()), State::Count / seconds, workers.size());
+	return mismatches == 0 && violations == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,60 @@
+//
+//  test_calendar.cpp
+//  HibernationFixup host tests
+//
+//  Round trips of kern_calendar.hpp conversions, checked against libc timegm/gmtime_r.
+//
+
+#include <time.h>
+#include <random>
+
+#include "check.hpp"
+#include "kern_calendar.hpp"
+
+static void checkSeconds(int64_t seconds)
+{
+	const Calendar::Date date = Calendar::fromSeconds(seconds);
+	CHECK_CASE(Calendar::toSeconds(date) == seconds, "seconds", seconds);
+	CHECK_CASE(date.month >= 1 && date.month <= 12 && date.day >= 1 && date.day <= Calendar::daysInMonth(date.year, date.month), "seconds", seconds);
+
+	if (date.year >= 0 && date.year <= UINT32_MAX) {
+		const IOPMCalendarStruct calendar = Calendar::toPMCalendar(seconds, kPMCalendarTypeMaintenance);
+		CHECK_CASE(calendar.selector == kPMCalendarTypeMaintenance, "seconds", seconds);
+		CHECK_CASE(Calendar::fromPMCalendar(calendar) == seconds, "seconds", seconds);
+	}
+
+	time_t t = static_cast<time_t>(seconds);
+	struct tm tm {};
+	if (gmtime_r(&t, &tm)) {
+		CHECK_CASE(tm.tm_year + 1900LL == date.year && tm.tm_mon + 1 == date.month && tm.tm_mday == date.day, "seconds", seconds);
+		CHECK_CASE(tm.tm_wday == date.weekday && tm.tm_yday == date.yearDay, "seconds", seconds);
+		CHECK_CASE(timegm(&tm) == t, "seconds", seconds);
+	}
+}
+
+int main()
+{
+	size_t checked = 0;
+
+	// every day from year -2000 to 4000
+	for (int64_t days = Calendar::daysFromCivil(-2000, 1, 1); days <= Calendar::daysFromCivil(4000, 1, 1) && !failed; days++, checked += 2) {
+		checkSeconds(days * Calendar::SecondsPerDay);
+		checkSeconds(days * Calendar::SecondsPerDay - 1);
+	}
+
+	// every civil date of a 400-year cycle maps to consecutive days
+	int64_t expected = Calendar::daysFromCivil(2000, 1, 1);
+	for (int64_t year = 2000; year < 2400 && !failed; year++)
+		for (uint8_t month = 1; month <= 12; month++)
+			for (uint8_t day = 1; day <= Calendar::daysInMonth(year, month); day++, expected++, checked++)
+				CHECK_CASE(Calendar::daysFromCivil(year, month, day) == expected, "days", expected);
+	CHECK_CASE(expected - Calendar::daysFromCivil(2000, 1, 1) == Calendar::DaysPerEra, "days", expected);
+
+	// random seconds within IOPMCalendarStruct years range
+	std::mt19937_64 random(2020);
+	std::uniform_int_distribution<int64_t> distribution(Calendar::toSeconds(0, 1, 1, 0, 0, 0), Calendar::toSeconds(UINT32_MAX, 12, 31, 23, 59, 59));
+	for (size_t i = 0; i < 1000000 && !failed; i++, checked++)
+		checkSeconds(distribution(random));
+
+	return report("%zu conversions checked", checked);
+}
@@ -0,0 +1,140 @@
+//
+//  test_config.cpp
+//  HibernationFixup host tests
+//
+//  Configuration option descriptors: boot-args take precedence over EFI variables,
+//  EFI variables are requested only for options which can still change, values are checked.
+//
+
+#include "check.hpp"
+#include "kern_config.hpp"
+
+static constexpr const EFI_GUID &Guid = EfiRuntimeServices::LiluReadOnlyGuid;
+
+/**
+ *  Read boot-args and EFI variables like HBFX does at start
+ *
+ *  @return amount of EFI variable lookups
+ */
+static long read(Configuration &config, const char *bootArgs, EfiRuntimeServices &rt)
+{
+	HostKernel::bootArgs() = bootArgs;
+	config.readArguments();
+	uint8_t buf[64];
+	uint32_t calls = config.readNVRAM(&rt, buf, sizeof(buf));
+	CHECK(calls == rt.calls);
+	return calls;
+}
+
+//==============================================================================
+
+static void testDefaults()
+{
+	Configuration config;
+	EfiRuntimeServices rt;
+	CHECK(read(config, "", rt) == Configuration::OptionCount);
+	CHECK(!config.dumpNvram && !config.compressPanicInfo && !config.disablePatchPCI && config.patchPCIFamily);
+	CHECK(config.ignored_device_list[0] == '\0' && config.autoHibernateMode == 0);
+	for (auto source : config.source)
+		CHECK(source == Configuration::Default);
+}
+
+//==============================================================================
+
+static void testBootArgs()
+{
+	Configuration config;
+	EfiRuntimeServices rt;
+	CHECK(read(config, "-v -hbfx-dump-nvram hbfx-patch-pci=XHC,IMEI hbfx-ahbm=0x1005 -hbfx-compress-panic -hbfx-disable-patch-pci", rt) == 0);
+	CHECK(config.dumpNvram && config.compressPanicInfo && config.disablePatchPCI && !config.patchPCIFamily);
+	CHECK(strcmp(config.ignored_device_list, "XHC,IMEI") == 0 && config.autoHibernateMode == 0x1005);
+	for (auto source : config.source)
+		CHECK(source == Configuration::BootArg);
+}
+
+//==============================================================================
+
+static void testPrecedence()
+{
+	Configuration config;
+	EfiRuntimeServices rt;
+	const bool yes = true;
+	const int mode = 0x45;
+	rt.set(u"hbfx-dump-nvram", &Guid, &yes, sizeof(yes));
+	rt.set(u"hbfx-compress-panic", &Guid, &yes, sizeof(yes));
+	rt.set(u"hbfx-patch-pci", &Guid, "GFX0", 5);
+	rt.set(u"hbfx-ahbm", &Guid, &mode, sizeof(mode));
+
+	// boot-args win, their options are not requested
+	CHECK(read(config, "hbfx-ahbm=3 hbfx-patch-pci=XHC", rt) == Configuration::OptionCount - 2);
+	CHECK(config.autoHibernateMode == 3 && strcmp(config.ignored_device_list, "XHC") == 0);
+	CHECK(config.source[Configuration::AutoHibernateMode] == Configuration::BootArg);
+	CHECK(config.dumpNvram && config.compressPanicInfo && !config.disablePatchPCI && config.patchPCIFamily);
+	CHECK(config.source[Configuration::DumpNvram] == Configuration::NVRAM);
+	CHECK(config.source[Configuration::DisablePatchPCI] == Configuration::Default);
+
+	// options which do not fit the buffer are not requested
+	CHECK(config.readNVRAM(&rt, nullptr, 0) == 0);
+
+	// options from NVRAM are requested again, boot-args stay
+	uint8_t buf[64];
+	rt.calls = 0;
+	CHECK(config.readNVRAM(&rt, buf, sizeof(buf)) == Configuration::OptionCount - 2 && rt.calls == Configuration::OptionCount - 2);
+	CHECK(config.autoHibernateMode == 3 && strcmp(config.ignored_device_list, "XHC") == 0);
+
+	// device list without boot-arg comes from NVRAM, none turns patching off
+	Configuration other;
+	EfiRuntimeServices off;
+	off.set(u"hbfx-patch-pci", &Guid, "none", 5);
+	CHECK(read(other, "", off) == Configuration::OptionCount);
+	CHECK(strcmp(other.ignored_device_list, "none") == 0 && !other.patchPCIFamily);
+
+	// macOS versions which do not need PCIFamily patching ignore its options
+	Configuration old;
+	EfiRuntimeServices oldrt;
+	HostKernel::version() = KernelVersion::Sierra - 1;
+	CHECK(read(old, "hbfx-patch-pci=XHC", oldrt) == Configuration::OptionCount - 2);
+	CHECK(old.ignored_device_list[0] == '\0' && !old.patchPCIFamily);
+	HostKernel::version() = KernelVersion::HighSierra;
+}
+
+//==============================================================================
+
+static void testSizes()
+{
+	Configuration config;
+	EfiRuntimeServices rt;
+	const uint16_t shortMode = 7;
+	const int flag = 1;
+	// hbfx-patch-pci must have at least 4 bytes, flags are one byte and numbers four
+	rt.set(u"hbfx-patch-pci", &Guid, "XH", 3);
+	rt.set(u"hbfx-ahbm", &Guid, &shortMode, sizeof(shortMode));
+	rt.set(u"hbfx-dump-nvram", &Guid, &flag, sizeof(flag));
+	rt.set(u"hbfx-compress-panic", &Guid, "\1", 1);
+	CHECK(read(config, "", rt) == Configuration::OptionCount);
+	CHECK(config.ignored_device_list[0] == '\0' && config.autoHibernateMode == 0 && !config.dumpNvram && config.compressPanicInfo);
+
+	// a list without terminating null and a list longer than the buffer
+	Configuration list;
+	EfiRuntimeServices listrt;
+	listrt.set(u"hbfx-patch-pci", &Guid, "XHC,", 4);
+	CHECK(read(list, "", listrt) == Configuration::OptionCount && strcmp(list.ignored_device_list, "XHC,") == 0);
+	Configuration longList;
+	EfiRuntimeServices longrt;
+	char names[100];
+	memset(names, 'A', sizeof(names));
+	longrt.set(u"hbfx-patch-pci", &Guid, names, sizeof(names));
+	// the variable does not fit into the buffer, so it can't be read
+	CHECK(read(longList, "", longrt) == Configuration::OptionCount && longList.ignored_device_list[0] == '\0');
+}
+
+//==============================================================================
+
+int main()
+{
+	testDefaults();
+	testBootArgs();
+	testPrecedence();
+	testSizes();
+	return report("%d options", Configuration::OptionCount);
+}
@@ -0,0 +1,123 @@
+//
+//  test_devset.cpp
+//  HibernationFixup host tests
+//
+//  DeviceNameSet parsing and exact matching, DeviceDecisionCache under device churn
+//  (devices terminate, new devices reuse their addresses) checked against a reference map.
+//
+
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "check.hpp"
+#include "kern_devset.hpp"
+
+static void testNames()
+{
+	DeviceNameSet set;
+	CHECK(set.parse("XHC,IMEI;IGPU GFX0\tHDEF|PXSX/RP01 ,; EH_1") == 8);
+	for (auto name : {"XHC", "IMEI", "IGPU", "GFX0", "HDEF", "PXSX", "RP01", "EH_1"})
+		CHECK(set.contains(name));
+	// names are matched exactly
+	CHECK(!set.contains("GFX") && !set.contains("IGFX") && !set.contains("XHC1") && !set.contains("xhc") && !set.contains(""));
+	CHECK(!set.contains(nullptr));
+
+	CHECK(set.parse(" ,;|") == 0 && set.empty() && !set.contains("XHC"));
+	CHECK(set.parse(nullptr) == 0 && set.empty());
+
+	// too long names are ignored
+	std::string longName(DeviceNameSet::MaxNameLength, 'A');
+	CHECK(set.parse((longName + ",XHC").c_str()) == 1 && set.contains("XHC") && !set.contains(longName.c_str()));
+	longName.pop_back();
+	CHECK(set.parse(longName.c_str()) == 1 && set.contains(longName.c_str()));
+
+	// names above the limit are ignored
+	std::string list;
+	for (size_t i = 0; i < DeviceNameSet::MaxNames + 6; i++)
+		list += "D" + std::to_string(i) + ",";
+	CHECK(set.parse(list.c_str()) == DeviceNameSet::MaxNames);
+	for (size_t i = 0; i < DeviceNameSet::MaxNames + 6; i++)
+		CHECK(set.contains(("D" + std::to_string(i)).c_str()) == (i < DeviceNameSet::MaxNames));
+}
+
+/**
+ *  Device addresses are taken from a pool larger than the cache. Half of them share one home slot,
+ *  so probe sequences wrap around and backward shift deletion moves entries on every removal.
+ */
+static std::vector<const void *> devicePool()
+{
+	std::vector<const void *> pool;
+	std::mt19937_64 random(2020);
+	for (uintptr_t i = 1; i <= DeviceDecisionCache::Capacity * 3 / 4; i++)
+		pool.push_back(reinterpret_cast<const void *>(i << 16));
+	for (size_t i = 0; i < DeviceDecisionCache::Capacity * 3 / 4; i++)
+		pool.push_back(reinterpret_cast<const void *>((random() & 0xFFFFFFFF0ULL) | 0x100000000ULL));
+	return pool;
+}
+
+static void testChurn()
+{
+	DeviceDecisionCache cache;
+	CHECK(cache.init());
+
+	std::vector<const void *> pool = devicePool();
+	std::map<const void *, bool> live;
+	std::mt19937 random(1974);
+	size_t found = 0, reused = 0;
+
+	for (int step = 0; step < 1000000 && !failed; step++) {
+		const void *device = pool[random() % pool.size()];
+		auto it = live.find(device);
+		bool decision;
+		if (it == live.end()) {
+			// a new device at the address of a terminated one, its decision must be made again
+			CHECK(!cache.lookup(device, decision));
+			live[device] = random() & 1;
+			cache.insert(device, live[device]);
+			reused++;
+		}
+		else if (random() % 8 == 0) {
+			cache.remove(device);
+			live.erase(it);
+		}
+		else if (cache.lookup(device, decision)) {
+			CHECK(decision == it->second);
+			found++;
+		}
+		else
+			cache.insert(device, it->second);
+
+		if (step % 4096 == 0) {
+			// every live device fits when fewer devices are alive than slots: no entry was lost by deletion
+			for (auto &entry : live)
+				cache.insert(entry.first, entry.second);
+			for (auto candidate : pool) {
+				auto alive = live.find(candidate);
+				bool cached = cache.lookup(candidate, decision);
+				CHECK(!cached || (alive != live.end() && decision == alive->second));
+				if (live.size() <= DeviceDecisionCache::Capacity)
+					CHECK(cached == (alive != live.end()));
+			}
+		}
+	}
+
+	// terminate everything, nothing is returned afterwards
+	for (auto candidate : pool)
+		cache.remove(candidate);
+	for (auto candidate : pool) {
+		bool decision;
+		CHECK(!cache.lookup(candidate, decision));
+	}
+	CHECK(found > 0 && reused > pool.size());
+	CHECK(cache.stats().invalidations > 0);
+	cache.deinit();
+}
+
+int main()
+{
+	testNames();
+	testChurn();
+	return report("device set and decision cache");
+}
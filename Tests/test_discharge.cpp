@@ -0,0 +1,160 @@
+//
+//  test_discharge.cpp
+//  HibernationFixup host tests
+//
+//  DischargePredictor sample handling and replay of discharge traces: capacity checks scheduled
+//  by the predictor are compared with fixed 60 second polling.
+//
+
+#include <math.h>
+
+#include "check.hpp"
+#include "kern_discharge.hpp"
+
+// the same limits as checkCapacity uses
+static constexpr uint64_t PollDelay     = 60;
+static constexpr uint64_t FallbackDelay = 600;
+static constexpr uint64_t MinimalDelay  = 15;
+static constexpr int      Threshold     = 10;
+
+/**
+ *  Battery draining from 100% to 0% in given time, discharge gets faster by acceleration (0 is linear),
+ *  capacity dips by 3% for a minute now and then, like some battery drivers report it
+ */
+struct Trace {
+	double duration;
+	double acceleration;
+	unsigned seed;
+
+	int capacity(uint64_t time, bool dips = true) const {
+		double x = time / duration;
+		double drained = x + acceleration * x * (x - 1);
+		double value = ceil(100 - 100 * drained);
+		if (!dips)
+			return value < 0 ? 0 : static_cast<int>(value);
+		unsigned minute = static_cast<unsigned>(time / 60) * 2654435761U ^ seed;
+		minute ^= minute >> 15;
+		if ((minute * 2246822519U >> 16) % 100 < 3)
+			value -= 3;
+		return value < 0 ? 0 : static_cast<int>(value);
+	}
+
+	/**
+	 *  Time when capacity really reaches threshold, a dip can be noticed earlier
+	 */
+	uint64_t crossing() const {
+		uint64_t time = 0;
+		while (capacity(time, false) > Threshold)
+			time++;
+		return time;
+	}
+};
+
+struct Replay {
+	unsigned checks;
+	uint64_t detected;
+};
+
+static Replay poll(const Trace &trace)
+{
+	Replay replay {0, 0};
+	for (; ; replay.detected += PollDelay) {
+		replay.checks++;
+		if (trace.capacity(replay.detected) <= Threshold)
+			return replay;
+	}
+}
+
+static Replay predict(const Trace &trace)
+{
+	DischargePredictor predictor;
+	Replay replay {0, 0};
+	for (; ; ) {
+		replay.checks++;
+		int capacity = trace.capacity(replay.detected);
+		predictor.add(replay.detected, capacity);
+		if (capacity <= Threshold)
+			return replay;
+		replay.detected += predictor.nextCheckDelay(Threshold, replay.detected, MinimalDelay, FallbackDelay, PollDelay);
+	}
+}
+
+static void testSamples()
+{
+	DischargePredictor predictor;
+	uint64_t seconds = 0;
+
+	// 1% per minute: 50% left, threshold 10% is reached in 40 minutes
+	for (int i = 0; i < 6; i++)
+		predictor.add(1000 + i * 60, 55 - i);
+	CHECK(predictor.samples() == 6);
+	CHECK(predictor.timeToThreshold(10, 1300, seconds));
+	CHECK(seconds == 40 * 60);
+	CHECK(predictor.nextCheckDelay(10, 1300, MinimalDelay, FallbackDelay, PollDelay) == FallbackDelay);
+	CHECK(predictor.nextCheckDelay(49, 1300, MinimalDelay, FallbackDelay, PollDelay) == MinimalDelay);
+	CHECK(predictor.timeToThreshold(60, 1300, seconds) && seconds == 0);
+
+	// one outlier does not move the estimate
+	predictor.add(1360, 30);
+	CHECK(predictor.timeToThreshold(10, 1360, seconds));
+	CHECK(seconds >= 38 * 60 && seconds <= 40 * 60);
+
+	// unchanged capacity is not stored more often than once a minute
+	size_t samples = predictor.samples();
+	predictor.add(1370, 30);
+	CHECK(predictor.samples() == samples);
+
+	// charging and sleeping reset the samples
+	predictor.add(1420, 31);
+	CHECK(predictor.samples() == 1);
+	predictor.add(1480, 30);
+	predictor.add(1480 + DischargePredictor::MaxSampleGap + 1, 29);
+	CHECK(predictor.samples() == 1);
+
+	// not enough samples, flat capacity
+	CHECK(!predictor.timeToThreshold(10, 3000, seconds));
+	CHECK(predictor.nextCheckDelay(10, 3000, MinimalDelay, FallbackDelay, PollDelay) == PollDelay);
+	predictor.reset();
+	for (int i = 0; i < 5; i++)
+		predictor.add(i * 120, 50);
+	CHECK(!predictor.timeToThreshold(10, 600, seconds));
+
+	// only the last MaxSamples samples are kept
+	predictor.reset();
+	for (int i = 0; i < 40; i++)
+		predictor.add(i * 60, 90 - i);
+	CHECK(predictor.samples() == DischargePredictor::MaxSamples);
+}
+
+static void testReplay()
+{
+	const Trace traces[] {
+		{1 * 3600, 0, 1}, {3 * 3600, 0, 2}, {8 * 3600, 0, 3},
+		{2 * 3600, 0.5, 4}, {5 * 3600, -0.3, 5}, {45 * 60, 0, 6}
+	};
+
+	for (const Trace &trace : traces) {
+		uint64_t crossing = trace.crossing();
+		Replay polled = poll(trace);
+		Replay predicted = predict(trace);
+		int64_t polledDelay = static_cast<int64_t>(polled.detected - crossing);
+		int64_t predictedDelay = static_cast<int64_t>(predicted.detected - crossing);
+		printf("%5.1fh drain, acceleration %4.1f: polling %3u checks, %4llds late; prediction %3u checks, %4llds late\n",
+			   trace.duration / 3600, trace.acceleration, polled.checks, static_cast<long long>(polledDelay),
+			   predicted.checks, static_cast<long long>(predictedDelay));
+
+		// the threshold is detected within one poll interval with a fraction of the checks,
+		// accelerating discharge is extrapolated linearly, so it may take one more interval
+		int64_t allowed = static_cast<int64_t>(trace.acceleration > 0 ? 2 * PollDelay : PollDelay);
+		CHECK(polledDelay <= static_cast<int64_t>(PollDelay));
+		CHECK(predictedDelay <= allowed);
+		CHECK(predicted.checks * 2 < polled.checks);
+	}
+}
+
+int main()
+{
+	testSamples();
+	testReplay();
+	return report("discharge prediction");
+}
@@ -0,0 +1,52 @@
+//
+//  test_gmtime.cpp
+//  HibernationFixup host tests
+//
+//  Differential test of HBFX gmtime_r against libc gmtime_r.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <random>
+
+#include "gmtime_shim.hpp"
+
+static bool check(int64_t seconds)
+{
+	time_t t = static_cast<time_t>(seconds);
+	struct tm expected {};
+	if (!gmtime_r(&t, &expected))
+		return true;
+
+	int actual[TmFieldCount];
+	hbfxGmtime(seconds, actual);
+	int wanted[TmFieldCount] {expected.tm_sec, expected.tm_min, expected.tm_hour, expected.tm_mday, expected.tm_mon,
+		expected.tm_year, expected.tm_wday, expected.tm_yday, expected.tm_isdst};
+	for (int i = 0; i < TmFieldCount; i++) {
+		if (actual[i] != wanted[i]) {
+			fprintf(stderr, "gmtime mismatch for %lld: field %d is %d, libc has %d\n", static_cast<long long>(seconds), i, actual[i], wanted[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+int main()
+{
+	size_t checked = 0;
+	bool ok = true;
+
+	// every hour boundary (and the seconds around it) from 1900 to 2200
+	for (int64_t seconds = -2208988800LL; seconds < 7258118400LL && ok; seconds += 3600, checked += 3)
+		ok = check(seconds - 1) && check(seconds) && check(seconds + 1);
+
+	// random times within +-10000 years
+	std::mt19937_64 random(1974);
+	std::uniform_int_distribution<int64_t> distribution(-377705116800LL, 253402300799LL);
+	for (size_t i = 0; i < 2000000 && ok; i++, checked++)
+		ok = check(distribution(random));
+
+	printf("%zu timestamps checked: %s\n", checked, ok ? "ok" : "FAILED");
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,144 @@
+//
+//  test_initonce.cpp
+//  HibernationFixup host tests
+//
+//  InitOnce used the way initializeNVStorage uses it: callers which do not wait, 64 threads at once.
+//
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "check.hpp"
+#include "kern_initonce.hpp"
+
+struct MutexLock {
+	std::mutex mutex;
+	void acquire() { mutex.lock(); }
+	bool tryAcquire() { return mutex.try_lock(); }
+	void release() { mutex.unlock(); }
+};
+
+/**
+ *  Storage which fails to initialize a few times, initialization is slow enough for callers to overlap
+ */
+struct Storage {
+	InitOnce<MutexLock> initOnce;
+	std::atomic<int> running {0};
+	std::atomic<int> attempts {0};
+	std::atomic<int> overlaps {0};
+	std::atomic<bool> blocked {false};
+	int failures {0};
+	int value {0};
+
+	bool init() {
+		if (running.fetch_add(1) != 0)
+			overlaps++;
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+		while (blocked.load())
+			std::this_thread::yield();
+		bool succeeded = attempts.fetch_add(1) >= failures;
+		if (succeeded)
+			value = 42;
+		running.fetch_sub(1);
+		return succeeded;
+	}
+
+	bool initialize(bool wait) {
+		if (initOnce.ready())
+			return true;
+
+		if (!initOnce.begin(wait))
+			return false;
+
+		bool initialized = initOnce.ready();
+		if (!initialized)
+			initialized = init();
+
+		initOnce.finish(initialized);
+		return initialized;
+	}
+};
+
+/**
+ *  Panic path does not wait: while another thread is stuck in initialization,
+ *  a caller which does not wait gives up at once and can retry later
+ */
+static void testNoWait()
+{
+	Storage storage;
+	storage.blocked = true;
+	std::thread owner([&]() { storage.initialize(true); });
+	while (storage.running.load() == 0)
+		std::this_thread::yield();
+
+	for (int i = 0; i < 1000; i++)
+		CHECK(!storage.initialize(false));
+	auto start = std::chrono::steady_clock::now();
+	CHECK(!storage.initialize(false));
+	CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100));
+	CHECK(storage.running == 1 && storage.attempts == 0 && !storage.initOnce.ready());
+
+	storage.blocked = false;
+	owner.join();
+	CHECK(storage.initOnce.ready() && storage.initialize(false) && storage.attempts == 1);
+}
+
+int main()
+{
+	testNoWait();
+
+	constexpr int Threads = 64;
+	constexpr int Rounds  = 200;
+
+	for (int round = 0; round < Rounds; round++) {
+		Storage storage;
+		storage.failures = round % 4;
+
+		std::atomic<bool> start {false};
+		std::atomic<int> succeeded {0}, incomplete {0}, skipped {0};
+		std::vector<std::thread> threads;
+		for (int i = 0; i < Threads; i++) {
+			// every 8th caller does not wait, like the panic path
+			bool wait = i % 8 != 0;
+			threads.emplace_back([&, wait]() {
+				while (!start.load())
+					std::this_thread::yield();
+				// callers retry like sleep and panic paths do, waiting callers finish with NVStorage ready
+				for (int attempt = 0; attempt <= storage.failures; attempt++) {
+					if (storage.initialize(wait)) {
+						succeeded++;
+						if (storage.value != 42)
+							incomplete++;
+						return;
+					}
+				}
+				skipped++;
+			});
+		}
+		start = true;
+		for (auto &thread : threads)
+			thread.join();
+
+		CHECK_CASE(storage.overlaps == 0, "round", round);
+		CHECK_CASE(incomplete == 0, "round", round);
+		CHECK_CASE(storage.initOnce.ready(), "round", round);
+		// initialization succeeds once, every failure is retried once
+		CHECK_CASE(storage.attempts == storage.failures + 1, "round", round);
+		// only callers which do not wait may give up
+		CHECK_CASE(succeeded + skipped == Threads && skipped <= Threads / 8, "round", round);
+
+		// ready storage does not lock
+		storage.initOnce.lock.acquire();
+		CHECK_CASE(storage.initialize(false) && storage.initialize(true), "round", round);
+		storage.initOnce.lock.release();
+
+		// after reset storage is initialized again
+		storage.initOnce.reset();
+		CHECK_CASE(storage.initialize(true) && storage.attempts == storage.failures + 2, "round", round);
+	}
+
+	return report("%d rounds of %d threads", Rounds, Threads);
+}
@@ -0,0 +1,151 @@
+//
+//  test_nvbatch.cpp
+//  HibernationFixup host tests
+//
+//  NVBatch against an in-memory NVStorage: written data is compared byte-for-byte,
+//  raw OSData must be stored without a copy, and every write of a batch is made to fail
+//  with and without rollback.
+//
+
+#include <string>
+#include <vector>
+
+#include "check.hpp"
+#include "kern_nvbatch.hpp"
+
+static constexpr size_t Variables = 6;
+
+static std::vector<uint8_t> value(size_t index, uint8_t seed)
+{
+	std::vector<uint8_t> bytes(16 + index * 7);
+	for (size_t i = 0; i < bytes.size(); i++)
+		bytes[i] = static_cast<uint8_t>(seed + index * 31 + i);
+	return bytes;
+}
+
+static bool equals(const OSData *data, const std::vector<uint8_t> &bytes)
+{
+	return data && data->getLength() == bytes.size() && memcmp(data->getBytesNoCopy(), bytes.data(), bytes.size()) == 0;
+}
+
+static std::string key(size_t index)
+{
+	return "test-variable-" + std::to_string(index);
+}
+
+//==============================================================================
+
+static void testStage()
+{
+	NVBatchStorage<2> batch;
+	uint8_t byte = 0;
+	CHECK(batch.capacity() == 2);
+	CHECK(!batch.stage(std::string(NVBatch::MaxKeyLength, 'k').c_str(), &byte, 1));
+	CHECK(!batch.stage("null", nullptr));
+	CHECK(batch.stage("a", &byte, 1) && batch.stage("b", &byte, 1));
+	CHECK(!batch.stage("c", &byte, 1) && batch.count() == 2);
+	batch.reset();
+	CHECK(batch.count() == 0 && batch.stage("c", &byte, 1));
+}
+
+//==============================================================================
+
+static void testCommit()
+{
+	std::vector<std::vector<uint8_t>> raw;
+	std::vector<OSData *> objects;
+	for (size_t i = 0; i < Variables; i++)
+	{
+		raw.push_back(value(i, 1));
+		objects.push_back(OSData::withBytes(value(i, 2).data(), static_cast<unsigned int>(value(i, 2).size())));
+	}
+
+	NVStorage storage;
+	NVBatchStorage<Variables * 2> batch;
+	for (size_t i = 0; i < Variables; i++)
+	{
+		CHECK(batch.stage(key(i).c_str(), raw[i].data(), static_cast<uint32_t>(raw[i].size())));
+		CHECK(batch.stage(key(Variables + i).c_str(), objects[i]));
+	}
+	// staged objects are retained, the caller may drop its references
+	for (auto &object : objects)
+		object->release();
+
+	CHECK(batch.commit(storage));
+	CHECK(storage.writes == static_cast<long>(Variables * 2) && storage.reads == 0);
+	for (size_t i = 0; i < Variables; i++)
+	{
+		CHECK(equals(storage.stored(key(i).c_str()), raw[i]));
+		// raw OSData is stored as is
+		CHECK(storage.stored(key(Variables + i).c_str()) == objects[i]);
+		CHECK(equals(storage.stored(key(Variables + i).c_str()), value(i, 2)));
+	}
+	CHECK(batch.stats().commits == 1 && batch.stats().written == Variables * 2 && batch.stats().copied == Variables);
+
+	// any other option makes NVStorage encode data, so it is copied
+	CHECK(batch.commit(storage, NVStorage::OptChecksum));
+	CHECK(batch.stats().commits == 2 && batch.stats().written == Variables * 4 && batch.stats().copied == Variables * 3);
+	CHECK(storage.stored(key(Variables).c_str()) != objects[0]);
+	batch.reset();
+}
+
+//==============================================================================
+
+static void testFailure(bool rollback)
+{
+	for (size_t fail = 0; fail < Variables; fail++)
+	{
+		// even variables exist before commit
+		NVStorage storage;
+		for (size_t i = 0; i < Variables; i += 2)
+			CHECK(storage.write(key(i).c_str(), value(i, 3).data(), static_cast<uint32_t>(value(i, 3).size())));
+
+		std::vector<std::vector<uint8_t>> raw;
+		for (size_t i = 0; i < Variables; i++)
+			raw.push_back(value(i, 4));
+
+		NVBatchStorage<Variables> batch;
+		for (size_t i = 0; i < Variables; i++)
+			CHECK(batch.stage(key(i).c_str(), raw[i].data(), static_cast<uint32_t>(raw[i].size())));
+
+		storage.writes = 0;
+		storage.failWrite = static_cast<long>(fail);
+		CHECK_CASE(!batch.commit(storage, NVStorage::OptRaw, rollback), "fail", fail);
+		storage.failWrite = -1;
+
+		for (size_t i = 0; i < Variables; i++)
+		{
+			auto stored = storage.stored(key(i).c_str());
+			if (i < fail && !rollback)
+				CHECK_CASE(equals(stored, raw[i]), "fail", fail);
+			else if (i % 2 == 0)
+				CHECK_CASE(equals(stored, value(i, 3)), "fail", fail);
+			else
+				CHECK_CASE(stored == nullptr, "fail", fail);
+		}
+
+		auto &stats = batch.stats();
+		CHECK_CASE(stats.commits == 1, "fail", fail);
+		CHECK_CASE(stats.written == (rollback ? 0 : fail), "fail", fail);
+		CHECK_CASE(stats.rolledBack == (rollback ? fail : 0), "fail", fail);
+		CHECK_CASE(storage.reads == (rollback ? static_cast<long>(Variables) : 0), "fail", fail);
+
+		// the same batch succeeds once storage does
+		CHECK_CASE(batch.commit(storage, NVStorage::OptRaw, rollback), "fail", fail);
+		for (size_t i = 0; i < Variables; i++)
+			CHECK_CASE(equals(storage.stored(key(i).c_str()), raw[i]), "fail", fail);
+	}
+}
+
+//==============================================================================
+
+int main()
+{
+	testStage();
+	testCommit();
+	testFailure(false);
+	testFailure(true);
+	// staged objects, snapshots and stored variables are all released
+	CHECK(OSData::alive() == 0);
+	return report("%zu variables per batch, failure at every write with and without rollback", Variables);
+}
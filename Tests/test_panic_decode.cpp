@@ -0,0 +1,66 @@
+//
+//  test_panic_decode.cpp
+//  HibernationFixup host tests
+//
+//  LZSS decoder and compressed panic info layout round trips.
+//
+
+#include <string.h>
+#include <random>
+
+#include "check.hpp"
+#include "panic_decode.hpp"
+#include "panic_sample.hpp"
+
+// nvram -p output with panic info split into chunks as packA does it
+static std::string storeCompressed(const std::string &text, size_t chunkSize) {
+	auto lzss = LZSS::compress(reinterpret_cast<const uint8_t *>(text.data()), text.size());
+	PanicInfo::Header header {PanicInfo::Header::Signature, static_cast<uint32_t>(text.size()), static_cast<uint32_t>(lzss.size())};
+	std::string data(reinterpret_cast<const char *>(&header), sizeof(header));
+	data.append(reinterpret_cast<const char *>(lzss.data()), lzss.size());
+
+	std::string nvram = "boot-args\t-v keepsyms=1\n";
+	char key[32];
+	for (unsigned i = 0; i * chunkSize < data.size(); i++) {
+		snprintf(key, sizeof(key), PanicInfo::CompressedKeyFormat, i);
+		nvram += std::string(key) + "\t" + PanicDecode::escape(data.substr(i * chunkSize, chunkSize)) + "\n";
+	}
+	return nvram;
+}
+
+int main()
+{
+	// LZSS round trips, including empty input, runs longer than the lookahead and binary data
+	std::mt19937 random(5);
+	std::string binary(5000, '\0');
+	for (auto &c : binary)
+		c = static_cast<char>(random());
+	const std::string inputs[] {"", "a", std::string(100, ' '), std::string(10000, 'x'), binary, samplePanic(20000, 7)};
+	for (auto &input : inputs) {
+		auto lzss = LZSS::compress(reinterpret_cast<const uint8_t *>(input.data()), input.size());
+		std::string output(input.size(), '\0');
+		size_t size = LZSS::decompress(reinterpret_cast<uint8_t *>(&output[0]), output.size(), lzss.data(), lzss.size());
+		CHECK(size == input.size() && output == input);
+	}
+
+	// compressed panic info split into 768 and 4096 byte chunks
+	for (size_t chunkSize : {768, 4096}) {
+		const std::string text = samplePanic(64 * 1024, static_cast<uint32_t>(chunkSize));
+		std::string nvram = storeCompressed(text, chunkSize), panic, error;
+		CHECK(PanicDecode::decode(nvram, panic, error) && panic == text);
+
+		// a missing chunk is reported
+		size_t first = nvram.find("HBFX,PanicInfo0001");
+		std::string broken = nvram.substr(0, first) + nvram.substr(nvram.find('\n', first) + 1);
+		CHECK(!PanicDecode::decode(broken, panic, error) && error == "missing variable HBFX,PanicInfo0001");
+
+		// a truncated last chunk is reported
+		std::string truncated = nvram.substr(0, nvram.size() - 20) + "\n";
+		CHECK(!PanicDecode::decode(truncated, panic, error) && error == "panic info is truncated");
+	}
+
+	std::string panic, error;
+	CHECK(!PanicDecode::decode("AAPL,PanicInfo0000\tabc\n", panic, error));
+
+	return report("panic info decoder");
+}
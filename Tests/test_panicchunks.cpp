@@ -0,0 +1,145 @@
+//
+//  test_panicchunks.cpp
+//  HibernationFixup host tests
+//
+//  Panic arena simulation: a 64 KiB panic log is packed in place (xnu packA) and split into
+//  chunks reserved like reservePanicArena does, while every allocation aborts the test.
+//  Prints how much of the arena the log used.
+//
+
+#include <string.h>
+#include <unistd.h>
+#include <new>
+#include <vector>
+
+#include "check.hpp"
+#include "kern_panicchunks.hpp"
+
+static bool allocationsAbort = false;
+
+static void allocated(const char *what)
+{
+	if (allocationsAbort) {
+		// stdio may allocate, write is safe here
+		static const char message[] = "memory is allocated while storing panic info: ";
+		(void)!write(STDERR_FILENO, message, sizeof(message) - 1);
+		(void)!write(STDERR_FILENO, what, strlen(what));
+		(void)!write(STDERR_FILENO, "\n", 1);
+		abort();
+	}
+}
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size) { allocated("malloc"); return __libc_malloc(size); }
+extern "C" void *calloc(size_t count, size_t size) { allocated("calloc"); return __libc_calloc(count, size); }
+extern "C" void *realloc(void *ptr, size_t size) { allocated("realloc"); return __libc_realloc(ptr, size); }
+#endif
+
+void *operator new(size_t size)
+{
+	allocated("operator new");
+	if (void *ptr = malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+/**
+ *  Maximum amount of panic info variables (PanicInfo::MaxChunks)
+ */
+static constexpr uint32_t MaxChunks = 128;
+
+/**
+ *  Reserved chunk, growing it past its capacity would allocate like OSData::appendBytes does
+ */
+struct Chunk {
+	std::vector<char> data;
+	uint32_t length {0};
+
+	bool append(const char *src, uint32_t size) {
+		if (length + size > data.size())
+			allocated("chunk growth");
+		memcpy(data.data() + length, src, size);
+		length += size;
+		return true;
+	}
+};
+
+/**
+ *  xnu packA: 8 ASCII characters are packed into 7 bytes in place
+ *
+ *  @return packed size
+ */
+static uint32_t packInPlace(char *buf, uint32_t length)
+{
+	uint32_t packed = 0;
+	for (uint32_t i = 0; i < length; i += 8) {
+		uint64_t bits = 0;
+		for (uint32_t k = 0; k < 8; k++)
+			bits |= static_cast<uint64_t>(i + k < length ? buf[i + k] & 0x7F : 0) << (7 * k);
+		for (uint32_t k = 0; k < 7; k++)
+			buf[packed++] = static_cast<char>((bits >> (8 * k)) & 0xFF);
+	}
+	return packed;
+}
+
+/**
+ *  Store a panic log the way packA does it with a reserved arena
+ *
+ *  @param pack  the kernel packs the log (no packA original means raw text is stored)
+ */
+static void store(uint32_t chunkSize, bool pack)
+{
+	// panic log text, the kernel buffer holds it before packA
+	std::vector<char> log(PanicChunks::InfoSize);
+	for (size_t i = 0; i < log.size(); i++)
+		log[i] = "0123456789abcdef: Backtrace (CPU 0), Frame : Return Address\n"[i % 61];
+	std::vector<char> expected(log);
+	uint32_t expectedSize = pack ? packInPlace(expected.data(), static_cast<uint32_t>(expected.size())) : static_cast<uint32_t>(expected.size());
+
+	// reservePanicArena
+	const uint32_t count = PanicChunks::count(chunkSize, MaxChunks);
+	std::vector<Chunk> chunks(count);
+	for (auto &chunk : chunks)
+		chunk.data.resize(chunkSize);
+
+	allocationsAbort = true;
+	uint32_t size = pack ? packInPlace(log.data(), static_cast<uint32_t>(log.size())) : static_cast<uint32_t>(log.size());
+	bool fits = size <= count * chunkSize;
+	uint32_t stored = 0;
+	if (fits)
+		stored = PanicChunks::split(log.data(), size, chunkSize, count, [&](uint32_t index, const char *data, uint32_t part) {
+			return chunks[index].append(data, part);
+		});
+	allocationsAbort = false;
+
+	CHECK_CASE(fits, "chunk size", chunkSize);
+	CHECK_CASE(size == expectedSize && stored == (size + chunkSize - 1) / chunkSize, "chunk size", chunkSize);
+	uint32_t used = 0;
+	for (uint32_t i = 0; i < stored; i++) {
+		CHECK_CASE(memcmp(chunks[i].data.data(), expected.data() + used, chunks[i].length) == 0, "chunk", i);
+		used += chunks[i].length;
+	}
+	CHECK_CASE(used == size, "chunk size", chunkSize);
+
+	printf("%u KiB %s panic info in %u-byte chunks: %u of %u chunks, %u of %u reserved bytes used\n",
+		   PanicChunks::InfoSize / 1024, pack ? "packed" : "raw", chunkSize, stored, count, used, count * chunkSize);
+}
+
+//==============================================================================
+
+int main()
+{
+	// firmware NVRAM and emulated NVRAM chunk sizes
+	for (uint32_t chunkSize : {768, 4096}) {
+		store(chunkSize, true);
+		store(chunkSize, false);
+	}
+	return report("panic info was stored without memory allocations");
+}
@@ -0,0 +1,55 @@
+//
+//  test_plist.cpp
+//  HibernationFixup host tests
+//
+//  kern_plist.hpp output compared with the text OSSerialize produces.
+//
+
+#include <string.h>
+
+#include "check.hpp"
+#include "kern_plist.hpp"
+#include "string_sink.hpp"
+
+template <typename Encode>
+static void expect(const char *expected, Encode encode)
+{
+	StringSink sink;
+	if (!encode(sink) || sink.text != expected) {
+		fprintf(stderr, "expected '%s', got '%s'\n", expected, sink.text.c_str());
+		failed = true;
+	}
+}
+
+static const uint8_t *bytes(const char *str)
+{
+	return reinterpret_cast<const uint8_t *>(str);
+}
+
+int main()
+{
+	// RFC 4648 test vectors
+	const char *vectors[][2] {{"", ""}, {"f", "Zg=="}, {"fo", "Zm8="}, {"foo", "Zm9v"}, {"foob", "Zm9vYg=="}, {"fooba", "Zm9vYmE="}, {"foobar", "Zm9vYmFy"}};
+	for (auto &vector : vectors)
+		expect(vector[1], [&](StringSink &s) { return Plist::appendBase64(s, bytes(vector[0]), strlen(vector[0])); });
+
+	// longer than the internal 64-character buffer
+	std::string zeros(100, '\0'), expected;
+	for (int i = 0; i < 33; i++)
+		expected += "AAAA";
+	expected += "AA==";
+	expect(expected.c_str(), [&](StringSink &s) { return Plist::appendBase64(s, bytes(zeros.data()), zeros.size()); });
+
+	expect("a&amp;b&lt;c&gt;d", [](StringSink &s) { return Plist::appendEscaped(s, "a&b<c>d", 7); });
+	expect("&lt;&gt;", [](StringSink &s) { return Plist::appendEscaped(s, "<>", 2); });
+	expect("\n<key>7C436110-AB2A-4BBB-A880-FE41995C9F82:boot-args</key>\n",
+		   [](StringSink &s) { return Plist::appendKey(s, "7C436110-AB2A-4BBB-A880-FE41995C9F82:boot-args", 46); });
+	expect("<data>AQI=</data>", [](StringSink &s) { return Plist::appendData(s, bytes("\x01\x02"), 2); });
+	expect("<string>-v &amp;</string>", [](StringSink &s) { return Plist::appendString(s, "-v &", 4); });
+	expect("<true/>", [](StringSink &s) { return Plist::appendBoolean(s, true); });
+	expect("<false/>", [](StringSink &s) { return Plist::appendBoolean(s, false); });
+	expect("<integer size=\"32\">0x0</integer>", [](StringSink &s) { return Plist::appendInteger(s, 32, 0); });
+	expect("<integer size=\"64\">0xffffffffffffffff</integer>", [](StringSink &s) { return Plist::appendInteger(s, 64, UINT64_MAX); });
+
+	return report("plist encoding");
+}
@@ -0,0 +1,89 @@
+//
+//  test_powersource.cpp
+//  HibernationFixup host tests
+//
+//  AutoHibernate::aggregate: several power sources combined into one snapshot.
+//
+
+#include "check.hpp"
+#include "kern_autohib.hpp"
+
+using namespace AutoHibernate;
+
+static PowerSourceState battery(uint32_t current, uint32_t maximum, int percent, bool charging = false, bool warn = false, bool critical = false)
+{
+	PowerSourceState state {};
+	state.batteryInstalled         = true;
+	state.charging                 = charging;
+	state.atWarnLevel              = warn;
+	state.atCriticalLevel          = critical;
+	state.currentCapacity          = current;
+	state.maxCapacity              = maximum;
+	state.capacityPercentRemaining = percent;
+	return state;
+}
+
+static PowerSourceState ups(bool externalConnected)
+{
+	PowerSourceState state {};
+	state.externalConnected = externalConnected;
+	return state;
+}
+
+int main()
+{
+	// no power sources: desktop without battery
+	PowerSnapshot none = aggregate(nullptr, 0);
+	CHECK(!none.batteryInstalled && !none.externalConnected && !none.charging);
+	CHECK(!none.atWarnLevel && !none.atCriticalLevel && none.capacityPercentRemaining == 0);
+
+	// single battery, percent is calculated from capacities (rounded)
+	PowerSourceState single[] {battery(2005, 4000, 49)};
+	PowerSnapshot one = aggregate(single, 1);
+	CHECK(one.batteryInstalled && one.capacityPercentRemaining == 50);
+
+	// two batteries: total capacity, charging if any battery charges
+	PowerSourceState two[] {battery(3000, 6000, 50), battery(1000, 4000, 25, true)};
+	PowerSnapshot both = aggregate(two, 2);
+	CHECK(both.batteryInstalled && both.charging && both.capacityPercentRemaining == 40);
+
+	// a battery without capacity values: average of reported percents
+	PowerSourceState unknown[] {battery(3000, 6000, 50), battery(0, 0, 20)};
+	CHECK(aggregate(unknown, 2).capacityPercentRemaining == 35);
+
+	// warning and critical levels are reached when every battery reached them
+	PowerSourceState levels[] {battery(100, 4000, 3, false, true, true), battery(3000, 4000, 75, false, true, false)};
+	PowerSnapshot level = aggregate(levels, 2);
+	CHECK(level.atWarnLevel && !level.atCriticalLevel);
+	levels[1].atCriticalLevel = true;
+	CHECK(aggregate(levels, 2).atCriticalLevel);
+
+	// UPS provides external power only, it does not count as a battery
+	PowerSourceState mixed[] {ups(true), battery(500, 5000, 10, false, true, true)};
+	PowerSnapshot withUps = aggregate(mixed, 2);
+	CHECK(withUps.externalConnected && withUps.batteryInstalled && withUps.capacityPercentRemaining == 10);
+	CHECK(withUps.atWarnLevel && withUps.atCriticalLevel);
+	PowerSourceState onlyUps[] {ups(false)};
+	PowerSnapshot upsOnly = aggregate(onlyUps, 1);
+	CHECK(!upsOnly.batteryInstalled && !upsOnly.externalConnected && !upsOnly.atWarnLevel);
+
+	// lid state of the given snapshot is kept, battery values are replaced
+	PowerSnapshot previous {};
+	previous.lidIsOpen = true;
+	previous.charging = true;
+	previous.externalConnected = true;
+	PowerSnapshot updated = aggregate(single, 1, previous);
+	CHECK(updated.lidIsOpen && !updated.charging && !updated.externalConnected);
+	CHECK(sameBatteryState(updated, one) && !sameBatteryState(updated, both));
+	updated.lidIsOpen = false;
+	CHECK(sameBatteryState(updated, one));
+
+	// aggregated state drives the capacity check: total capacity counts, no sleep on external power
+	Options options {};
+	options.minimalRemainingCapacity = 15;
+	CHECK(evaluateCapacity(options, aggregate(mixed + 1, 1)) == Reason::MinimalCapacity);
+	CHECK(evaluateCapacity(options, aggregate(levels, 2)) == Reason::None);
+	CHECK(evaluateCapacity(options, withUps) == Reason::None);
+
+	return report("power source aggregation");
+}
@@ -0,0 +1,296 @@
+//
+//  test_powerwatch.cpp
+//  HibernationFixup host tests
+//
+//  PowerSourceWatch with scripted power sources: getter reads per capacity decision, sources terminated
+//  and published while a capture queries them, per-source notification tracking, and a discharge
+//  simulation comparing detection latency and timer wakeups per hour of polled and notifying batteries.
+//
+
+#include "check.hpp"
+#include "kern_powerwatch.hpp"
+
+/**
+ *  Non-recursive lock which records whether it is held, so sources can check they are queried without it
+ */
+struct FakeLock {
+	bool held {false};
+	long acquisitions {0};
+
+	void acquire() {
+		CHECK(!held);
+		held = true;
+		acquisitions++;
+	}
+
+	void release() {
+		CHECK(held);
+		held = false;
+	}
+};
+
+struct FakeNotifier {};
+
+struct FakeSource;
+using Watch = PowerSourceWatch<FakeSource, FakeNotifier, FakeLock>;
+static Watch *watch = nullptr;
+
+/**
+ *  IOPMPowerSource counterpart: values are set by the test, every getter call is counted,
+ *  script is called by the first getter of a capture to change the world meanwhile
+ */
+struct FakeSource {
+	bool     installed {true};
+	bool     external {false};
+	bool     charging {false};
+	bool     warn {false};
+	bool     critical {false};
+	uint32_t current {3000};
+	uint32_t maximum {6000};
+	int      percent {50};
+
+	int  refs {1};
+	long reads {0};
+	void (*script)(FakeSource *) {nullptr};
+
+	void retain() { refs++; }
+	void release() { CHECK(refs > 0); refs--; }
+
+	bool     batteryInstalled()         { return get(installed); }
+	bool     externalConnected()        { return get(external); }
+	bool     isCharging()               { return get(charging); }
+	bool     atWarnLevel()              { return get(warn); }
+	bool     atCriticalLevel()          { return get(critical); }
+	uint32_t currentCapacity()          { return get(current); }
+	uint32_t maxCapacity()              { return get(maximum); }
+	int      capacityPercentRemaining() { return get(percent); }
+
+private:
+	template <typename T>
+	T get(T value) {
+		// the battery driver may be slow, the list lock must not be held while it is queried
+		CHECK(!watch->lock.held);
+		// a source must be alive (retained) while it is queried
+		CHECK(refs > 0);
+		reads++;
+		if (script) {
+			auto run = script;
+			script = nullptr;
+			run(this);
+		}
+		return value;
+	}
+};
+
+static void release(FakeSource *source, FakeNotifier *) {
+	source->release();
+}
+
+/**
+ *  Every value of a battery is read once per decision, a source without battery only reports its presence
+ *  and external power, the sources keep one reference held by the watch after the capture
+ */
+static void testReads() {
+	Watch w;
+	watch = &w;
+	FakeSource battery, ups;
+	ups.installed = false;
+	ups.external = true;
+	CHECK(w.add(&battery) && w.add(&ups));
+	CHECK(!w.add(&battery));
+
+	constexpr int Decisions = 100;
+	AutoHibernate::PowerSnapshot snapshot {};
+	snapshot.lidIsOpen = true;
+	for (int i = 0; i < Decisions; i++)
+		CHECK(w.capture(snapshot) == 2);
+
+	CHECK(battery.reads == 8 * Decisions && ups.reads == 2 * Decisions);
+	CHECK(snapshot.batteryInstalled && snapshot.externalConnected && snapshot.capacityPercentRemaining == 50 && snapshot.lidIsOpen);
+	CHECK(battery.refs == 2 && ups.refs == 2);
+	printf("%.1f getter reads per decision with a battery and a UPS\n", (battery.reads + ups.reads) / static_cast<double>(Decisions));
+
+	// one acquisition per capture, none while the sources are queried
+	long acquisitions = w.lock.acquisitions;
+	w.capture(snapshot);
+	CHECK(w.lock.acquisitions == acquisitions + 1);
+
+	w.clear(release);
+	CHECK(battery.refs == 1 && ups.refs == 1);
+}
+
+/**
+ *  A source terminated by the battery driver while another one is queried stays retained until
+ *  the capture is done, a source published meanwhile is seen by the next capture
+ */
+static void testMidCapture() {
+	Watch w;
+	watch = &w;
+	FakeSource first, second, third;
+	second.current = 1000;
+	second.maximum = 2000;
+	CHECK(w.add(&first) && w.add(&second));
+
+	static FakeSource *terminated, *published;
+	terminated = &second;
+	published = &third;
+	first.script = [](FakeSource *) {
+		FakeNotifier *interest = nullptr;
+		FakeSource *removed = watch->remove(terminated, interest);
+		CHECK(removed == terminated);
+		removed->release();
+		CHECK(watch->add(published));
+		// termination changes the state too, the capture reads its own copy of the list
+		terminated->percent = 0;
+	};
+
+	AutoHibernate::PowerSnapshot snapshot {};
+	CHECK(w.capture(snapshot) == 2);
+	// both batteries were read: 3000 + 1000 of 6000 + 2000
+	CHECK(snapshot.capacityPercentRemaining == 50);
+	CHECK(second.refs == 1 && second.reads == 8);
+	CHECK(third.reads == 0 && third.refs == 2);
+
+	CHECK(w.capture(snapshot) == 2);
+	CHECK(second.reads == 8 && third.reads == 8);
+	w.clear(release);
+	CHECK(first.refs == 1 && third.refs == 1);
+}
+
+/**
+ *  Capacity checks get rare only when every source sends status notifications
+ */
+static void testPerSource() {
+	Watch w;
+	watch = &w;
+	FakeSource internal, external, replacement;
+	CHECK(w.add(&internal) && w.add(&external));
+
+	AutoHibernate::Options options {};
+	DischargePredictor predictor;
+	CHECK(!w.notifying() && w.nextCheckDelay(options, predictor, 0) == Watch::PollInterval);
+
+	// one battery notifies, the other one is still polled
+	CHECK(w.notified(&internal) && w.notified(&internal));
+	CHECK(w.notifications(&internal) == 2 && w.notifications(&external) == 0);
+	CHECK(!w.notifying() && w.nextCheckDelay(options, predictor, 0) == Watch::PollInterval);
+
+	CHECK(w.notified(&external));
+	CHECK(w.notifying() && w.nextCheckDelay(options, predictor, 0) == Watch::FallbackInterval);
+
+	// unknown sources are not counted
+	CHECK(!w.notified(&replacement) && w.notifications(&replacement) == 0);
+
+	// a replaced battery has to prove it notifies again
+	FakeNotifier interest, *kept = nullptr;
+	CHECK(w.attach(&external, &interest));
+	CHECK(w.remove(&external, kept) == &external && kept == &interest);
+	external.release();
+	CHECK(w.add(&replacement));
+	CHECK(!w.notifying() && w.nextCheckDelay(options, predictor, 0) == Watch::PollInterval);
+	CHECK(w.notified(&replacement) && w.notifying());
+
+	// without sources nothing notifies
+	w.clear(release);
+	CHECK(!w.notifying());
+}
+
+/**
+ *  Battery driver updating its state every UpdateInterval seconds while the battery drains 1% per
+ *  SecondsPerPercent, a notifying driver sends a status notification when the values change
+ */
+struct DischargeRun {
+	uint64_t latency;
+	uint64_t detected;
+	long     wakeups;
+	long     notifications;
+};
+
+static constexpr uint64_t UpdateInterval    = 30;
+static constexpr uint64_t SecondsPerPercent = 150;
+static constexpr int      Threshold         = 10;
+
+static DischargeRun discharge(bool notifying) {
+	Watch w;
+	watch = &w;
+	FakeSource battery;
+	battery.percent = 100;
+	battery.current = battery.maximum = 6000;
+	w.add(&battery);
+
+	AutoHibernate::Options options {};
+	options.minimalRemainingCapacity = Threshold;
+	DischargePredictor predictor;
+
+	DischargeRun run {};
+	uint64_t due = w.nextCheckDelay(options, predictor, 0) / 1000;
+	uint64_t reached = 0;
+	for (uint64_t now = 1; run.detected == 0; now++) {
+		bool check = false;
+		if (now % UpdateInterval == 0) {
+			int percent = 100 - static_cast<int>(now / SecondsPerPercent);
+			if (percent != battery.percent) {
+				battery.percent = percent;
+				battery.current = battery.maximum * percent / 100;
+				if (percent <= Threshold && reached == 0)
+					reached = now;
+				if (notifying) {
+					// IOPMPowerSource_statusChanged: the check runs right away on workLoop
+					w.notified(&battery);
+					run.notifications++;
+					check = true;
+				}
+			}
+		}
+
+		if (now >= due) {
+			run.wakeups++;
+			check = true;
+		}
+
+		if (!check)
+			continue;
+
+		// checkCapacity
+		AutoHibernate::PowerSnapshot power {};
+		w.capture(power);
+		predictor.add(now, power.capacityPercentRemaining);
+		if (AutoHibernate::evaluateCapacity(options, power) != AutoHibernate::Reason::None) {
+			run.detected = now;
+			run.latency = now - reached;
+		}
+		due = now + w.nextCheckDelay(options, predictor, now) / 1000;
+	}
+
+	w.clear(release);
+	return run;
+}
+
+static void testDischarge() {
+	DischargeRun polled = discharge(false);
+	DischargeRun notified = discharge(true);
+
+	double polledRate = polled.wakeups * 3600.0 / polled.detected;
+	double notifiedRate = notified.wakeups * 3600.0 / notified.detected;
+	printf("polled battery: threshold detected after %llu s, %.1f timer wakeups per hour\n",
+		   static_cast<unsigned long long>(polled.latency), polledRate);
+	printf("notifying battery: threshold detected after %llu s, %.1f timer wakeups per hour, %.1f notifications per hour\n",
+		   static_cast<unsigned long long>(notified.latency), notifiedRate, notified.notifications * 3600.0 / notified.detected);
+
+	// a notification is checked at once, the timer only covers drivers which stopped notifying
+	CHECK(notified.latency == 0);
+	CHECK(notifiedRate < polledRate);
+	// predicted checks are denser close to the threshold, it is never missed by more than the minimal interval
+	CHECK(polled.latency <= Watch::MinInterval / 1000 + UpdateInterval);
+	// fixed 60 second polling would wake up 60 times per hour
+	CHECK(polledRate < 3600.0 / (Watch::PollInterval / 1000));
+}
+
+int main()
+{
+	testReads();
+	testMidCapture();
+	testPerSource();
+	testDischarge();
+	return report("power source watch");
+}
@@ -0,0 +1,127 @@
+//
+//  test_rtcprobe.cpp
+//  HibernationFixup host tests
+//
+//  RTCBankProbe against a simulated CMOS (index/data ports of both banks): port I/O per 1000 sleep cycles
+//  with and without the cache, re-probe after hibernation wake, firmware switching the second bank off.
+//
+
+#include "check.hpp"
+#include "kern_rtcprobe.hpp"
+
+/**
+ *  CMOS behind ports 0x70/0x71 (first bank) and 0x72/0x73 (second bank).
+ *  A missing second bank ignores writes and reads as 0xFF like an unconnected bus.
+ */
+struct CMOS {
+	uint8_t bank[2][128] {};
+	uint8_t index[2] {};
+	bool secondBank {true};
+	bool accessible {true};
+	long io {0};
+
+	void out(uint16_t port, uint8_t value) {
+		io++;
+		int b = (port - 0x70) / 2;
+		if (b == 1 && !secondBank)
+			return;
+		if (port % 2 == 0)
+			index[b] = value & 0x7F;
+		else
+			bank[b][index[b]] = value;
+	}
+
+	uint8_t in(uint16_t port) {
+		io++;
+		int b = (port - 0x70) / 2;
+		if (b == 1 && !secondBank)
+			return 0xFF;
+		return port % 2 == 0 ? index[b] : bank[b][index[b]];
+	}
+};
+
+static CMOS cmos;
+
+/**
+ *  RTCStorage counterpart: init reads status register A, the check flips a byte of the second bank and restores it
+ */
+struct SimulatedRTC {
+	static constexpr uint8_t StatusA = 0x0A;
+	static constexpr uint8_t TestRegister = 0x40;
+
+	bool init() {
+		cmos.out(0x70, StatusA);
+		cmos.in(0x71);
+		return cmos.accessible;
+	}
+
+	bool checkExtendedMemory() {
+		cmos.out(0x72, TestRegister);
+		uint8_t saved = cmos.in(0x73);
+		cmos.out(0x73, static_cast<uint8_t>(~saved));
+		bool result = cmos.in(0x73) == static_cast<uint8_t>(~saved);
+		cmos.out(0x73, saved);
+		return result;
+	}
+
+	void deinit() {}
+};
+
+static constexpr int Cycles = 1000;
+static constexpr int HibernateEvery = 25;
+
+/**
+ *  Sleep cycles: every sleep checks the second bank at pre-arm, every HibernateEvery-th sleep ends
+ *  with wake from hibernation
+ *
+ *  @param cached  cache is used, otherwise every sleep probes RTC as before the cache
+ *
+ *  @return port I/O of all cycles
+ */
+static long sleepCycles(bool cached, RTCBankProbe<SimulatedRTC> &probe)
+{
+	long start = cmos.io;
+	for (int cycle = 1; cycle <= Cycles; cycle++) {
+		CHECK_CASE(probe.available() == cmos.secondBank, "cycle", cycle);
+		if (!cached || cycle % HibernateEvery == 0)
+			probe.invalidate();
+	}
+	return cmos.io - start;
+}
+
+//==============================================================================
+
+int main()
+{
+	RTCBankProbe<SimulatedRTC> uncached;
+	long uncachedIO = sleepCycles(false, uncached);
+	CHECK(uncached.probes() == Cycles);
+
+	RTCBankProbe<SimulatedRTC> probe;
+	long cachedIO = sleepCycles(true, probe);
+	// the first sleep and every sleep after wake from hibernation probe
+	CHECK(probe.probes() == 1 + (Cycles - 1) / HibernateEvery);
+	// RTC ports are accessed only by probes
+	CHECK(cachedIO == uncachedIO / Cycles * probe.probes());
+
+	// firmware switched the second bank off while the system was hibernated
+	cmos.secondBank = false;
+	probe.invalidate();
+	CHECK(!probe.available() && !probe.available());
+	uint32_t probes = probe.probes();
+	cmos.secondBank = true;
+	CHECK(!probe.available() && probe.probes() == probes);
+
+	// RTC which can't be initialized is probed again
+	cmos.accessible = false;
+	probe.invalidate();
+	CHECK(!probe.available() && !probe.available() && probe.probes() == probes + 2);
+	cmos.accessible = true;
+	CHECK(probe.available() && probe.available() && probe.probes() == probes + 3);
+
+	// probing leaves CMOS contents unchanged
+	CHECK(cmos.bank[1][SimulatedRTC::TestRegister] == 0);
+
+	return report("port I/O per %d sleep cycles: %ld without cache, %ld with cache (hibernation every %d sleeps)",
+				  Cycles, uncachedIO, cachedIO, HibernateEvery);
+}
@@ -0,0 +1,122 @@
+//
+//  test_sleephist.cpp
+//  HibernationFixup host tests
+//
+//  SleepDurationPredictor buckets, pooling of neighbouring hours and saved state.
+//
+
+#include <string.h>
+
+#include "check.hpp"
+#include "kern_sleephist.hpp"
+
+static constexpr uint64_t Hour = 3600;
+
+static void testBuckets()
+{
+	using P = SleepDurationPredictor;
+	for (size_t i = 1; i < P::Buckets; i++) {
+		CHECK(P::bucketOf(P::bucketStart(i)) == i);
+		CHECK(P::bucketOf(P::bucketStart(i) - 1) == i - 1);
+	}
+}
+
+static void testPrediction()
+{
+	SleepDurationPredictor p;
+	// not enough samples
+	for (int i = 0; i < 3; i++)
+		p.add(2, 23, 8 * Hour);
+	CHECK(!p.predictLonger(2, 23, 3 * Hour, 80));
+	p.add(2, 23, 8 * Hour);
+	CHECK(p.predictLonger(2, 23, 3 * Hour, 80));
+	// only buckets entirely above the minimum count
+	CHECK(!p.predictLonger(2, 23, 9 * Hour, 80));
+	// one short sleep out of five is still 80%
+	p.add(2, 23, 20 * 60);
+	CHECK(p.predictLonger(2, 23, 3 * Hour, 80));
+	p.add(2, 23, 20 * 60);
+	CHECK(!p.predictLonger(2, 23, 3 * Hour, 80));
+	CHECK(!p.predictLonger(7, 0, 0, 0) && !p.predictLonger(0, 24, 0, 0));
+}
+
+static void testPooling()
+{
+	SleepDurationPredictor p;
+	// sleeps start around midnight: 2 before it on Monday, 2 after it on Tuesday
+	p.add(1, 23, 8 * Hour);
+	p.add(1, 23, 7 * Hour);
+	p.add(2, 0, 8 * Hour);
+	p.add(2, 0, 9 * Hour);
+	CHECK(p.predictLonger(1, 23, 3 * Hour, 80));
+	CHECK(p.predictLonger(2, 0, 3 * Hour, 80));
+	// two hours away is not pooled
+	CHECK(!p.predictLonger(2, 1, 3 * Hour, 80));
+	// Saturday 23:00 is pooled with Sunday 0:00
+	p.add(0, 0, 8 * Hour);
+	p.add(0, 0, 8 * Hour);
+	p.add(6, 22, 8 * Hour);
+	p.add(6, 22, 8 * Hour);
+	CHECK(p.predictLonger(6, 23, 3 * Hour, 80));
+
+	// a slot with enough own samples is not diluted by its neighbours
+	for (int i = 0; i < 4; i++)
+		p.add(3, 12, 30 * 60);
+	for (int i = 0; i < 20; i++)
+		p.add(3, 13, 8 * Hour);
+	CHECK(!p.predictLonger(3, 12, 3 * Hour, 80));
+	CHECK(p.predictLonger(3, 13, 3 * Hour, 80));
+}
+
+static void testState()
+{
+	SleepDurationPredictor p;
+	for (int i = 0; i < 5; i++)
+		p.add(4, 22, 8 * Hour);
+	p.add(5, 7, 10 * 60);
+
+	uint8_t state[SleepDurationPredictor::StateSize];
+	p.save(state);
+	CHECK(state[0] == 'H' && state[1] == 'B' && state[2] == 'S' && state[3] == 'H');
+
+	SleepDurationPredictor restored;
+	CHECK(restored.merge(state, sizeof(state)));
+	CHECK(restored.predictLonger(4, 22, 3 * Hour, 80));
+	uint8_t copy[SleepDurationPredictor::StateSize];
+	restored.save(copy);
+	CHECK(memcmp(state, copy, sizeof(state)) == 0);
+
+	// durations learned before the state was loaded are kept
+	SleepDurationPredictor merged;
+	for (int i = 0; i < 3; i++)
+		merged.add(4, 22, 20 * 60);
+	CHECK(merged.merge(state, sizeof(state)));
+	CHECK(!merged.predictLonger(4, 22, 3 * Hour, 80));
+
+	// other layouts are rejected
+	CHECK(!restored.merge(state, sizeof(state) - 1));
+	CHECK(!restored.merge(nullptr, sizeof(state)));
+	state[0] ^= 1;
+	CHECK(!restored.merge(state, sizeof(state)));
+
+	// saturated counters are halved
+	SleepDurationPredictor full;
+	for (int i = 0; i < 300; i++)
+		full.add(1, 1, 8 * Hour);
+	full.add(1, 1, 10 * 60);
+	full.save(copy);
+	size_t slot = sizeof(uint32_t) + (24 + 1) * SleepDurationPredictor::Buckets;
+	CHECK(copy[slot + SleepDurationPredictor::bucketOf(8 * Hour)] == 172 && copy[slot] == 1);
+	CHECK(full.merge(copy, sizeof(copy)));
+	full.save(state);
+	CHECK(state[slot + SleepDurationPredictor::bucketOf(8 * Hour)] == 172 && state[slot] == 1);
+}
+
+int main()
+{
+	testBuckets();
+	testPrediction();
+	testPooling();
+	testState();
+	return report("sleep duration prediction");
+}
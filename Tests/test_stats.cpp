@@ -0,0 +1,82 @@
+//
+//  test_stats.cpp
+//  HibernationFixup host tests
+//
+//  Log2Histogram buckets and DeviceRestoreStats accounting.
+//
+
+#include "check.hpp"
+#include "kern_stats.hpp"
+
+static void testHistogram()
+{
+	using Histogram = Log2Histogram<20>;
+	CHECK(Histogram::bucketOf(0) == 0);
+	CHECK(Histogram::bucketOf(1) == 0);
+	CHECK(Histogram::bucketOf(2) == 1);
+	CHECK(Histogram::bucketOf(3) == 1);
+	CHECK(Histogram::bucketOf(4) == 2);
+	for (size_t i = 1; i < Histogram::Buckets; i++) {
+		CHECK(Histogram::bucketOf(1ULL << i) == i);
+		CHECK(Histogram::bucketOf((1ULL << (i + 1)) - 1) == i);
+	}
+	// the last bucket counts everything above
+	CHECK(Histogram::bucketOf(1ULL << 40) == Histogram::Buckets - 1);
+	CHECK(Histogram::bucketOf(UINT64_MAX) == Histogram::Buckets - 1);
+
+	Histogram histogram;
+	const uint64_t values[] {0, 1, 5, 7, 1000, 1ULL << 30};
+	uint64_t total = 0;
+	for (auto value : values) {
+		histogram.add(value);
+		total += value;
+	}
+	CHECK(histogram.count == 6);
+	CHECK(histogram.total == total);
+	CHECK(histogram.maximum == 1ULL << 30);
+	CHECK(histogram.bucket[0] == 2 && histogram.bucket[2] == 2 && histogram.bucket[9] == 1 && histogram.bucket[19] == 1);
+	uint32_t counted = 0;
+	for (auto bucket : histogram.bucket)
+		counted += bucket;
+	CHECK(counted == histogram.count);
+}
+
+static void testDeviceStats()
+{
+	static DeviceRestoreStats stats;
+	int devices[DeviceRestoreStats::MaxDevices + 4] {};
+
+	// a device is added once, by the first record
+	CHECK(stats.recordRestore(&devices[0], 10));
+	CHECK(!stats.recordRestore(&devices[0], 30));
+	CHECK(!stats.recordInjection(&devices[0]));
+	CHECK(stats.recordInjection(&devices[1]));
+	CHECK(!stats.recordRestore(&devices[1], 1));
+	CHECK(!stats.recordRestore(nullptr, 1) && !stats.recordInjection(nullptr));
+	CHECK(stats.count() == 2);
+
+	const DeviceRestoreStats::Device &first = stats.device(0);
+	CHECK(first.device == &devices[0]);
+	CHECK(first.restoreUS.count == 2 && first.restoreUS.total == 40 && first.restoreUS.maximum == 30);
+	CHECK(first.memorySpaceInjected == 1);
+	const DeviceRestoreStats::Device &second = stats.device(1);
+	CHECK(second.device == &devices[1] && second.restoreUS.count == 1 && second.memorySpaceInjected == 1);
+
+	// records of devices which do not fit are dropped, known devices are still accounted
+	size_t added = 0;
+	for (auto &device : devices)
+		added += stats.recordRestore(&device, 100);
+	CHECK(added == DeviceRestoreStats::MaxDevices - 2);
+	CHECK(stats.count() == DeviceRestoreStats::MaxDevices);
+	CHECK(stats.dropped() == 4);
+	CHECK(!stats.recordInjection(&devices[DeviceRestoreStats::MaxDevices]));
+	CHECK(stats.dropped() == 5);
+	CHECK(stats.device(0).restoreUS.count == 3 && stats.device(DeviceRestoreStats::MaxDevices - 1).restoreUS.count == 1);
+}
+
+int main()
+{
+	testHistogram();
+	testDeviceStats();
+	return report("statistics");
+}